@@ -0,0 +1,552 @@
+/*
+ * gdibitmap - bit-level operations on packed 1-bit pages
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gdibitmap.h"
+
+/* Clear the bits past the right edge of a row */
+static void clear_tail(unsigned char *row, unsigned int width)
+{
+    if (width % 8)
+        row[GDI_BITMAP_STRIDE(width) - 1] &= 0xff << (8 - width % 8);
+}
+
+void gdi_bitmap_or_bits(unsigned char *dst, size_t dst_len, size_t dst_bit,
+                        const unsigned char *src, size_t src_len, size_t src_bit,
+                        size_t n)
+{
+    unsigned int s = src_bit % 8, t = dst_bit % 8;
+    const unsigned char *sp = src + src_bit / 8;
+    unsigned char *dp = dst + dst_bit / 8;
+    size_t src_left = src_len - src_bit / 8;
+    size_t dst_left = dst_len - dst_bit / 8;
+
+    /* A byte of the source bit stream at a time, spread over one or
+     * two destination bytes */
+    for (size_t k = 0; n > 0 && k < src_left; k++) {
+        unsigned int v = (unsigned int)sp[k] << s;
+        if (s && k + 1 < src_left) v |= sp[k + 1] >> (8 - s);
+        v &= 0xff;
+        if (n < 8) {
+            v &= 0xff << (8 - n);
+            n = 0;
+        } else {
+            n -= 8;
+        }
+        if (k < dst_left) dp[k] |= v >> t;
+        if (t && k + 1 < dst_left) dp[k + 1] |= (v << (8 - t)) & 0xff;
+    }
+}
+
+unsigned char *gdi_bitmap_double(const unsigned char *src, unsigned int width,
+                                 unsigned int height)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    size_t out_stride = GDI_BITMAP_STRIDE(2 * (size_t)width);
+    unsigned char *dst = calloc(out_stride, 2 * (size_t)height);
+    if (!dst) return NULL;
+
+    /* Each byte widened to a word with every bit twice */
+    uint16_t spread[256];
+    for (unsigned int b = 0; b < 256; b++) {
+        uint16_t w = 0;
+        for (int i = 0; i < 8; i++)
+            if (b & (0x80 >> i)) w |= 0xc000 >> (2 * i);
+        spread[b] = w;
+    }
+
+    for (unsigned int y = 0; y < height; y++) {
+        const unsigned char *s = src + (size_t)y * stride;
+        unsigned char *d = dst + 2 * (size_t)y * out_stride;
+        for (size_t x = 0; x < stride; x++) {
+            uint16_t w = spread[s[x]];
+            d[2 * x] = w >> 8;
+            if (2 * x + 1 < out_stride) d[2 * x + 1] = w & 0xff;
+        }
+        clear_tail(d, 2 * width);
+        memcpy(d + out_stride, d, out_stride);
+    }
+    return dst;
+}
+
+unsigned char *gdi_bitmap_halve(const unsigned char *src, unsigned int width,
+                                unsigned int height, int majority)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    unsigned int out_width = (width + 1) / 2, out_height = (height + 1) / 2;
+    size_t out_stride = GDI_BITMAP_STRIDE(out_width);
+    unsigned char *dst = calloc(out_stride ? out_stride : 1, out_height ? out_height : 1);
+    unsigned char *blank = calloc(1, stride ? stride : 1);
+    if (!dst || !blank) {
+        free(dst);
+        free(blank);
+        return NULL;
+    }
+
+    /* For each pair of bits in a byte, one bit of a nibble: set if
+     * either bit is (any) or if both are (both) */
+    unsigned char any[256], both[256];
+    for (unsigned int b = 0; b < 256; b++) {
+        any[b] = both[b] = 0;
+        for (int i = 0; i < 4; i++) {
+            unsigned int pair = (b >> (6 - 2 * i)) & 3;
+            if (pair) any[b] |= 8 >> i;
+            if (pair == 3) both[b] |= 8 >> i;
+        }
+    }
+
+    for (unsigned int y = 0; y < out_height; y++) {
+        const unsigned char *a = src + 2 * (size_t)y * stride;
+        const unsigned char *b = 2 * y + 1 < height ? a + stride : blank;
+        unsigned char *d = dst + (size_t)y * out_stride;
+        for (size_t x = 0; x < out_stride; x++) {
+            unsigned int a0 = a[2 * x], b0 = b[2 * x];
+            unsigned int a1 = 2 * x + 1 < stride ? a[2 * x + 1] : 0;
+            unsigned int b1 = 2 * x + 1 < stride ? b[2 * x + 1] : 0;
+            if (majority) {
+                /* Two of four: both pixels of a column, or one in each
+                 * column */
+                d[x] = (any[a0 & b0] | both[a0 | b0]) << 4 |
+                       (any[a1 & b1] | both[a1 | b1]);
+            } else {
+                d[x] = any[a0 | b0] << 4 | any[a1 | b1];
+            }
+        }
+        clear_tail(d, out_width);
+    }
+    free(blank);
+    return dst;
+}
+
+unsigned char *gdi_bitmap_fit(const unsigned char *src, unsigned int width,
+                              unsigned int height, unsigned int new_width,
+                              unsigned int new_height)
+{
+    size_t out_stride = GDI_BITMAP_STRIDE(new_width);
+    unsigned char *dst = calloc(out_stride ? out_stride : 1, new_height ? new_height : 1);
+    if (!dst) return NULL;
+
+    gdi_bitmap_place(dst, new_width, new_height, src, width, height,
+                     ((long)new_width - (long)width) / 2,
+                     ((long)new_height - (long)height) / 2);
+    return dst;
+}
+
+void gdi_bitmap_place(unsigned char *dst, unsigned int dst_width, unsigned int dst_height,
+                      const unsigned char *src, unsigned int width, unsigned int height,
+                      long x, long y)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    size_t dst_stride = GDI_BITMAP_STRIDE(dst_width);
+    size_t src_bit = x < 0 ? (size_t)-x : 0;
+    size_t dst_bit = x > 0 ? (size_t)x : 0;
+    if (src_bit >= width || dst_bit >= dst_width) return;
+    size_t n = width - src_bit < dst_width - dst_bit ? width - src_bit : dst_width - dst_bit;
+
+    for (unsigned int sy = 0; sy < height; sy++) {
+        long dy = y + (long)sy;
+        if (dy < 0) continue;
+        if (dy >= (long)dst_height) break;
+        gdi_bitmap_or_bits(dst + (size_t)dy * dst_stride, dst_stride, dst_bit,
+                           src + (size_t)sy * stride, stride, src_bit, n);
+    }
+}
+
+/* Set n bits of a row from bit x */
+static void set_bits(unsigned char *row, size_t x, size_t n)
+{
+    for (; n > 0 && x % 8; x++, n--)
+        row[x / 8] |= 0x80 >> (x % 8);
+    memset(row + x / 8, 0xff, n / 8);
+    x += n / 8 * 8;
+    for (n %= 8; n > 0; x++, n--)
+        row[x / 8] |= 0x80 >> (x % 8);
+}
+
+void gdi_bitmap_frame(unsigned char *dst, unsigned int dst_width, unsigned int dst_height,
+                      unsigned int x, unsigned int y, unsigned int width,
+                      unsigned int height, unsigned int thickness)
+{
+    size_t dst_stride = GDI_BITMAP_STRIDE(dst_width);
+    if (x >= dst_width || y >= dst_height) return;
+    if (width > dst_width - x) width = dst_width - x;
+    if (height > dst_height - y) height = dst_height - y;
+    if (thickness > width / 2) thickness = (width + 1) / 2;
+    if (thickness > height / 2) thickness = (height + 1) / 2;
+
+    for (unsigned int i = 0; i < height; i++) {
+        unsigned char *row = dst + (size_t)(y + i) * dst_stride;
+        if (i < thickness || i >= height - thickness) {
+            set_bits(row, x, width);
+        } else {
+            set_bits(row, x, thickness);
+            set_bits(row, (size_t)x + width - thickness, thickness);
+        }
+    }
+}
+
+/* 16 bytes at a time; GCC and Clang compile this to SSE2 or NEON */
+typedef unsigned char vec16_t __attribute__((vector_size(16)));
+
+static void combine_row(unsigned char *dst, const unsigned char *src, size_t len,
+                        int knockout)
+{
+    size_t x = 0;
+    for (; x + 16 <= len; x += 16) {
+        vec16_t d, s;
+        memcpy(&d, dst + x, 16);
+        memcpy(&s, src + x, 16);
+        if (knockout)
+            d &= ~s;
+        else
+            d |= s;
+        memcpy(dst + x, &d, 16);
+    }
+    for (; x < len; x++) {
+        if (knockout)
+            dst[x] &= ~src[x];
+        else
+            dst[x] |= src[x];
+    }
+}
+
+void gdi_bitmap_overlay(unsigned char *dst, unsigned int width, unsigned int height,
+                        const unsigned char *src, unsigned int src_width,
+                        unsigned int src_height, int knockout)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    size_t src_stride = GDI_BITMAP_STRIDE(src_width);
+    size_t len = stride < src_stride ? stride : src_stride;
+    unsigned int rows = height < src_height ? height : src_height;
+
+    for (unsigned int y = 0; y < rows; y++) {
+        unsigned char *row = dst + (size_t)y * stride;
+        combine_row(row, src + (size_t)y * src_stride, len, knockout);
+        if (src_width > width)
+            clear_tail(row, width);
+    }
+}
+
+int gdi_bitmap_thin(unsigned char *page, unsigned int width, unsigned int height)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    size_t padded = stride + 32;
+
+    /* Unmodified copies of the rows above, at and below the one being
+     * thinned, with a white byte before and a vector's worth after so
+     * that the loads one byte either side stay inside */
+    unsigned char *buf = calloc(3, padded);
+    if (!buf) return -1;
+    unsigned char *above = buf + 1, *cur = buf + padded + 1, *below = buf + 2 * padded + 1;
+    if (height > 0) memcpy(cur, page, stride);
+    if (height > 1) memcpy(below, page + stride, stride);
+
+    for (unsigned int y = 0; y < height; y++) {
+        vec16_t keep;
+        memset(&keep, y % 2 ? 0x55 : 0xaa, sizeof(keep));
+        unsigned char *row = page + (size_t)y * stride;
+
+        for (size_t x = 0; x < stride; x += 16) {
+            vec16_t c, l, r, u, d;
+            memcpy(&c, cur + x, 16);
+            memcpy(&l, cur + x - 1, 16);
+            memcpy(&r, cur + x + 1, 16);
+            memcpy(&u, above + x, 16);
+            memcpy(&d, below + x, 16);
+
+            /* Black with black on all four sides */
+            vec16_t inner = c & (c >> 1 | l << 7) & (c << 1 | r >> 7) & u & d;
+            c &= ~inner | keep;
+            memcpy(row + x, &c, stride - x < 16 ? stride - x : 16);
+        }
+
+        unsigned char *t = above;
+        above = cur;
+        cur = below;
+        below = t;
+        if (y + 2 < height)
+            memcpy(below, page + (size_t)(y + 2) * stride, stride);
+        else
+            memset(below, 0, stride);
+    }
+    free(buf);
+    return 0;
+}
+
+/* Rows as big-endian 64-bit words, so the leftmost pixel is the high
+ * bit and a shift by one moves every pixel to its neighbour's place;
+ * a white word either side stands for the margins */
+static uint64_t from_be(uint64_t w)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(w);
+#else
+    return w;
+#endif
+}
+
+static void load_row(const unsigned char *row, size_t stride, uint64_t *words, size_t nwords)
+{
+    size_t full = stride / 8;
+    for (size_t i = 0; i < full; i++) {
+        uint64_t w;
+        memcpy(&w, row + 8 * i, 8);
+        words[i] = from_be(w);
+    }
+    if (full < nwords) {
+        uint64_t w = 0;
+        memcpy(&w, row + 8 * full, stride - 8 * full);
+        words[full] = from_be(w);
+    }
+}
+
+static void store_row(const uint64_t *words, unsigned char *row, size_t stride)
+{
+    size_t full = stride / 8;
+    for (size_t i = 0; i < full; i++) {
+        uint64_t w = from_be(words[i]);
+        memcpy(row + 8 * i, &w, 8);
+    }
+    if (stride % 8) {
+        uint64_t w = from_be(words[full]);
+        memcpy(row + 8 * full, &w, stride % 8);
+    }
+}
+
+/* Pixel to the left or right of each pixel, moved into its place */
+static uint64_t west(const uint64_t *r, size_t i) { return r[i] >> 1 | r[i - 1] << 63; }
+static uint64_t east(const uint64_t *r, size_t i) { return r[i] << 1 | r[i + 1] >> 63; }
+
+/* Of the eight neighbours of each pixel in word i of row c: whether any
+ * is black, and whether two or more are */
+static void neighbours(const uint64_t *a, const uint64_t *c, const uint64_t *b, size_t i,
+                       uint64_t *one, uint64_t *two)
+{
+    uint64_t n[8] = { west(a, i), a[i], east(a, i), west(c, i),
+                      east(c, i), west(b, i), b[i], east(b, i) };
+    uint64_t any = 0, more = 0;
+    for (int k = 0; k < 8; k++) {
+        more |= any & n[k];
+        any |= n[k];
+    }
+    *one = any;
+    *two = more;
+}
+
+long gdi_bitmap_despeckle(unsigned char *page, unsigned int width, unsigned int height,
+                          int level)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    size_t nwords = (stride + 7) / 8, row_words = nwords + 2;
+
+    /* Rolling windows: source rows y-1..y+2, and for pairs the rows
+     * y-1..y+1 of "black with at most one black neighbour" */
+    uint64_t *buf = calloc(8 * row_words, sizeof(uint64_t));
+    if (!buf) return -1;
+    uint64_t *blank = buf + 1;
+    uint64_t *src[4], *lonely[3];
+    for (int k = 0; k < 4; k++) src[k] = buf + (size_t)(1 + k) * row_words + 1;
+    for (int k = 0; k < 3; k++) lonely[k] = buf + (size_t)(5 + k) * row_words + 1;
+
+#define SRC(r)    ((r) < 0 || (r) >= (long)height ? blank : src[(r) % 4])
+#define LONELY(r) ((r) < 0 || (r) >= (long)height ? blank : lonely[(r) % 3])
+
+    long removed = 0, loaded = 0, marked = 0;
+    for (long y = 0; y < (long)height; y++) {
+        for (; loaded <= y + 2 && loaded < (long)height; loaded++)
+            load_row(page + (size_t)loaded * stride, stride, src[loaded % 4], nwords);
+
+        if (level >= 2) {
+            for (; marked <= y + 1 && marked < (long)height; marked++) {
+                const uint64_t *a = SRC(marked - 1), *c = SRC(marked), *b = SRC(marked + 1);
+                uint64_t *m = lonely[marked % 3];
+                for (size_t i = 0; i < nwords; i++) {
+                    uint64_t one, two;
+                    neighbours(a, c, b, i, &one, &two);
+                    m[i] = c[i] & ~two;
+                }
+            }
+        }
+
+        const uint64_t *a = SRC(y - 1), *c = SRC(y), *b = SRC(y + 1);
+        uint64_t out[8];
+        for (size_t i = 0; i < nwords; i++) {
+            uint64_t clear;
+            if (level >= 2) {
+                /* Lonely pixels with no neighbour that has company of its
+                 * own: single pixels and isolated pairs */
+                const uint64_t *ma = LONELY(y - 1), *mc = LONELY(y), *mb = LONELY(y + 1);
+                uint64_t xa[3], xc[3], xb[3];
+                for (int k = 0; k < 3; k++) {
+                    long j = (long)i + k - 1;
+                    xa[k] = a[j] & ~ma[j];
+                    xc[k] = c[j] & ~mc[j];
+                    xb[k] = b[j] & ~mb[j];
+                }
+                uint64_t crowd = west(xa + 1, 0) | xa[1] | east(xa + 1, 0) |
+                                 west(xc + 1, 0) | xc[1] | east(xc + 1, 0) |
+                                 west(xb + 1, 0) | xb[1] | east(xb + 1, 0);
+                clear = mc[i] & ~crowd;
+            } else {
+                uint64_t one, two;
+                neighbours(a, c, b, i, &one, &two);
+                clear = c[i] & ~one;
+            }
+            removed += __builtin_popcountll(clear);
+            out[i % 8] = c[i] & ~clear;
+            if (i % 8 == 7 || i + 1 == nwords) {
+                size_t first = i / 8 * 8;
+                size_t off = first * 8, n = stride - off < 64 ? stride - off : 64;
+                store_row(out, page + (size_t)y * stride + off, n);
+            }
+        }
+    }
+#undef SRC
+#undef LONELY
+    free(buf);
+    return removed;
+}
+
+unsigned long gdi_bitmap_count(const unsigned char *page, size_t size)
+{
+    unsigned long dots = 0;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, page + i, 8);
+        dots += __builtin_popcountll(w);
+    }
+    for (; i < size; i++)
+        dots += __builtin_popcount(page[i]);
+    return dots;
+}
+
+/* Rows of 8x8 blocks handled together when rotating, so the 64 source
+ * rows and the destination rows they fill stay in cache */
+#define ROTATE_TILE_ROWS 64
+
+/* Transpose an 8x8 bit matrix held as 8 rows of 8 bits, first row in
+ * the high byte: bit j of row i becomes bit i of row j */
+static uint64_t transpose8(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+    x ^= t ^ (t << 28);
+    return x;
+}
+
+/* 90 degrees: source row y becomes destination column height-1-y, so
+ * blocks of 8 rows are taken from the bottom up to keep destination
+ * bytes aligned; rows above the top are read as white. 270 degrees:
+ * row y becomes column y and column x row width-1-x. */
+static unsigned char *rotate_quarter(const unsigned char *src, unsigned int width,
+                                     unsigned int height, int clockwise)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    size_t out_stride = GDI_BITMAP_STRIDE(height);
+    unsigned char *dst = calloc(out_stride ? out_stride : 1, width ? width : 1);
+    if (!dst) return NULL;
+
+    size_t blocks = out_stride;     /* blocks of 8 source rows */
+    for (size_t tile = 0; tile < blocks; tile += ROTATE_TILE_ROWS / 8) {
+        size_t tile_end = tile + ROTATE_TILE_ROWS / 8;
+        if (tile_end > blocks) tile_end = blocks;
+        for (size_t bx = 0; bx < stride; bx++) {
+            for (size_t k = tile; k < tile_end; k++) {
+                long y0 = clockwise ? (long)height - 8 * (long)(k + 1) : 8 * (long)k;
+                uint64_t m = 0;
+                if (y0 >= 0 && y0 + 8 <= (long)height) {
+                    const unsigned char *p = src + (size_t)y0 * stride + bx;
+                    for (int i = 0; i < 8; i++)
+                        m = m << 8 | p[(size_t)(clockwise ? 7 - i : i) * stride];
+                } else {
+                    for (int i = 0; i < 8; i++) {
+                        long y = clockwise ? y0 + 7 - i : y0 + i;
+                        m <<= 8;
+                        if (y >= 0 && y < (long)height)
+                            m |= src[(size_t)y * stride + bx];
+                    }
+                }
+                if (!m) continue;   /* white, as dst already is */
+                m = transpose8(m);
+                for (int j = 0; j < 8; j++) {
+                    size_t x = 8 * bx + j;
+                    if (x >= width) break;
+                    size_t row = clockwise ? x : width - 1 - x;
+                    dst[row * out_stride + k] = (m >> (56 - 8 * j)) & 0xff;
+                }
+            }
+        }
+    }
+    for (unsigned int y = 0; y < width; y++)
+        clear_tail(dst + (size_t)y * out_stride, height);
+    return dst;
+}
+
+/* Reverse a row: bytes in reverse order with their bits reversed, then
+ * shifted left past what was the padding at the end */
+static void reverse_row(const unsigned char *row, unsigned int width,
+                        const unsigned char *reverse, unsigned char *scratch,
+                        unsigned char *dst)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    for (size_t x = 0; x < stride; x++)
+        scratch[x] = reverse[row[stride - 1 - x]];
+    if (width % 8 == 0)
+        memcpy(dst, scratch, stride);
+    else
+        gdi_bitmap_or_bits(dst, stride, 0, scratch, stride, 8 - width % 8, width);
+}
+
+static unsigned char *flip(const unsigned char *src, unsigned int width,
+                           unsigned int height, int upside_down)
+{
+    size_t stride = GDI_BITMAP_STRIDE(width);
+    unsigned char *dst = calloc(stride ? stride : 1, height ? height : 1);
+    unsigned char *scratch = malloc(stride ? stride : 1);
+    if (!dst || !scratch) {
+        free(dst);
+        free(scratch);
+        return NULL;
+    }
+
+    unsigned char reverse[256];
+    for (unsigned int b = 0; b < 256; b++) {
+        unsigned int r = 0;
+        for (int i = 0; i < 8; i++)
+            if (b & (1 << i)) r |= 0x80 >> i;
+        reverse[b] = r;
+    }
+
+    for (unsigned int y = 0; y < height; y++) {
+        unsigned int sy = upside_down ? height - 1 - y : y;
+        reverse_row(src + (size_t)sy * stride, width, reverse, scratch,
+                    dst + (size_t)y * stride);
+    }
+    free(scratch);
+    return dst;
+}
+
+unsigned char *gdi_bitmap_rotate(const unsigned char *src, unsigned int width,
+                                 unsigned int height, int degrees)
+{
+    switch (degrees) {
+    case 90:  return rotate_quarter(src, width, height, 1);
+    case 180: return flip(src, width, height, 1);
+    case 270: return rotate_quarter(src, width, height, 0);
+    default:  return NULL;
+    }
+}
+
+unsigned char *gdi_bitmap_mirror(const unsigned char *src, unsigned int width,
+                                 unsigned int height)
+{
+    return flip(src, width, height, 0);
+}
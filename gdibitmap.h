@@ -0,0 +1,86 @@
+/*
+ * gdibitmap - bit-level operations on packed 1-bit pages
+ *
+ * Pages are packed as everywhere else in the filter: 1 = black, the
+ * leftmost pixel in the high bit, rows of (width + 7) / 8 bytes. Every
+ * function returns a new calloc'd page (NULL on allocation failure)
+ * whose bits past the right edge are zero, and leaves src alone, except
+ * place, frame, overlay, thin and despeckle, which work on a page of the
+ * caller's.
+ */
+
+#ifndef GDIBITMAP_H
+#define GDIBITMAP_H
+
+#include <stddef.h>
+
+/* Row length in bytes */
+#define GDI_BITMAP_STRIDE(width) (((size_t)(width) + 7) / 8)
+
+/* Twice the size, every pixel becoming 2x2 (300 to 600 dpi) */
+unsigned char *gdi_bitmap_double(const unsigned char *src, unsigned int width,
+                                 unsigned int height);
+
+/* Half the size, rounded up (1200 to 600 dpi). A pixel is black if any
+ * of its 2x2 source pixels is, which keeps hairlines, or with majority
+ * set if at least two are. */
+unsigned char *gdi_bitmap_halve(const unsigned char *src, unsigned int width,
+                                unsigned int height, int majority);
+
+/* new_width x new_height with src centred on it: cropped equally on
+ * both sides where it is larger, padded with white where smaller */
+unsigned char *gdi_bitmap_fit(const unsigned char *src, unsigned int width,
+                              unsigned int height, unsigned int new_width,
+                              unsigned int new_height);
+
+/* OR src onto dst with its top left corner at (x, y), which may be off
+ * dst; whatever falls outside dst is clipped */
+void gdi_bitmap_place(unsigned char *dst, unsigned int dst_width, unsigned int dst_height,
+                      const unsigned char *src, unsigned int width, unsigned int height,
+                      long x, long y);
+
+/* Draw a black frame of this many pixels just inside the rectangle at
+ * (x, y), clipped to dst */
+void gdi_bitmap_frame(unsigned char *dst, unsigned int dst_width, unsigned int dst_height,
+                      unsigned int x, unsigned int y, unsigned int width,
+                      unsigned int height, unsigned int thickness);
+
+/* OR src over dst, or with knockout clear dst wherever src is black,
+ * both from their top left corners; only the overlap is touched */
+void gdi_bitmap_overlay(unsigned char *dst, unsigned int width, unsigned int height,
+                        const unsigned char *src, unsigned int src_width,
+                        unsigned int src_height, int knockout);
+
+/* Toner saving: clear every other pixel, in a checkerboard, of the
+ * black pixels whose four neighbours are black too, so solid areas
+ * print at half density inside unchanged outlines. Returns -1, with
+ * the page untouched, if memory runs out. */
+int gdi_bitmap_thin(unsigned char *page, unsigned int width, unsigned int height);
+
+/* Remove black pixels with no black pixel among their eight neighbours
+ * (level 1), and at level 2 also isolated pairs. Line ends, dots of an
+ * i and halftone dots of three or more pixels survive. Returns the
+ * number of pixels cleared, or -1, with the page untouched, if memory
+ * runs out. */
+long gdi_bitmap_despeckle(unsigned char *page, unsigned int width, unsigned int height,
+                          int level);
+
+/* Black pixels in size bytes of page, whose row padding must be clear */
+unsigned long gdi_bitmap_count(const unsigned char *page, size_t size);
+
+/* Turned clockwise by 90, 180 or 270 degrees; width and height swap
+ * for 90 and 270. NULL for any other angle. */
+unsigned char *gdi_bitmap_rotate(const unsigned char *src, unsigned int width,
+                                 unsigned int height, int degrees);
+
+/* Flipped left to right */
+unsigned char *gdi_bitmap_mirror(const unsigned char *src, unsigned int width,
+                                 unsigned int height);
+
+/* OR n bits of src starting at bit src_bit into dst starting at bit
+ * dst_bit; dst_len and src_len bound the rows */
+void gdi_bitmap_or_bits(unsigned char *dst, size_t dst_len, size_t dst_bit,
+                        const unsigned char *src, size_t src_len, size_t src_bit,
+                        size_t n);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * gdicapture - record production jobs for offline replay
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "gdicapture.h"
+#include "ricohgdi.h"
+
+struct gdi_capture {
+    gdi_capture_mode_t mode;
+    int fd;                     /* raster input */
+    char base[1024];            /* <dir>/<job>-<pid> */
+    FILE *job;
+    FILE *raster;               /* full mode */
+    int failed;                 /* a write failed; stop capturing, keep printing */
+    unsigned char sampled[GDI_CAPTURE_SAMPLES][PAGE_CACHE_KEY_LEN];
+    int samples;
+    int pages;
+};
+
+/* Captures hold job content, so only the owner may read them */
+static FILE *create_private(const char *path, const char *mode)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return NULL;
+    FILE *f = fdopen(fd, mode);
+    if (!f) close(fd);
+    return f;
+}
+
+/* Job arguments go on one line each; keep line breaks out of them */
+static void put_field(FILE *f, const char *name, const char *value)
+{
+    fprintf(f, "%s ", name);
+    for (const char *p = value ? value : ""; *p; p++)
+        fputc(*p == '\n' || *p == '\r' ? ' ' : *p, f);
+    fputc('\n', f);
+}
+
+static void hex(const unsigned char *data, size_t len, char *out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 15];
+    }
+    out[2 * len] = '\0';
+}
+
+gdi_capture_t *gdi_capture_open(const char *dir, gdi_capture_mode_t mode,
+                                int fd, char *argv[])
+{
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        gdi_log(LOG_ERR, "cannot create capture directory %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+
+    gdi_capture_t *cap = calloc(1, sizeof(*cap));
+    if (!cap) return NULL;
+    cap->mode = mode;
+    cap->fd = fd;
+    snprintf(cap->base, sizeof(cap->base), "%s/%s-%d", dir, argv[1], (int)getpid());
+
+    char path[1100];
+    snprintf(path, sizeof(path), "%s.job", cap->base);
+    cap->job = create_private(path, "w");
+    if (cap->job && mode == GDI_CAPTURE_FULL) {
+        snprintf(path, sizeof(path), "%s.ras", cap->base);
+        cap->raster = create_private(path, "w");
+    }
+    if (!cap->job || (mode == GDI_CAPTURE_FULL && !cap->raster)) {
+        gdi_log(LOG_ERR, "cannot create capture %s: %s", path, strerror(errno));
+        if (cap->job) fclose(cap->job);
+        free(cap);
+        return NULL;
+    }
+
+    const char *slash = strrchr(cap->base, '/');
+    fprintf(cap->job, "%s\n", GDI_CAPTURE_MAGIC);
+    fprintf(cap->job, "mode %s\n", mode == GDI_CAPTURE_FULL ? "full" : "hashes");
+    put_field(cap->job, "job", argv[1]);
+    put_field(cap->job, "user", argv[2]);
+    put_field(cap->job, "title", argv[3]);
+    put_field(cap->job, "copies", argv[4]);
+    put_field(cap->job, "options", argv[5]);
+    if (mode == GDI_CAPTURE_FULL)
+        fprintf(cap->job, "raster %s.ras\n", slash ? slash + 1 : cap->base);
+
+    gdi_log(LOG_INFO, "capturing job to %s.job", cap->base);
+    return cap;
+}
+
+/* Raster read callback that keeps a copy of everything it reads */
+static ssize_t tee_read(void *ctx, unsigned char *buf, size_t len)
+{
+    gdi_capture_t *cap = ctx;
+    ssize_t n;
+
+    do
+        n = read(cap->fd, buf, len);
+    while (n < 0 && errno == EINTR);
+
+    if (n > 0 && !cap->failed && fwrite(buf, 1, n, cap->raster) != (size_t)n) {
+        gdi_log(LOG_ERR, "capture write failed, job continues uncaptured: %s",
+                strerror(errno));
+        cap->failed = 1;
+    }
+    return n;
+}
+
+cups_raster_t *gdi_capture_raster(gdi_capture_t *cap)
+{
+    if (cap->mode == GDI_CAPTURE_FULL)
+        return cupsRasterOpenIO(tee_read, cap, CUPS_RASTER_READ);
+    return cupsRasterOpen(cap->fd, CUPS_RASTER_READ);
+}
+
+/* Write a stripe as a PBM file, the sample replay builds pages from */
+static int write_sample(gdi_capture_t *cap, const unsigned char *data,
+                        unsigned int width, unsigned int lines, char *name, size_t size)
+{
+    char path[1100];
+    const char *slash = strrchr(cap->base, '/');
+
+    snprintf(name, size, "%s-sample%d.pbm", slash ? slash + 1 : cap->base, cap->samples);
+    snprintf(path, sizeof(path), "%s-sample%d.pbm", cap->base, cap->samples);
+    FILE *f = create_private(path, "wb");
+    if (!f) return -1;
+    fprintf(f, "P4\n%u %u\n", width, lines);
+    fwrite(data, 1, (size_t)(width + 7) / 8 * lines, f);
+    return fclose(f);
+}
+
+void gdi_capture_page(gdi_capture_t *cap, const cups_page_header2_t *header,
+                      const unsigned char *bitmap, unsigned int width,
+                      unsigned int height)
+{
+    if (!cap || cap->mode != GDI_CAPTURE_HASHES || cap->failed) return;
+
+    size_t stride = (width + 7) / 8;
+    cap->pages++;
+    fprintf(cap->job, "page %u %u %u %u %u %u %u %u %u %s\n", width, height,
+            header->HWResolution[0], header->HWResolution[1],
+            header->PageSize[0], header->PageSize[1], header->MediaPosition,
+            header->cupsInteger[0], header->cupsInteger[1],
+            header->cupsPageSizeName[0] ? header->cupsPageSizeName : "-");
+
+    for (unsigned int y = 0; y < height; y += RGDI_STRIPE_LINES) {
+        unsigned int lines = height - y < RGDI_STRIPE_LINES ? height - y : RGDI_STRIPE_LINES;
+        const unsigned char *data = bitmap + (size_t)y * stride;
+        size_t size = stride * lines;
+        unsigned char key[PAGE_CACHE_KEY_LEN];
+        char key_hex[2 * PAGE_CACHE_KEY_LEN + 1];
+        unsigned long black = 0;
+
+        for (size_t i = 0; i < size; i++)
+            black += __builtin_popcount(data[i]);
+        page_cache_key(data, size, width, lines, "capture stripe", key);
+        hex(key, sizeof(key), key_hex);
+        fprintf(cap->job, "stripe %s %lu", key_hex, black);
+
+        /* Samples are picked by hash, about one distinct stripe in 64,
+         * so the choice is spread over the job but the same every run */
+        if (black > 0 && key[0] < 4) {
+            int known = -1;
+            for (int i = 0; i < cap->samples; i++)
+                if (memcmp(cap->sampled[i], key, sizeof(key)) == 0) known = i;
+            char name[1100];
+            const char *slash = strrchr(cap->base, '/');
+            if (known >= 0) {
+                snprintf(name, sizeof(name), "%s-sample%d.pbm",
+                         slash ? slash + 1 : cap->base, known);
+                fprintf(cap->job, " %s", name);
+            } else if (cap->samples < GDI_CAPTURE_SAMPLES &&
+                       write_sample(cap, data, width, lines, name, sizeof(name)) == 0) {
+                memcpy(cap->sampled[cap->samples++], key, sizeof(key));
+                fprintf(cap->job, " %s", name);
+            }
+        }
+        fputc('\n', cap->job);
+    }
+}
+
+void gdi_capture_close(gdi_capture_t *cap)
+{
+    if (!cap) return;
+    int failed = cap->failed;
+    if (cap->raster && fclose(cap->raster) != 0) failed = 1;
+    if (fclose(cap->job) != 0) failed = 1;
+    if (failed)
+        gdi_log(LOG_ERR, "capture %s is incomplete", cap->base);
+    else if (cap->mode == GDI_CAPTURE_HASHES)
+        gdi_log(LOG_INFO, "captured %d page(s) as hashes, %d sample stripe(s)",
+                cap->pages, cap->samples);
+    free(cap);
+}
@@ -0,0 +1,52 @@
+/*
+ * gdicapture - record production jobs for offline replay
+ *
+ * A full capture copies the raster stream, as the filter reads it, to
+ * <dir>/<job>-<pid>.ras. A hashed capture keeps no page content: for
+ * each page its size and settings, and for each 72-line stripe a hash
+ * and its number of black pixels, plus a few sample stripes as PBM
+ * files. Replay rebuilds such pages with the same stripe repetition
+ * and density, which is what the caches and the encoder respond to.
+ *
+ * Either way <dir>/<job>-<pid>.job holds the job's arguments and the
+ * page records; it is the file ricohgdi-replay is given.
+ */
+
+#ifndef GDICAPTURE_H
+#define GDICAPTURE_H
+
+#include <cups/cups.h>
+#include <cups/raster.h>
+
+/* Directory under $TMPDIR that captures are written to */
+#define GDI_CAPTURE_DIR "ricoh-capture"
+
+/* Sample stripes kept per job in hashed mode */
+#define GDI_CAPTURE_SAMPLES 8
+
+/* First line of a .job file */
+#define GDI_CAPTURE_MAGIC "ricoh-capture 1"
+
+typedef enum { GDI_CAPTURE_FULL, GDI_CAPTURE_HASHES } gdi_capture_mode_t;
+
+typedef struct gdi_capture gdi_capture_t;
+
+/* Start capturing the job whose raster arrives on fd; argv is the
+ * filter's. Returns NULL (after logging) if the files cannot be made,
+ * in which case the job simply runs uncaptured. */
+gdi_capture_t *gdi_capture_open(const char *dir, gdi_capture_mode_t mode,
+                                int fd, char *argv[]);
+
+/* Open the job's raster stream; in full mode it is copied as it is read */
+cups_raster_t *gdi_capture_raster(gdi_capture_t *cap);
+
+/* Record one page as converted to a packed 1-bit bitmap (hashed mode;
+ * a no-op in full mode) */
+void gdi_capture_page(gdi_capture_t *cap, const cups_page_header2_t *header,
+                      const unsigned char *bitmap, unsigned int width,
+                      unsigned int height);
+
+/* Finish the files; call after the raster stream is closed */
+void gdi_capture_close(gdi_capture_t *cap);
+
+#endif
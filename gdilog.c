@@ -0,0 +1,190 @@
+/*
+ * gdilog - level-gated, asynchronous logging for the filter
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include "gdilog.h"
+
+/* A slot is free for the writer whose position equals seq, and holds
+ * a message for the reader when seq is one past its position */
+typedef struct {
+    unsigned long seq;
+    int level;
+    char text[GDI_LOG_LINE];
+} slot_t;
+
+int gdi_log_level = LOG_DEBUG;
+
+static int buffering;
+static int to_stderr;
+static slot_t ring[GDI_LOG_RING];
+static unsigned long head;              /* next slot to fill */
+static unsigned long tail;              /* next slot to flush; flusher only */
+static unsigned long dropped;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static int flusher_state;               /* 0 none, 1 starting, 2 running */
+static int stopping;
+
+static const struct {
+    const char *name;
+    int level;
+} levels[] = {
+    { "none", -1 }, { "emerg", LOG_EMERG }, { "alert", LOG_ALERT },
+    { "crit", LOG_CRIT }, { "error", LOG_ERR }, { "warn", LOG_WARNING },
+    { "notice", LOG_NOTICE }, { "info", LOG_INFO }, { "debug", LOG_DEBUG },
+    { "debug2", LOG_DEBUG },
+};
+
+static void emit(int level, const char *text)
+{
+    if (to_stderr)
+        fprintf(stderr, "%s: %s\n", level <= LOG_ERR ? "ERROR" :
+                level == LOG_WARNING ? "WARNING" : "DEBUG", text);
+    else
+        syslog(level, "%s", text);
+}
+
+/* Hand every finished message to syslog; returns how many */
+static unsigned long drain(void)
+{
+    unsigned long n = 0;
+
+    for (;;) {
+        slot_t *s = &ring[tail % GDI_LOG_RING];
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            break;
+        emit(s->level, s->text);
+        __atomic_store_n(&s->seq, tail + GDI_LOG_RING, __ATOMIC_RELEASE);
+        tail++;
+        n++;
+    }
+
+    unsigned long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (lost) {
+        char text[64];
+        snprintf(text, sizeof(text), "log ring full, %lu message(s) dropped", lost);
+        emit(LOG_WARNING, text);
+    }
+    return n;
+}
+
+static void *flusher_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (!stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 200 * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wake, &lock, &until);
+        pthread_mutex_unlock(&lock);
+        drain();
+        pthread_mutex_lock(&lock);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void gdi_log_open(const char *ident)
+{
+    const char *env = getenv("RICOH_GDI_LOG");
+    size_t len = env ? strcspn(env, ",") : 0;
+
+    openlog(ident, LOG_PID, LOG_LPR);
+    gdi_log_level = LOG_WARNING;
+    for (size_t i = 0; len && i < sizeof(levels) / sizeof(levels[0]); i++)
+        if (strlen(levels[i].name) == len && strncasecmp(env, levels[i].name, len) == 0)
+            gdi_log_level = levels[i].level;
+    to_stderr = env && env[len] == ',' && strcasecmp(env + len + 1, "stderr") == 0;
+
+    for (unsigned long i = 0; i < GDI_LOG_RING; i++)
+        ring[i].seq = i;
+    head = tail = 0;
+    buffering = 1;
+    atexit(gdi_log_close);
+}
+
+void gdi_log_close(void)
+{
+    if (!buffering) return;
+    buffering = 0;
+
+    if (__atomic_load_n(&flusher_state, __ATOMIC_ACQUIRE) == 2) {
+        pthread_mutex_lock(&lock);
+        stopping = 1;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&lock);
+        pthread_join(flusher, NULL);
+        flusher_state = 0;
+        stopping = 0;
+    }
+    drain();
+    gdi_log_level = LOG_DEBUG;
+    closelog();
+}
+
+/* The flusher is only started once there is something to flush, so a
+ * job that logs nothing never has one */
+static void start_flusher(void)
+{
+    int none = 0;
+    if (!__atomic_compare_exchange_n(&flusher_state, &none, 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) == 0)
+        __atomic_store_n(&flusher_state, 2, __ATOMIC_RELEASE);
+}
+
+void gdi_log_write(int level, const char *format, ...)
+{
+    va_list ap;
+
+    if (!buffering) {
+        va_start(ap, format);
+        vsyslog(level, format, ap);
+        va_end(ap);
+        return;
+    }
+
+    /* Claim a slot; if the flusher is a whole ring behind, drop */
+    slot_t *s;
+    unsigned long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    for (;;) {
+        s = &ring[pos % GDI_LOG_RING];
+        long diff = (long)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+
+    s->level = level;
+    va_start(ap, format);
+    vsnprintf(s->text, sizeof(s->text), format, ap);
+    va_end(ap);
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&flusher_state, __ATOMIC_ACQUIRE) == 0)
+        start_flusher();
+    else if (pos % (GDI_LOG_RING / 2) == 0)
+        pthread_cond_signal(&wake);
+}
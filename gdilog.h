@@ -0,0 +1,47 @@
+/*
+ * gdilog - level-gated, asynchronous logging for the filter
+ *
+ * gdi_log() tests the level before its arguments are evaluated, so
+ * messages above the configured level cost one comparison. Messages that
+ * pass are formatted into a fixed ring without locks and handed to
+ * syslog (or stderr) by a background thread, started on the first
+ * message, and at gdi_log_close(); a full ring drops messages and
+ * counts them rather than blocking.
+ *
+ * The level comes from RICOH_GDI_LOG, which takes the names of the CUPS
+ * LogLevel directive (none, emerg, alert, crit, error, warn, notice,
+ * info, debug, debug2), optionally followed by ",stderr" to send the
+ * messages to cupsd's error_log as DEBUG:, WARNING: and ERROR: lines.
+ * Without it the level is warn, the CUPS default.
+ *
+ * Until gdi_log_open() is called, for instance in the daemon, messages
+ * go straight to syslog, as before.
+ */
+
+#ifndef GDILOG_H
+#define GDILOG_H
+
+#include <syslog.h>
+
+/* Messages that can wait before being flushed */
+#define GDI_LOG_RING 1024
+
+/* Longest message; the rest is cut off */
+#define GDI_LOG_LINE 256
+
+extern int gdi_log_level;
+
+#define gdi_log(level, ...) \
+    do { if ((level) <= gdi_log_level) gdi_log_write((level), __VA_ARGS__); } while (0)
+
+/* Read RICOH_GDI_LOG, open syslog as ident and start buffering */
+void gdi_log_open(const char *ident);
+
+/* Flush what is buffered, stop the flusher and close syslog. Also run
+ * at exit, so early returns from main() lose nothing. */
+void gdi_log_close(void);
+
+void gdi_log_write(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
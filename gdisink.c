@@ -0,0 +1,426 @@
+/*
+ * gdisink - output sinks and the page writer thread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "ricohgdi.h"
+
+/* Socket send buffer requested in raw socket mode. A whole compressed
+ * page usually fits, so writev() hands it to the kernel in one go. */
+#define RAW_SOCKET_SNDBUF (4 * 1024 * 1024)
+
+/* A busy printer is retried this often; waits are sliced so that a
+ * cancel is noticed within a slice */
+#define RETRY_SECS      5
+#define CANCEL_SLICE_MS 100
+
+/* How long a closing socket waits for the printer to close its side */
+#define DRAIN_MS        10000
+
+typedef enum { SINK_FD, SINK_SOCKET, SINK_MEMORY, SINK_CALLBACK } sink_kind_t;
+
+struct rgdi_sink {
+    sink_kind_t kind;
+    int fd;
+    rgdi_buffer_t memory;
+    rgdi_sink_fn fn;
+    void *ctx;
+};
+
+static rgdi_sink_t *sink_new(sink_kind_t kind)
+{
+    rgdi_sink_t *sink = calloc(1, sizeof(*sink));
+    if (!sink) {
+        gdi_log(LOG_ERR, "rastertericoh: memory allocation failed");
+        return NULL;
+    }
+    sink->kind = kind;
+    sink->fd = -1;
+    return sink;
+}
+
+rgdi_sink_t *rgdi_sink_fd(int fd)
+{
+    rgdi_sink_t *sink = sink_new(SINK_FD);
+    if (sink) sink->fd = fd;
+    return sink;
+}
+
+rgdi_sink_t *rgdi_sink_memory(void)
+{
+    return sink_new(SINK_MEMORY);
+}
+
+rgdi_sink_t *rgdi_sink_callback(rgdi_sink_fn fn, void *ctx)
+{
+    rgdi_sink_t *sink = sink_new(SINK_CALLBACK);
+    if (sink) {
+        sink->fn = fn;
+        sink->ctx = ctx;
+    }
+    return sink;
+}
+
+static int is_cancelled(const volatile sig_atomic_t *cancel)
+{
+    return cancel && *cancel;
+}
+
+/* connect() that gives up with ECANCELED once *cancel is set */
+static int connect_cancellable(int fd, const struct sockaddr *addr, socklen_t len,
+                               const volatile sig_atomic_t *cancel)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return connect(fd, addr, len);
+
+    int rc = connect(fd, addr, len);
+    if (rc < 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        for (;;) {
+            if (is_cancelled(cancel)) {
+                errno = ECANCELED;
+                break;
+            }
+            int n = poll(&pfd, 1, CANCEL_SLICE_MS);
+            if (n < 0 && errno != EINTR) break;
+            if (n > 0) {
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+                    err = errno;
+                if (err == 0)
+                    rc = 0;
+                else
+                    errno = err;
+                break;
+            }
+        }
+    }
+    int saved = errno;
+    fcntl(fd, F_SETFL, flags);
+    errno = saved;
+    return rc;
+}
+
+/* Connect to a raw socket printer given as "host", "host:port" or
+ * "[v6addr]:port". A busy printer refuses connections, so retry
+ * like the CUPS socket backend does, until *cancel is set. */
+static int open_raw_socket(const char *address, const volatile sig_atomic_t *cancel)
+{
+    char host[256];
+    const char *port = RGDI_RAW_SOCKET_PORT;
+    const char *colon;
+
+    if (address[0] == '[') {
+        const char *end = strchr(address, ']');
+        if (!end || (size_t)(end - address - 1) >= sizeof(host)) {
+            gdi_log(LOG_ERR, "bad socket address %s", address);
+            return -1;
+        }
+        memcpy(host, address + 1, end - address - 1);
+        host[end - address - 1] = '\0';
+        if (end[1] == ':') port = end + 2;
+    } else {
+        snprintf(host, sizeof(host), "%s", address);
+        colon = strchr(host, ':');
+        if (colon && !strchr(colon + 1, ':')) {
+            host[colon - host] = '\0';
+            port = address + (colon - host) + 1;
+        }
+    }
+
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        gdi_log(LOG_ERR, "cannot resolve %s: %s", address, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    for (int attempt = 0; fd < 0; attempt++) {
+        int err = 0;
+        for (ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {
+                err = errno;
+                continue;
+            }
+            if (connect_cancellable(fd, ai->ai_addr, ai->ai_addrlen, cancel) == 0)
+                break;
+            err = errno;
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0) break;
+        if (is_cancelled(cancel)) {
+            gdi_log(LOG_INFO, "connecting to %s cancelled", address);
+            freeaddrinfo(res);
+            return -1;
+        }
+        if (err != ECONNREFUSED && err != ETIMEDOUT && err != EHOSTUNREACH &&
+            err != ENETUNREACH && err != EHOSTDOWN) {
+            gdi_log(LOG_ERR, "cannot connect to %s: %s", address, strerror(err));
+            freeaddrinfo(res);
+            return -1;
+        }
+        if (attempt == 0)
+            gdi_log(LOG_INFO, "printer %s busy or unreachable (%s), retrying",
+                    address, strerror(err));
+        for (int ms = 0; ms < RETRY_SECS * 1000 && !is_cancelled(cancel);
+             ms += CANCEL_SLICE_MS)
+            usleep(CANCEL_SLICE_MS * 1000);
+    }
+    freeaddrinfo(res);
+
+    int sndbuf = RAW_SOCKET_SNDBUF;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    gdi_log(LOG_INFO, "connected to %s", address);
+    return fd;
+}
+
+rgdi_sink_t *rgdi_sink_socket(const char *address, const volatile sig_atomic_t *cancel)
+{
+    int fd = open_raw_socket(address, cancel);
+    if (fd < 0) return NULL;
+    rgdi_sink_t *sink = sink_new(SINK_SOCKET);
+    if (!sink) {
+        close(fd);
+        return NULL;
+    }
+    sink->fd = fd;
+    return sink;
+}
+
+/* Write an iovec array completely, restarting after partial writes */
+static int write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int rgdi_sink_write(rgdi_sink_t *sink, struct iovec *iov, int iovcnt)
+{
+    switch (sink->kind) {
+    case SINK_FD:
+    case SINK_SOCKET:
+        return write_all(sink->fd, iov, iovcnt);
+    case SINK_MEMORY:
+        for (int i = 0; i < iovcnt; i++) {
+            if (rgdi_buffer_append(&sink->memory, iov[i].iov_base, iov[i].iov_len) < 0) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        return 0;
+    case SINK_CALLBACK:
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len > 0 &&
+                sink->fn(sink->ctx, iov[i].iov_base, iov[i].iov_len) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+int rgdi_sink_write_page(rgdi_sink_t *sink, const rgdi_page_t *page)
+{
+    struct iovec iov[3] = {
+        { page->head.data, page->head.size },
+        { page->jbig, page->jbig_size },
+        { page->tail.data, page->tail.size },
+    };
+    return rgdi_sink_write(sink, iov, 3);
+}
+
+const unsigned char *rgdi_sink_memory_data(const rgdi_sink_t *sink, size_t *len)
+{
+    if (sink->kind != SINK_MEMORY) return NULL;
+    *len = sink->memory.size;
+    return sink->memory.data;
+}
+
+/* For sockets: tell the printer we are done and wait up to drain_ms
+ * in all for it to close its side, so the last page is not lost when
+ * we exit. */
+static void sink_close(rgdi_sink_t *sink, int drain_ms)
+{
+    if (!sink) return;
+    if (sink->kind == SINK_SOCKET) {
+        char drain[1024];
+        struct pollfd pfd = { sink->fd, POLLIN, 0 };
+        struct timespec start, now;
+        int left = drain_ms;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        shutdown(sink->fd, SHUT_WR);
+        while (left > 0 && poll(&pfd, 1, left) > 0 &&
+               read(sink->fd, drain, sizeof(drain)) > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = drain_ms - (int)((now.tv_sec - start.tv_sec) * 1000 +
+                                    (now.tv_nsec - start.tv_nsec) / 1000000);
+        }
+        close(sink->fd);
+    }
+    rgdi_buffer_free(&sink->memory);
+    free(sink);
+}
+
+void rgdi_sink_close(rgdi_sink_t *sink)
+{
+    sink_close(sink, DRAIN_MS);
+}
+
+void rgdi_sink_close_cancelled(rgdi_sink_t *sink)
+{
+    sink_close(sink, RGDI_CANCEL_DRAIN_MS);
+}
+
+static void *writer_main(void *arg)
+{
+    rgdi_writer_t *w = (rgdi_writer_t *)arg;
+    int written = 0;
+
+    gdi_trace_thread("writer");
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        while (!w->pending && !w->done)
+            pthread_cond_wait(&w->cond, &w->lock);
+        rgdi_page_t *page = w->pending;
+        w->pending = NULL;
+        w->busy = page != NULL;
+        int failed = w->failed;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+
+        if (!page) break;
+
+        uint64_t span = gdi_trace_begin();
+        if (page->jbig) gdi_trace_page(++written);
+        int rc = failed ? 0 : rgdi_sink_write_page(w->sink, page);
+        int error = errno;
+        gdi_trace_end(page->jbig ? "write page" : "write PJL", span, -1);
+        rgdi_page_free(page);
+
+        pthread_mutex_lock(&w->lock);
+        if (rc < 0) {
+            w->failed = 1;
+            w->error = error;
+        }
+        w->busy = 0;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+int rgdi_writer_start(rgdi_writer_t *w, rgdi_sink_t *sink)
+{
+    memset(w, 0, sizeof(*w));
+    w->sink = sink;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, writer_main, w) != 0) {
+        gdi_log(LOG_ERR, "rastertericoh: cannot start writer thread");
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        return -1;
+    }
+    return 0;
+}
+
+/* Hand a page to the writer. Blocks while the previous one is still
+ * queued, so at most one page waits behind the one being sent. */
+int rgdi_writer_submit(rgdi_writer_t *w, rgdi_page_t *page)
+{
+    /* Time spent here is the writer holding up the pipeline */
+    uint64_t span = gdi_trace_begin();
+    pthread_mutex_lock(&w->lock);
+    int stalled = w->pending && !w->failed;
+    while (w->pending && !w->failed)
+        pthread_cond_wait(&w->cond, &w->lock);
+    int failed = w->failed;
+    if (!failed) {
+        w->pending = page;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (stalled)
+        gdi_trace_end("wait for writer", span, -1);
+
+    if (failed) {
+        rgdi_page_free(page);
+        return -1;
+    }
+    return 0;
+}
+
+int rgdi_writer_sync(rgdi_writer_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    while ((w->pending || w->busy) && !w->failed)
+        pthread_cond_wait(&w->cond, &w->lock);
+    int failed = w->failed;
+    pthread_mutex_unlock(&w->lock);
+    return failed ? -1 : 0;
+}
+
+int rgdi_writer_cancel(rgdi_writer_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    rgdi_page_t *page = w->pending;
+    w->pending = NULL;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    rgdi_page_free(page);
+    return page ? 1 : 0;
+}
+
+/* Wait for all submitted pages to be written */
+int rgdi_writer_finish(rgdi_writer_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->done = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+
+    if (w->failed)
+        gdi_log(LOG_ERR, "write failed: %s", strerror(w->error));
+    return w->failed ? -1 : 0;
+}
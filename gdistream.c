@@ -0,0 +1,381 @@
+/*
+ * gdistream - reader for the Ricoh GDI byte stream (PJL + JBIG1)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <jbig.h>
+#include "gdistream.h"
+
+#define UEL "\033%-12345X"
+#define UEL_LEN 9
+
+ssize_t gdi_read_fd(void *ctx, void *buf, size_t len)
+{
+    int fd = *(int *)ctx;
+    ssize_t n;
+
+    do {
+        n = read(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+void gdi_stream_init(gdi_stream_t *s, gdi_read_fn read, void *ctx)
+{
+    memset(s, 0, sizeof(*s));
+    s->read = read;
+    s->ctx = ctx;
+}
+
+static int stream_error(gdi_stream_t *s, const char *fmt, const char *arg)
+{
+    char what[128];
+    snprintf(what, sizeof(what), fmt, arg);
+    snprintf(s->error, sizeof(s->error), "offset %zu: %s", s->offset, what);
+    return GDI_ERROR;
+}
+
+static int fill(gdi_stream_t *s)
+{
+    if (s->eof) return 0;
+    if (s->pos > 0) {
+        memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+        s->len -= s->pos;
+        s->pos = 0;
+    }
+    ssize_t n = s->read(s->ctx, s->buf + s->len, sizeof(s->buf) - s->len);
+    if (n < 0) return -1;
+    if (n == 0) s->eof = 1;
+    s->len += n;
+    return (int)(n > 0);
+}
+
+/* Read one line without its CR+LF. Returns the length, or -1 at end of
+ * stream with nothing left, -2 if the line is too long or -3 on a read
+ * error. The final line of a job, the closing UEL, has no line ending. */
+static int read_line(gdi_stream_t *s, char *line, size_t size)
+{
+    for (;;) {
+        unsigned char *start = s->buf + s->pos;
+        unsigned char *nl = memchr(start, '\n', s->len - s->pos);
+        size_t n;
+
+        if (nl || s->eof) {
+            if (!nl && s->pos == s->len) return -1;
+            n = nl ? (size_t)(nl - start) : s->len - s->pos;
+            if (n >= size) return -2;
+            memcpy(line, start, n);
+            s->pos += n + (nl ? 1 : 0);
+            s->offset += n + (nl ? 1 : 0);
+            if (n > 0 && line[n - 1] == '\r') n--;
+            line[n] = '\0';
+            return (int)n;
+        }
+        if (s->len - s->pos >= size) return -2;
+        if (fill(s) < 0) return -3;
+    }
+}
+
+/* Read exactly len bytes of binary data */
+static int read_data(gdi_stream_t *s, unsigned char *dst, size_t len)
+{
+    size_t have = s->len - s->pos;
+    if (have > len) have = len;
+    memcpy(dst, s->buf + s->pos, have);
+    s->pos += have;
+
+    /* Large remainders go straight to the destination */
+    size_t done = have;
+    while (done < len) {
+        ssize_t n = s->read(s->ctx, dst + done, len - done);
+        if (n <= 0) {
+            s->eof = 1;
+            s->offset += done;
+            return -1;
+        }
+        done += n;
+    }
+    s->offset += len;
+    return 0;
+}
+
+static void copy_value(char *dst, size_t size, const char *value)
+{
+    snprintf(dst, size, "%s", value);
+}
+
+int gdi_next(gdi_stream_t *s, gdi_page_t *page)
+{
+    char line[GDI_MAX_LINE];
+
+    for (;;) {
+        int n = read_line(s, line, sizeof(line));
+        if (n == -2)
+            return stream_error(s, "%s", "line too long");
+        if (n == -3)
+            return stream_error(s, "read error: %s", strerror(errno));
+        if (n == -1) {
+            if (s->in_page) return stream_error(s, "%s", "truncated page");
+            if (s->in_job) return stream_error(s, "%s", "job not terminated by @PJL EOJ");
+            return GDI_EOF;
+        }
+
+        char *p = line;
+        int uel = 0;
+        while (strncmp(p, UEL, UEL_LEN) == 0) {
+            p += UEL_LEN;
+            uel = 1;
+        }
+        if (uel) {
+            if (*p == '\0') continue;   /* closing UEL */
+            if (strcmp(p, "@PJL") != 0)
+                return stream_error(s, "unexpected text after UEL: %.40s", p);
+            if (s->in_job)
+                return stream_error(s, "%s", "new job started inside a job");
+            s->in_job = 1;
+            s->username[0] = '\0';
+            s->timestamp[0] = '\0';
+            return GDI_JOB_START;
+        }
+
+        if (*p == '\0') continue;
+        if (strncasecmp(p, "@PJL", 4) != 0)
+            return stream_error(s, "unexpected data: %.40s", p);
+        if (!s->in_job)
+            return stream_error(s, "%s", "PJL command outside a job");
+
+        if (strcasecmp(p, "@PJL EOJ") == 0 || strncasecmp(p, "@PJL EOJ ", 9) == 0) {
+            if (s->in_page) return stream_error(s, "%s", "EOJ inside a page");
+            s->in_job = 0;
+            return GDI_JOB_END;
+        }
+
+        if (strncasecmp(p, "@PJL SET ", 9) != 0)
+            continue;   /* other PJL commands carry nothing we model */
+
+        char *key = p + 9;
+        char *value = strchr(key, '=');
+        if (!value) continue;
+        *value++ = '\0';
+
+        if (strcasecmp(key, "USERNAME") == 0) {
+            copy_value(s->username, sizeof(s->username), value);
+        } else if (strcasecmp(key, "TIMESTAMP") == 0) {
+            copy_value(s->timestamp, sizeof(s->timestamp), value);
+        } else if (strcasecmp(key, "PAGESTATUS") == 0) {
+            if (strcasecmp(value, "START") == 0) {
+                if (s->in_page) return stream_error(s, "%s", "page started twice");
+                memset(page, 0, sizeof(*page));
+                page->dotcount = -1;
+                s->in_page = 1;
+            } else if (strcasecmp(value, "END") == 0) {
+                if (!s->in_page) return stream_error(s, "%s", "page end without start");
+                if (!page->data) return stream_error(s, "%s", "page without IMAGELEN");
+                s->in_page = 0;
+                return GDI_PAGE;
+            }
+        } else if (!s->in_page) {
+            continue;   /* job-level settings we do not track */
+        } else if (strcasecmp(key, "PAPER") == 0) {
+            copy_value(page->paper, sizeof(page->paper), value);
+        } else if (strcasecmp(key, "MEDIASOURCE") == 0) {
+            copy_value(page->mediasource, sizeof(page->mediasource), value);
+        } else if (strcasecmp(key, "MEDIATYPE") == 0) {
+            copy_value(page->mediatype, sizeof(page->mediatype), value);
+        } else if (strcasecmp(key, "PAPERWIDTH") == 0) {
+            page->width = (unsigned int)strtoul(value, NULL, 10);
+        } else if (strcasecmp(key, "PAPERLENGTH") == 0) {
+            page->height = (unsigned int)strtoul(value, NULL, 10);
+        } else if (strcasecmp(key, "RESOLUTION") == 0) {
+            page->resolution = atoi(value);
+        } else if (strcasecmp(key, "DOTCOUNT") == 0) {
+            page->dotcount = strtol(value, NULL, 10);
+        } else if (strcasecmp(key, "IMAGELEN") == 0) {
+            char *end;
+            unsigned long long len = strtoull(value, &end, 10);
+            if (*end != '\0' || len == 0 || len > GDI_MAX_IMAGELEN)
+                return stream_error(s, "bad IMAGELEN %s", value);
+            if (page->data)
+                return stream_error(s, "%s", "second IMAGELEN in one page");
+            page->data = malloc(len);
+            if (!page->data)
+                return stream_error(s, "%s", "out of memory");
+            page->imagelen = len;
+            if (read_data(s, page->data, len) < 0) {
+                gdi_page_free(page);
+                return stream_error(s, "%s", "stream ends inside JBIG data");
+            }
+        }
+    }
+}
+
+void gdi_page_free(gdi_page_t *page)
+{
+    free(page->data);
+    page->data = NULL;
+}
+
+int gdi_page_decode(const gdi_page_t *page, unsigned char **bitmap,
+                    char *err, size_t errlen)
+{
+    struct jbg_dec_state dec;
+    size_t cnt = 0;
+    int rc;
+
+    *bitmap = NULL;
+    jbg_dec_init(&dec);
+    rc = jbg_dec_in(&dec, page->data, page->imagelen, &cnt);
+    if (rc != JBG_EOK) {
+        snprintf(err, errlen, "JBIG decode: %s", jbg_strerror(rc));
+        jbg_dec_free(&dec);
+        return -1;
+    }
+    if (cnt != page->imagelen) {
+        snprintf(err, errlen, "%zu bytes after end of JBIG image",
+                 page->imagelen - cnt);
+        jbg_dec_free(&dec);
+        return -1;
+    }
+
+    unsigned long w = jbg_dec_getwidth(&dec);
+    unsigned long h = jbg_dec_getheight(&dec);
+    if (w != page->width || h != page->height) {
+        snprintf(err, errlen, "JBIG image is %lux%lu, PJL says %ux%u",
+                 w, h, page->width, page->height);
+        jbg_dec_free(&dec);
+        return -1;
+    }
+
+    size_t size = jbg_dec_getsize(&dec);
+    *bitmap = malloc(size);
+    if (!*bitmap) {
+        snprintf(err, errlen, "out of memory");
+        jbg_dec_free(&dec);
+        return -1;
+    }
+    memcpy(*bitmap, jbg_dec_getimage(&dec, 0), size);
+    jbg_dec_free(&dec);
+    return 0;
+}
+
+/* JBIG marker codes (T.82 section 6.2.6) */
+#define MARK_ESC     0xff
+#define MARK_STUFF   0x00
+#define MARK_SDNORM  0x02
+#define MARK_SDRST   0x03
+#define MARK_ABORT   0x04
+#define MARK_NEWLEN  0x05
+#define MARK_ATMOVE  0x06
+#define MARK_COMMENT 0x07
+
+#define BIH_LEN      20
+#define DPTABLE_LEN  1728
+
+static unsigned long get_be32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+           ((unsigned long)p[2] << 8) | p[3];
+}
+
+int gdi_bie_parse(const unsigned char *data, size_t len, gdi_bie_t *bie,
+                  char *err, size_t errlen)
+{
+    size_t cap = 0, pos, sde_start;
+
+    memset(bie, 0, sizeof(*bie));
+    if (len < BIH_LEN) {
+        snprintf(err, errlen, "BIE shorter than its header");
+        return -1;
+    }
+    if (data[0] != 0 || data[1] != 0 || data[2] != 1) {
+        snprintf(err, errlen, "BIE is not a single-plane, single-layer image");
+        return -1;
+    }
+    bie->width = get_be32(data + 4);
+    bie->height = get_be32(data + 8);
+    bie->l0 = get_be32(data + 12);
+    bie->mx = data[16];
+    bie->order = data[18];
+    bie->options = data[19];
+
+    pos = BIH_LEN;
+    if ((bie->options & JBG_DPON) && (bie->options & JBG_DPPRIV) &&
+        !(bie->options & JBG_DPLAST))
+        pos += DPTABLE_LEN;
+
+    sde_start = pos;
+    while (pos < len) {
+        if (data[pos] != MARK_ESC) {
+            pos++;
+            continue;
+        }
+        if (pos + 1 >= len) break;
+
+        int code = data[pos + 1];
+        size_t skip = 2;
+        switch (code) {
+        case MARK_STUFF:
+            break;
+        case MARK_SDNORM:
+        case MARK_SDRST:
+            if (bie->nstripes == cap) {
+                cap = cap ? cap * 2 : 128;
+                size_t *grown = realloc(bie->stripe_bytes, cap * sizeof(size_t));
+                if (!grown) {
+                    snprintf(err, errlen, "out of memory");
+                    gdi_bie_free(bie);
+                    return -1;
+                }
+                bie->stripe_bytes = grown;
+            }
+            bie->stripe_bytes[bie->nstripes++] = pos + 2 - sde_start;
+            if (code == MARK_SDRST) bie->sdrst++;
+            sde_start = pos + 2;
+            break;
+        case MARK_ABORT:
+            snprintf(err, errlen, "ABORT marker at BIE offset %zu", pos);
+            gdi_bie_free(bie);
+            return -1;
+        case MARK_NEWLEN:
+            if (pos + 6 > len) break;
+            bie->height = get_be32(data + pos + 2);
+            skip = 6;
+            sde_start = pos + skip;
+            break;
+        case MARK_ATMOVE:
+            skip = 8;
+            sde_start = pos + skip;
+            break;
+        case MARK_COMMENT:
+            if (pos + 6 > len) break;
+            skip = 6 + get_be32(data + pos + 2);
+            sde_start = pos + skip;
+            break;
+        default:
+            snprintf(err, errlen, "unknown marker 0x%02x at BIE offset %zu",
+                     code, pos);
+            gdi_bie_free(bie);
+            return -1;
+        }
+        pos += skip;
+    }
+
+    if (sde_start < len) {
+        snprintf(err, errlen, "%zu bytes after the last stripe", len - sde_start);
+        gdi_bie_free(bie);
+        return -1;
+    }
+    return 0;
+}
+
+void gdi_bie_free(gdi_bie_t *bie)
+{
+    free(bie->stripe_bytes);
+    bie->stripe_bytes = NULL;
+    bie->nstripes = 0;
+}
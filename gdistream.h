@@ -0,0 +1,96 @@
+/*
+ * gdistream - reader for the Ricoh GDI byte stream (PJL + JBIG1)
+ *
+ * Parses the UEL/PJL framing written by rastertericoh and hands back
+ * each page with its PJL settings and its IMAGELEN bytes of JBIG data.
+ * Used by the tools that consume a captured or live job stream.
+ */
+
+#ifndef GDISTREAM_H
+#define GDISTREAM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Longest PJL line accepted */
+#define GDI_MAX_LINE 1024
+
+/* Largest IMAGELEN accepted, to reject garbage before allocating */
+#define GDI_MAX_IMAGELEN (256u * 1024 * 1024)
+
+/* Values returned by gdi_next() */
+enum {
+    GDI_ERROR = -1,
+    GDI_EOF = 0,
+    GDI_JOB_START,      /* UEL + @PJL seen */
+    GDI_PAGE,           /* a complete page, PAGESTATUS=START..END */
+    GDI_JOB_END         /* @PJL EOJ seen */
+};
+
+/* Byte source: returns bytes read, 0 at end of stream, -1 on error */
+typedef ssize_t (*gdi_read_fn)(void *ctx, void *buf, size_t len);
+
+typedef struct {
+    char paper[32];
+    char mediasource[32];
+    char mediatype[32];
+    unsigned int width;         /* PAPERWIDTH */
+    unsigned int height;        /* PAPERLENGTH */
+    int resolution;
+    long dotcount;              /* -1 if not given */
+    size_t imagelen;
+    unsigned char *data;        /* imagelen bytes of BIE, caller frees */
+} gdi_page_t;
+
+typedef struct {
+    gdi_read_fn read;
+    void *ctx;
+    unsigned char buf[65536];
+    size_t pos, len;
+    int eof;
+    int in_job;
+    int in_page;
+    size_t offset;              /* stream bytes consumed so far */
+    char username[128];
+    char timestamp[64];
+    char error[160];
+} gdi_stream_t;
+
+/* Read callback for a plain file descriptor; ctx points to the fd */
+ssize_t gdi_read_fd(void *ctx, void *buf, size_t len);
+
+void gdi_stream_init(gdi_stream_t *s, gdi_read_fn read, void *ctx);
+
+/* Advance to the next job boundary or complete page. On GDI_PAGE the
+ * page is filled in and its data must be released with gdi_page_free().
+ * On GDI_ERROR s->error says what was wrong; gdi_page_free() is safe
+ * to call on the page either way. */
+int gdi_next(gdi_stream_t *s, gdi_page_t *page);
+
+void gdi_page_free(gdi_page_t *page);
+
+/* Decode the page's JBIG data with libjbig and check it against
+ * PAPERWIDTH/PAPERLENGTH. On success returns 0 and a malloc'd packed
+ * bitmap (1 = black, rows of (width + 7) / 8 bytes); otherwise -1 with
+ * a message in err. */
+int gdi_page_decode(const gdi_page_t *page, unsigned char **bitmap,
+                    char *err, size_t errlen);
+
+/* Layout of a single-layer BIE (JBIG bi-level image entity) */
+typedef struct {
+    unsigned long width, height;    /* XD, YD after any NEWLEN */
+    unsigned long l0;               /* lines per stripe */
+    int order, options, mx;
+    size_t nstripes;
+    size_t *stripe_bytes;           /* per stripe, including its end marker */
+    size_t sdrst;                   /* stripes ended by SDRST rather than SDNORM */
+} gdi_bie_t;
+
+/* Split a BIE into its stripes by walking the marker segments, without
+ * decoding. Returns 0, or -1 with a message in err. */
+int gdi_bie_parse(const unsigned char *data, size_t len, gdi_bie_t *bie,
+                  char *err, size_t errlen);
+
+void gdi_bie_free(gdi_bie_t *bie);
+
+#endif
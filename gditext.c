@@ -0,0 +1,347 @@
+/*
+ * gditext - plain text laid out straight into packed 1-bit pages
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "gditext.h"
+#include "gdibitmap.h"
+
+/* Glyph grid: 5 columns, 7 rows above the baseline and 2 below, in a
+ * cell of 6 x 10 with the spacing */
+#define FONT_FIRST  0x20
+#define FONT_LAST   0x7e
+#define FONT_WIDTH  5
+#define FONT_HEIGHT 9
+
+/* Rows of each printable ASCII character, top first, the leftmost
+ * pixel in bit 4 */
+static const unsigned char font[FONT_LAST - FONT_FIRST + 1][FONT_HEIGHT] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  /* ' ' */
+    { 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04, 0x00, 0x00 },  /* '!' */
+    { 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  /* '"' */
+    { 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a, 0x00, 0x00 },  /* '#' */
+    { 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04, 0x00, 0x00 },  /* '$' */
+    { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03, 0x00, 0x00 },  /* '%' */
+    { 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d, 0x00, 0x00 },  /* '&' */
+    { 0x04, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  /* '\'' */
+    { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02, 0x00, 0x00 },  /* '(' */
+    { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08, 0x00, 0x00 },  /* ')' */
+    { 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00, 0x00, 0x00 },  /* '*' */
+    { 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00, 0x00, 0x00 },  /* '+' */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08, 0x00 },  /* ',' */
+    { 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00, 0x00, 0x00 },  /* '-' */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c, 0x00, 0x00 },  /* '.' */
+    { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00, 0x00, 0x00 },  /* '/' */
+    { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e, 0x00, 0x00 },  /* '0' */
+    { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e, 0x00, 0x00 },  /* '1' */
+    { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f, 0x00, 0x00 },  /* '2' */
+    { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e, 0x00, 0x00 },  /* '3' */
+    { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02, 0x00, 0x00 },  /* '4' */
+    { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e, 0x00, 0x00 },  /* '5' */
+    { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e, 0x00, 0x00 },  /* '6' */
+    { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08, 0x00, 0x00 },  /* '7' */
+    { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e, 0x00, 0x00 },  /* '8' */
+    { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c, 0x00, 0x00 },  /* '9' */
+    { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00, 0x00, 0x00 },  /* ':' */
+    { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08, 0x00, 0x00 },  /* ';' */
+    { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02, 0x00, 0x00 },  /* '<' */
+    { 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00, 0x00, 0x00 },  /* '=' */
+    { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08, 0x00, 0x00 },  /* '>' */
+    { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04, 0x00, 0x00 },  /* '?' */
+    { 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e, 0x00, 0x00 },  /* '@' */
+    { 0x0e, 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x00, 0x00 },  /* 'A' */
+    { 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e, 0x00, 0x00 },  /* 'B' */
+    { 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e, 0x00, 0x00 },  /* 'C' */
+    { 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c, 0x00, 0x00 },  /* 'D' */
+    { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f, 0x00, 0x00 },  /* 'E' */
+    { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10, 0x00, 0x00 },  /* 'F' */
+    { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f, 0x00, 0x00 },  /* 'G' */
+    { 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11, 0x00, 0x00 },  /* 'H' */
+    { 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e, 0x00, 0x00 },  /* 'I' */
+    { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c, 0x00, 0x00 },  /* 'J' */
+    { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11, 0x00, 0x00 },  /* 'K' */
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f, 0x00, 0x00 },  /* 'L' */
+    { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11, 0x00, 0x00 },  /* 'M' */
+    { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11, 0x00, 0x00 },  /* 'N' */
+    { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e, 0x00, 0x00 },  /* 'O' */
+    { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10, 0x00, 0x00 },  /* 'P' */
+    { 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d, 0x00, 0x00 },  /* 'Q' */
+    { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11, 0x00, 0x00 },  /* 'R' */
+    { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e, 0x00, 0x00 },  /* 'S' */
+    { 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x00 },  /* 'T' */
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e, 0x00, 0x00 },  /* 'U' */
+    { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04, 0x00, 0x00 },  /* 'V' */
+    { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a, 0x00, 0x00 },  /* 'W' */
+    { 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11, 0x00, 0x00 },  /* 'X' */
+    { 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04, 0x00, 0x00 },  /* 'Y' */
+    { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f, 0x00, 0x00 },  /* 'Z' */
+    { 0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e, 0x00, 0x00 },  /* '[' */
+    { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00, 0x00, 0x00 },  /* '\\' */
+    { 0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e, 0x00, 0x00 },  /* ']' */
+    { 0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  /* '^' */
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f, 0x00 },  /* '_' */
+    { 0x08, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  /* '`' */
+    { 0x00, 0x00, 0x0e, 0x01, 0x0f, 0x11, 0x0f, 0x00, 0x00 },  /* 'a' */
+    { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1e, 0x00, 0x00 },  /* 'b' */
+    { 0x00, 0x00, 0x0e, 0x10, 0x10, 0x11, 0x0e, 0x00, 0x00 },  /* 'c' */
+    { 0x01, 0x01, 0x0d, 0x13, 0x11, 0x11, 0x0f, 0x00, 0x00 },  /* 'd' */
+    { 0x00, 0x00, 0x0e, 0x11, 0x1f, 0x10, 0x0e, 0x00, 0x00 },  /* 'e' */
+    { 0x06, 0x09, 0x08, 0x1c, 0x08, 0x08, 0x08, 0x00, 0x00 },  /* 'f' */
+    { 0x00, 0x00, 0x0f, 0x11, 0x11, 0x11, 0x0f, 0x01, 0x0e },  /* 'g' */
+    { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11, 0x00, 0x00 },  /* 'h' */
+    { 0x04, 0x00, 0x0c, 0x04, 0x04, 0x04, 0x0e, 0x00, 0x00 },  /* 'i' */
+    { 0x02, 0x00, 0x06, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c },  /* 'j' */
+    { 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12, 0x00, 0x00 },  /* 'k' */
+    { 0x0c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e, 0x00, 0x00 },  /* 'l' */
+    { 0x00, 0x00, 0x1a, 0x15, 0x15, 0x11, 0x11, 0x00, 0x00 },  /* 'm' */
+    { 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11, 0x00, 0x00 },  /* 'n' */
+    { 0x00, 0x00, 0x0e, 0x11, 0x11, 0x11, 0x0e, 0x00, 0x00 },  /* 'o' */
+    { 0x00, 0x00, 0x1e, 0x11, 0x11, 0x11, 0x1e, 0x10, 0x10 },  /* 'p' */
+    { 0x00, 0x00, 0x0f, 0x11, 0x11, 0x11, 0x0f, 0x01, 0x01 },  /* 'q' */
+    { 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10, 0x00, 0x00 },  /* 'r' */
+    { 0x00, 0x00, 0x0f, 0x10, 0x0e, 0x01, 0x1e, 0x00, 0x00 },  /* 's' */
+    { 0x08, 0x08, 0x1c, 0x08, 0x08, 0x09, 0x06, 0x00, 0x00 },  /* 't' */
+    { 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0d, 0x00, 0x00 },  /* 'u' */
+    { 0x00, 0x00, 0x11, 0x11, 0x11, 0x0a, 0x04, 0x00, 0x00 },  /* 'v' */
+    { 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0a, 0x00, 0x00 },  /* 'w' */
+    { 0x00, 0x00, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x00, 0x00 },  /* 'x' */
+    { 0x00, 0x00, 0x11, 0x11, 0x11, 0x11, 0x0f, 0x01, 0x0e },  /* 'y' */
+    { 0x00, 0x00, 0x1f, 0x02, 0x04, 0x08, 0x1f, 0x00, 0x00 },  /* 'z' */
+    { 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02, 0x00, 0x00 },  /* '{' */
+    { 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x00 },  /* '|' */
+    { 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08, 0x00, 0x00 },  /* '}' */
+    { 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00, 0x00, 0x00 },  /* '~' */
+};
+
+#define READ_SIZE 65536
+
+struct gdi_text {
+    int fd;
+    gdi_text_layout_t layout;
+    size_t stride, page_size;
+    /* Each character's cell as 64-bit rows, and the rows it inks */
+    uint64_t *glyphs;
+    unsigned int ink_top[FONT_LAST - FONT_FIRST + 1];
+    unsigned int ink_rows[FONT_LAST - FONT_FIRST + 1];
+    unsigned char buf[READ_SIZE];
+    size_t pos, len;
+    int eof;
+};
+
+static int font_bit(const unsigned char *glyph, int col, int row)
+{
+    if (col < 0 || col >= FONT_WIDTH || row < 0 || row >= FONT_HEIGHT)
+        return 0;
+    return glyph[row] >> (FONT_WIDTH - 1 - col) & 1;
+}
+
+/* Pixel (x, y) of a glyph scaled by scale. A white grid square between
+ * two black ones that meet only at a corner gets the triangle on that
+ * corner's side, so diagonal strokes come out straight instead of in
+ * steps; squares in the crook of an L are left alone. */
+static int glyph_pixel(const unsigned char *glyph, unsigned int scale,
+                       unsigned int x, unsigned int y)
+{
+    int col = x / scale, row = y / scale;
+    if (font_bit(glyph, col, row))
+        return 1;
+    /* Position inside the square, doubled so the centre is an integer */
+    int fx = 2 * (x % scale) + 1, fy = 2 * (y % scale) + 1, s = 2 * scale;
+    for (int dy = -1; dy <= 1; dy += 2) {
+        for (int dx = -1; dx <= 1; dx += 2) {
+            if (!font_bit(glyph, col + dx, row) || !font_bit(glyph, col, row + dy) ||
+                font_bit(glyph, col + dx, row + dy))
+                continue;
+            /* Distance from the corner between the two, along each axis */
+            int cx = dx < 0 ? fx : s - fx, cy = dy < 0 ? fy : s - fy;
+            if (cx + cy < s)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/* Scale every glyph to the cell and centre it both ways; the 5x9 grid
+ * already holds the descenders, so centring it leaves equal leading
+ * above and below */
+static int build_glyphs(gdi_text_t *text)
+{
+    unsigned int cw = text->layout.cell_width, ch = text->layout.cell_height;
+    unsigned int scale = cw / (FONT_WIDTH + 1) < ch / (FONT_HEIGHT + 1)
+                         ? cw / (FONT_WIDTH + 1) : ch / (FONT_HEIGHT + 1);
+    if (scale == 0) scale = 1;
+    unsigned int x0 = cw > FONT_WIDTH * scale ? (cw - FONT_WIDTH * scale) / 2 : 0;
+    unsigned int y0 = ch > FONT_HEIGHT * scale ? (ch - FONT_HEIGHT * scale) / 2 : 0;
+
+    text->glyphs = calloc((size_t)(FONT_LAST - FONT_FIRST + 1) * ch, sizeof(uint64_t));
+    if (!text->glyphs)
+        return -1;
+    for (int c = 0; c <= FONT_LAST - FONT_FIRST; c++) {
+        uint64_t *rows = text->glyphs + (size_t)c * ch;
+        unsigned int top = ch, bottom = 0;
+        for (unsigned int y = y0; y < y0 + FONT_HEIGHT * scale && y < ch; y++) {
+            uint64_t bits = 0;
+            for (unsigned int x = 0; x < FONT_WIDTH * scale && x0 + x < cw; x++)
+                if (glyph_pixel(font[c], scale, x, y - y0))
+                    bits |= (uint64_t)1 << (63 - x0 - x);
+            rows[y] = bits;
+            if (bits) {
+                if (top == ch) top = y;
+                bottom = y + 1;
+            }
+        }
+        text->ink_top[c] = top < bottom ? top : 0;
+        text->ink_rows[c] = top < bottom ? bottom - top : 0;
+    }
+    return 0;
+}
+
+static uint64_t from_be(uint64_t w)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(w);
+#else
+    return w;
+#endif
+}
+
+/* OR rows of a glyph into the page with its cell's left edge at pixel
+ * x: eight bytes and the bits shifted into a ninth. Pages carry eight
+ * bytes of slack, so the last row can do the same. */
+static void blit(unsigned char *dst, size_t stride, unsigned int x,
+                 const uint64_t *rows, unsigned int n)
+{
+    unsigned int shift = x % 8;
+    dst += x / 8;
+    for (unsigned int i = 0; i < n; i++, dst += stride) {
+        uint64_t bits = rows[i], w;
+        if (!bits) continue;
+        memcpy(&w, dst, 8);
+        w = from_be(from_be(w) | bits >> shift);
+        memcpy(dst, &w, 8);
+        if (shift)
+            dst[8] |= (unsigned char)(bits << (8 - shift));
+    }
+}
+
+gdi_text_t *gdi_text_open(int fd, const gdi_text_layout_t *layout)
+{
+    const gdi_text_layout_t *l = layout;
+    if (l->columns == 0 || l->lines == 0 || l->cell_width == 0 ||
+        l->cell_width > GDI_TEXT_MAX_CELL || l->cell_height == 0 ||
+        l->left + l->columns * l->cell_width > l->width ||
+        l->top + l->lines * l->cell_height > l->height)
+        return NULL;
+
+    gdi_text_t *text = calloc(1, sizeof(*text));
+    if (!text)
+        return NULL;
+    text->fd = fd;
+    text->layout = *layout;
+    text->stride = GDI_BITMAP_STRIDE(l->width);
+    text->page_size = text->stride * l->height;
+    if (build_glyphs(text) < 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+/* Next byte of the text, -1 at the end, -2 on a read error */
+static int next_byte(gdi_text_t *text)
+{
+    if (text->pos == text->len) {
+        if (text->eof)
+            return -1;
+        ssize_t n = read(text->fd, text->buf, sizeof(text->buf));
+        if (n < 0)
+            return -2;
+        if (n == 0) {
+            text->eof = 1;
+            return -1;
+        }
+        text->pos = 0;
+        text->len = (size_t)n;
+    }
+    return text->buf[text->pos++];
+}
+
+/* Put the byte back after a page ends on it */
+static void unread_byte(gdi_text_t *text)
+{
+    text->pos--;
+}
+
+int gdi_text_next(gdi_text_t *text, unsigned char **page)
+{
+    const gdi_text_layout_t *l = &text->layout;
+    unsigned int line = 0, col = 0;
+    int used = 0, c;
+
+    unsigned char *out = calloc(1, text->page_size + 8);
+    if (!out)
+        return -1;
+
+    while ((c = next_byte(text)) >= 0) {
+        if (c == '\n') {
+            col = 0;
+            used = 1;
+            if (++line == l->lines) break;
+        } else if (c == '\r') {
+            col = 0;
+        } else if (c == '\f') {
+            if (used) break;
+        } else if (c == '\t') {
+            col = (col / 8 + 1) * 8;
+            used = 1;
+        } else if (c == '\b') {
+            if (col > 0) col--;
+        } else if (c < 0x20 || c == 0x7f || (c >= 0x80 && c < 0xc0)) {
+            continue;   /* controls, and the rest of a UTF-8 sequence */
+        } else {
+            if (col >= l->columns) {
+                if (!l->wrap) continue;
+                col = 0;
+                if (++line == l->lines) {
+                    unread_byte(text);
+                    break;
+                }
+            }
+            int g = (c >= 0x80 ? '?' : c) - FONT_FIRST;
+            if (text->ink_rows[g]) {
+                unsigned int y = l->top + line * l->cell_height + text->ink_top[g];
+                blit(out + (size_t)y * text->stride, text->stride,
+                     l->left + col * l->cell_width,
+                     text->glyphs + (size_t)g * l->cell_height + text->ink_top[g],
+                     text->ink_rows[g]);
+            }
+            col++;
+            used = 1;
+        }
+    }
+    if (c == -2 || (!used && c == -1)) {
+        free(out);
+        return c == -2 ? -1 : 0;
+    }
+    *page = out;
+    return 1;
+}
+
+int gdi_text_rewind(gdi_text_t *text)
+{
+    if (lseek(text->fd, 0, SEEK_SET) < 0)
+        return -1;
+    text->pos = text->len = 0;
+    text->eof = 0;
+    return 0;
+}
+
+void gdi_text_close(gdi_text_t *text)
+{
+    if (!text) return;
+    free(text->glyphs);
+    free(text);
+}
@@ -0,0 +1,50 @@
+/*
+ * gditext - plain text laid out straight into packed 1-bit pages
+ *
+ * Monospaced, with a built-in 5x9 bitmap font scaled to the character
+ * cell at 600 dpi once per job, diagonals smoothed. Each glyph is kept
+ * as the 64-bit rows of its cell, which are ORed into the page where
+ * the character goes, so overstrikes (bold and underline through
+ * backspace) come out as on a line printer.
+ *
+ * Newlines, carriage returns, form feeds, tabs (every 8 columns) and
+ * backspaces are obeyed; other control characters are dropped, and
+ * characters outside ASCII print as '?', once per UTF-8 sequence.
+ */
+
+#ifndef GDITEXT_H
+#define GDITEXT_H
+
+#include <stddef.h>
+
+/* Widest character cell, in pixels (10 characters per inch) */
+#define GDI_TEXT_MAX_CELL 64
+
+typedef struct {
+    unsigned int width, height;             /* page, in pixels */
+    unsigned int left, top;                 /* first cell's top left corner */
+    unsigned int columns, lines;            /* cells per line, lines per page */
+    unsigned int cell_width, cell_height;   /* width at most GDI_TEXT_MAX_CELL */
+    int wrap;                               /* long lines continue, else are cut */
+} gdi_text_layout_t;
+
+typedef struct gdi_text gdi_text_t;
+
+/* Text from fd, which stays the caller's; NULL if memory runs out or
+ * the layout has no room for a character */
+gdi_text_t *gdi_text_open(int fd, const gdi_text_layout_t *layout);
+
+/* Lay out the next page into a new calloc'd page of layout width x
+ * height. Returns 1 with *page set, 0 at the end of the text, -1 on a
+ * read error (errno set; EINTR included) or when memory runs out. A
+ * form feed or the last line ends a page; an empty page is only
+ * produced by a form feed after a blank line. */
+int gdi_text_next(gdi_text_t *text, unsigned char **page);
+
+/* Start over from the beginning of fd, for the next copy; -1 if it
+ * cannot seek */
+int gdi_text_rewind(gdi_text_t *text);
+
+void gdi_text_close(gdi_text_t *text);
+
+#endif
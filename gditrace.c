@@ -0,0 +1,153 @@
+/*
+ * gditrace - timeline of the filter's internals in Chrome trace format
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "gditrace.h"
+#include "gdilog.h"
+
+typedef struct {
+    const char *name;
+    uint64_t start;             /* ns since gdi_trace_open() */
+    uint64_t duration;
+    int page;
+    long stripe;
+} span_t;
+
+/* One per thread. Only the owning thread writes to it; rings are never
+ * freed, so a thread's pointer stays valid across jobs. */
+typedef struct ring {
+    struct ring *next;
+    int tid;
+    const char *thread;
+    unsigned long count;        /* spans recorded; the last GDI_TRACE_RING are kept */
+    span_t spans[GDI_TRACE_RING];
+} ring_t;
+
+int gdi_trace_on;
+
+static ring_t *rings;
+static int last_tid;
+static uint64_t epoch;
+static char trace_path[1024];
+static __thread ring_t *thread_ring;
+static __thread int thread_page;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* The calling thread's ring, added to the list without a lock */
+static ring_t *ring_get(void)
+{
+    if (thread_ring) return thread_ring;
+
+    ring_t *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->tid = __atomic_add_fetch(&last_tid, 1, __ATOMIC_RELAXED);
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    thread_ring = r;
+    return r;
+}
+
+void gdi_trace_open(const char *name)
+{
+    const char *env = getenv("RICOH_GDI_TRACE");
+    if (!env || !*env || strcmp(env, "0") == 0) return;
+
+    const char *tmpdir = getenv("TMPDIR");
+    snprintf(trace_path, sizeof(trace_path), "%s/ricoh-trace-%s-%d.json",
+             tmpdir ? tmpdir : "/tmp", name, (int)getpid());
+    epoch = now_ns();
+    gdi_trace_on = 1;
+}
+
+void gdi_trace_thread(const char *name)
+{
+    if (!gdi_trace_on) return;
+    ring_t *r = ring_get();
+    if (r) r->thread = name;
+}
+
+void gdi_trace_page(int page)
+{
+    thread_page = page;
+}
+
+uint64_t gdi_trace_begin(void)
+{
+    return gdi_trace_on ? now_ns() : 0;
+}
+
+void gdi_trace_end(const char *name, uint64_t begin, long stripe)
+{
+    if (!gdi_trace_on || !begin) return;
+    ring_t *r = ring_get();
+    if (!r) return;
+
+    span_t *s = &r->spans[r->count % GDI_TRACE_RING];
+    s->name = name;
+    s->start = begin - epoch;
+    s->duration = now_ns() - begin;
+    s->page = thread_page;
+    s->stripe = stripe;
+    __atomic_store_n(&r->count, r->count + 1, __ATOMIC_RELEASE);
+}
+
+void gdi_trace_close(void)
+{
+    if (!gdi_trace_on) return;
+    gdi_trace_on = 0;
+
+    FILE *f = fopen(trace_path, "w");
+    if (!f) {
+        gdi_log(LOG_ERR, "cannot write trace %s: %s", trace_path, strerror(errno));
+        return;
+    }
+
+    int pid = (int)getpid();
+    unsigned long spans = 0, lost = 0;
+    const char *sep = "";
+    fprintf(f, "{\"traceEvents\":[");
+    for (ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+        unsigned long first = count > GDI_TRACE_RING ? count - GDI_TRACE_RING : 0;
+
+        if (r->thread) {
+            fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}", sep, pid, r->tid, r->thread);
+            sep = ",";
+        }
+        for (unsigned long i = first; i < count; i++) {
+            const span_t *s = &r->spans[i % GDI_TRACE_RING];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"page\":%d",
+                    sep, s->name, pid, r->tid, s->start / 1e3, s->duration / 1e3, s->page);
+            if (s->stripe >= 0)
+                fprintf(f, ",\"stripe\":%ld", s->stripe);
+            fprintf(f, "}}");
+            sep = ",";
+        }
+        spans += count - first;
+        lost += first;
+        r->count = 0;
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (fclose(f) != 0)
+        gdi_log(LOG_ERR, "cannot write trace %s: %s", trace_path, strerror(errno));
+    else
+        gdi_log(LOG_INFO, "trace of %lu span(s) written to %s%s", spans, trace_path,
+                lost ? ", oldest spans overwritten" : "");
+}
@@ -0,0 +1,44 @@
+/*
+ * gditrace - timeline of the filter's internals in Chrome trace format
+ *
+ * With RICOH_GDI_TRACE=1 in the environment, spans for header parsing,
+ * raster ingest, stripe encoding, cache lookups and writes are recorded
+ * with their thread and page/stripe number, and written as Chrome trace
+ * JSON (chrome://tracing, ui.perfetto.dev) to $TMPDIR when the job ends.
+ *
+ * Every thread records into its own ring buffer, so recording takes no
+ * locks; when a ring is full the oldest spans are overwritten. Without
+ * the variable each call is a single test of a global flag.
+ */
+
+#ifndef GDITRACE_H
+#define GDITRACE_H
+
+#include <stdint.h>
+
+/* Spans kept per thread before the oldest are overwritten */
+#define GDI_TRACE_RING 65536
+
+extern int gdi_trace_on;
+
+/* Start tracing if RICOH_GDI_TRACE is set; name goes into the file name */
+void gdi_trace_open(const char *name);
+
+/* Write the trace file and stop. Threads that recorded must have
+ * finished or be idle. */
+void gdi_trace_close(void);
+
+/* Name the calling thread in the timeline */
+void gdi_trace_thread(const char *name);
+
+/* Page that spans of the calling thread are attributed to */
+void gdi_trace_page(int page);
+
+/* Start of a span, in ns; 0 when tracing is off */
+uint64_t gdi_trace_begin(void);
+
+/* Record a span from begin until now. name must be a string literal
+ * (it is kept by pointer); stripe is -1 when not about one stripe. */
+void gdi_trace_end(const char *name, uint64_t begin, long stripe);
+
+#endif
@@ -0,0 +1,478 @@
+/*
+ * jbigstripe - JBIG1 encoding with independently coded stripes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <jbig85.h>
+#include "jbigstripe.h"
+#include "gditrace.h"
+#include "gdilog.h"
+
+/* Bi-level image header as jbg_enc_out() writes it for our settings */
+#define BIH_LEN      20
+#define BIH_ORDER    0x0c    /* JBG_HITOLO | JBG_SEQ */
+
+/* Stripe key material: which profile, and whether context lines exist */
+#define STRIPE_PROFILE     "jbg85 stripe options=TPBON mx=0 end=SDRST"
+#define STRIPE_PROFILE_TOP "jbg85 stripe options=TPBON mx=0 end=SDRST top"
+
+struct stripe_entry {
+    unsigned char key[PAGE_CACHE_KEY_LEN];
+    size_t size;
+    unsigned char data[];
+};
+
+/* A stripe coded on this page, to go to the persistent store */
+typedef struct {
+    unsigned char key[PAGE_CACHE_KEY_LEN];
+    unsigned long lines;
+    size_t start, size;
+} new_stripe_t;
+
+/* Growable output buffer */
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+} out_buffer_t;
+
+static int buffer_append(out_buffer_t *buf, const unsigned char *data, size_t len)
+{
+    if (buf->failed) return -1;
+    if (buf->size + len > buf->capacity) {
+        size_t new_cap = buf->capacity ? buf->capacity * 2 : 65536;
+        while (new_cap < buf->size + len)
+            new_cap *= 2;
+        unsigned char *new_data = realloc(buf->data, new_cap);
+        if (!new_data) {
+            gdi_log(LOG_ERR, "rastertericoh: stripe buffer realloc failed");
+            buf->failed = 1;
+            return -1;
+        }
+        buf->data = new_data;
+        buf->capacity = new_cap;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    return 0;
+}
+
+static void stripe_data_cb(unsigned char *start, size_t len, void *file)
+{
+    buffer_append((out_buffer_t *)file, start, len);
+}
+
+void stripe_cache_init(stripe_cache_t *cache, size_t max_bytes, page_cache_t *disk)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->max_bytes = max_bytes;
+    cache->disk = disk;
+}
+
+void stripe_cache_free(stripe_cache_t *cache)
+{
+    for (size_t i = 0; i < cache->nslots; i++)
+        free(cache->slots[i]);
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->nslots = cache->count = cache->bytes = 0;
+}
+
+static size_t slot_of(const unsigned char *key, size_t nslots)
+{
+    size_t h;
+    memcpy(&h, key, sizeof(h));  /* the key is already a SHA-256 */
+    return h & (nslots - 1);
+}
+
+static stripe_entry_t *lookup(stripe_cache_t *cache, const unsigned char *key)
+{
+    if (cache->nslots == 0) return NULL;
+    for (size_t i = slot_of(key, cache->nslots); cache->slots[i];
+         i = (i + 1) & (cache->nslots - 1)) {
+        if (memcmp(cache->slots[i]->key, key, PAGE_CACHE_KEY_LEN) == 0)
+            return cache->slots[i];
+    }
+    return NULL;
+}
+
+/* Remember a stripe; once the memory budget is spent new stripes are
+ * no longer kept, which favours the headers seen on the first pages. */
+static void insert(stripe_cache_t *cache, const unsigned char *key,
+                   const unsigned char *data, size_t size)
+{
+    if (cache->bytes + size > cache->max_bytes) return;
+
+    if (cache->count * 2 >= cache->nslots) {
+        size_t nslots = cache->nslots ? cache->nslots * 2 : 1024;
+        stripe_entry_t **slots = calloc(nslots, sizeof(*slots));
+        if (!slots) return;
+        for (size_t i = 0; i < cache->nslots; i++) {
+            stripe_entry_t *e = cache->slots[i];
+            if (!e) continue;
+            size_t j = slot_of(e->key, nslots);
+            while (slots[j]) j = (j + 1) & (nslots - 1);
+            slots[j] = e;
+        }
+        free(cache->slots);
+        cache->slots = slots;
+        cache->nslots = nslots;
+    }
+
+    stripe_entry_t *e = malloc(sizeof(*e) + size);
+    if (!e) return;
+    memcpy(e->key, key, PAGE_CACHE_KEY_LEN);
+    e->size = size;
+    memcpy(e->data, data, size);
+
+    size_t i = slot_of(key, cache->nslots);
+    while (cache->slots[i]) i = (i + 1) & (cache->nslots - 1);
+    cache->slots[i] = e;
+    cache->count++;
+    cache->bytes += size;
+}
+
+/* jbg_enc_out() drops the 0x00 bytes at the end of each stripe's coded
+ * data, which T.82 lets the decoder supply; jbg85 writes them out.
+ * Remove them in place so that both encoders give the same bytes.
+ * Returns the new length. */
+static size_t remove_trailing_zeros(unsigned char *data, size_t len)
+{
+    size_t in = 0, out = 0, zeros = 0;
+
+    while (in < len) {
+        unsigned char c = data[in];
+        if (c == 0x00) {
+            zeros++;
+            in++;
+            continue;
+        }
+        if (c == 0xff && in + 1 < len &&
+            (data[in + 1] == 0x02 || data[in + 1] == 0x03))
+            zeros = 0;          /* end of stripe: the zeros go */
+        for (; zeros; zeros--)
+            data[out++] = 0x00;
+        data[out++] = c;
+        in++;
+        if (c == 0xff && in < len)
+            data[out++] = data[in++];   /* marker or stuffed 0x00 */
+    }
+    for (; zeros; zeros--)
+        data[out++] = 0x00;
+    return out;
+}
+
+/* Encode one stripe on its own and append its SDE, ended by SDRST */
+static int encode_stripe(const unsigned char *bitmap, size_t stride,
+                         unsigned int width, unsigned long y0, unsigned long lines,
+                         out_buffer_t *out)
+{
+    struct jbg85_enc_state enc;
+    out_buffer_t sde = { NULL, 0, 0, 0 };
+
+    jbg85_enc_init(&enc, width, lines, stripe_data_cb, &sde);
+    jbg85_enc_options(&enc, JBG_TPBON, lines, 0);
+    for (unsigned long y = y0; y < y0 + lines; y++) {
+        unsigned char *line = (unsigned char *)bitmap + y * stride;
+        jbg85_enc_lineout(&enc, line,
+                          y >= 1 ? line - stride : NULL,
+                          y >= 2 ? line - 2 * stride : NULL);
+    }
+
+    /* A single-stripe image: its own BIH, the SDE, then ESC SDNORM */
+    if (sde.failed || sde.size < BIH_LEN + 2 ||
+        sde.data[sde.size - 2] != 0xff || sde.data[sde.size - 1] != 0x02) {
+        free(sde.data);
+        return -1;
+    }
+    sde.data[sde.size - 1] = 0x03;  /* SDRST */
+    size_t len = remove_trailing_zeros(sde.data + BIH_LEN, sde.size - BIH_LEN);
+    int rc = buffer_append(out, sde.data + BIH_LEN, len);
+    free(sde.data);
+    return rc;
+}
+
+static void put_be32(unsigned char *p, unsigned long v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+/* Threshold map of an 8x8 ordered (Bayer) dither */
+static const unsigned char bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+/* Black pixels per 64 in each 8x8 block of the block row starting at y */
+static void block_density(const unsigned char *bitmap, size_t stride,
+                          unsigned int height, unsigned long y,
+                          unsigned char *density)
+{
+    unsigned long rows = height - y < 8 ? height - y : 8;
+
+    for (size_t x = 0; x < stride; x++) {
+        unsigned int n = 0;
+        for (unsigned long r = 0; r < rows; r++)
+            n += __builtin_popcount(bitmap[(y + r) * stride + x]);
+        density[x] = n * 8 / rows;
+    }
+}
+
+static void dither_line(const unsigned char *density, size_t stride,
+                        unsigned int width, unsigned long y, unsigned char *line)
+{
+    const unsigned char *row = bayer8[y & 7];
+
+    for (size_t x = 0; x < stride; x++) {
+        unsigned char b = 0;
+        for (int c = 0; c < 8; c++)
+            if (row[c] < density[x]) b |= 0x80 >> c;
+        line[x] = b;
+    }
+    if (width % 8)
+        line[stride - 1] &= 0xff << (8 - width % 8);
+}
+
+static double elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 +
+           (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/* Whether the stripe just finished crossed one of the guard's limits */
+static int guard_check(jbig_guard_t *guard, const struct timespec *start,
+                       unsigned long stripe, unsigned long lines_done,
+                       unsigned int height, size_t stripe_raw, size_t stripe_bytes)
+{
+    double ms = elapsed_ms(start);
+    int over_time = guard->page_ms > 0 && ms > guard->page_ms / 4 &&
+                    ms > guard->page_ms * lines_done / height;
+    int over_size = guard->max_ratio > 0 &&
+                    stripe_bytes > guard->max_ratio * stripe_raw;
+
+    if (!over_time && !over_size) return 0;
+    guard->tripped = 1;
+    guard->stripe = stripe;
+    guard->elapsed_ms = ms;
+    guard->stripe_bytes = stripe_bytes;
+    return 1;
+}
+
+unsigned char *jbig_encode_page(const unsigned char *bitmap,
+                                unsigned int width, unsigned int height,
+                                unsigned long l0, const volatile sig_atomic_t *cancel,
+                                jbig_guard_t *guard, size_t *out_size)
+{
+    size_t stride = (width + 7) / 8;
+    struct jbg85_enc_state enc;
+    out_buffer_t out = { NULL, 0, 0, 0 };
+    unsigned char *scratch = NULL, *density = NULL;
+    const unsigned char *prev1 = NULL, *prev2 = NULL;
+    struct timespec start;
+    size_t stripe_start = 0;
+    int dithering = 0;
+    uint64_t span = 0;
+
+    if (guard) {
+        guard->tripped = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    jbg85_enc_init(&enc, width, height, stripe_data_cb, &out);
+    jbg85_enc_options(&enc, JBG_TPBON, l0, 0);
+    for (unsigned long y = 0; y < height; y++) {
+        if (y % l0 == 0) {
+            if (cancel && *cancel) {
+                free(out.data);
+                free(scratch);
+                free(density);
+                return NULL;
+            }
+            span = gdi_trace_begin();
+        }
+        const unsigned char *line = bitmap + y * stride;
+
+        /* Once dithering, lines go through a ring of three so that the
+         * encoder sees the lines above as they were coded */
+        if (dithering) {
+            unsigned char *dst = scratch + (y % 3) * stride;
+            if (y % 8 == 0)
+                block_density(bitmap, stride, height, y, density);
+            dither_line(density, stride, width, y, dst);
+            line = dst;
+        }
+        jbg85_enc_lineout(&enc, (unsigned char *)line,
+                          (unsigned char *)prev1, (unsigned char *)prev2);
+        prev2 = prev1;
+        prev1 = line;
+        if ((y + 1) % l0 == 0 || y + 1 == height)
+            gdi_trace_end(dithering ? "encode stripe (dithered)" : "encode stripe",
+                          span, y / l0);
+
+        if (guard && !dithering && ((y + 1) % l0 == 0 || y + 1 == height)) {
+            unsigned long lines = y % l0 + 1;
+            if (y + 1 < height &&
+                guard_check(guard, &start, y / l0, y + 1, height,
+                            lines * stride, out.size - stripe_start)) {
+                scratch = malloc(3 * stride);
+                density = malloc(stride);
+                if (!scratch || !density) {
+                    gdi_log(LOG_ERR, "rastertericoh: memory allocation failed");
+                    free(out.data);
+                    free(scratch);
+                    free(density);
+                    return NULL;
+                }
+                dithering = 1;
+                /* Blocks are aligned to the page, not the stripe */
+                block_density(bitmap, stride, height, (y + 1) & ~7UL, density);
+            }
+            stripe_start = out.size;
+        }
+    }
+    free(scratch);
+    free(density);
+
+    /* jbg85 always writes order 0; the stripes are the same for ours */
+    if (out.failed || out.size < BIH_LEN) {
+        free(out.data);
+        return NULL;
+    }
+    out.data[18] = BIH_ORDER;
+    *out_size = BIH_LEN + remove_trailing_zeros(out.data + BIH_LEN, out.size - BIH_LEN);
+    return out.data;
+}
+
+unsigned char *jbig_encode_stripes(const unsigned char *bitmap,
+                                   unsigned int width, unsigned int height,
+                                   unsigned long l0, stripe_cache_t *cache,
+                                   pthread_mutex_t *lock,
+                                   const volatile sig_atomic_t *cancel,
+                                   size_t *out_size)
+{
+    size_t stride = (width + 7) / 8;
+    out_buffer_t out = { NULL, 0, 0, 0 };
+    unsigned char bih[BIH_LEN] = { 0, 0, 1, 0 };
+    new_stripe_t *stored = NULL;
+    size_t nstored = 0;
+
+    /* Misses go to disk once the page is done, not one by one while
+     * encoding */
+    if (cache && cache->disk) {
+        stored = malloc((height / l0 + 1) * sizeof(*stored));
+        if (!stored) {
+            gdi_log(LOG_ERR, "rastertericoh: memory allocation failed");
+            return NULL;
+        }
+    }
+
+    put_be32(bih + 4, width);
+    put_be32(bih + 8, height);
+    put_be32(bih + 12, l0);
+    bih[18] = BIH_ORDER;
+    bih[19] = JBG_TPBON;
+    buffer_append(&out, bih, BIH_LEN);
+
+    for (unsigned long y0 = 0; y0 < height; y0 += l0) {
+        unsigned long lines = height - y0 < l0 ? height - y0 : l0;
+        unsigned char key[PAGE_CACHE_KEY_LEN];
+        size_t start = out.size;
+
+        if (cancel && *cancel) {
+            free(out.data);
+            free(stored);
+            return NULL;
+        }
+
+        if (cache) {
+            /* The stripe plus its two context lines are contiguous */
+            unsigned long first = y0 >= 2 ? y0 - 2 : 0;
+            page_cache_key(bitmap + first * stride, (y0 + lines - first) * stride,
+                           width, lines, y0 >= 2 ? STRIPE_PROFILE : STRIPE_PROFILE_TOP,
+                           key);
+
+            /* A hit is copied out before the lock goes: another thread
+             * may reset the cache right after */
+            uint64_t span = gdi_trace_begin();
+            if (lock) pthread_mutex_lock(lock);
+            cache->lookups++;
+            stripe_entry_t *e = lookup(cache, key);
+            if (e) {
+                cache->hits++;
+                buffer_append(&out, e->data, e->size);
+            }
+            if (lock) pthread_mutex_unlock(lock);
+            if (e) {
+                gdi_trace_end("stripe cache hit", span, y0 / l0);
+                continue;
+            }
+            if (cache->disk) {
+                size_t len;
+                unsigned char *data = page_cache_get(cache->disk, key, width, lines, &len);
+                if (data) {
+                    buffer_append(&out, data, len);
+                    if (lock) pthread_mutex_lock(lock);
+                    cache->hits++;
+                    cache->disk_hits++;
+                    insert(cache, key, data, len);
+                    if (lock) pthread_mutex_unlock(lock);
+                    free(data);
+                    gdi_trace_end("stripe cache hit", span, y0 / l0);
+                    continue;
+                }
+            }
+            gdi_trace_end("stripe cache miss", span, y0 / l0);
+        }
+
+        uint64_t span = gdi_trace_begin();
+        if (encode_stripe(bitmap, stride, width, y0, lines, &out) < 0) {
+            gdi_log(LOG_ERR, "rastertericoh: stripe encode failed at line %lu", y0);
+            free(out.data);
+            free(stored);
+            return NULL;
+        }
+        gdi_trace_end("encode stripe", span, y0 / l0);
+        if (cache) {
+            if (lock) pthread_mutex_lock(lock);
+            insert(cache, key, out.data + start, out.size - start);
+            if (lock) pthread_mutex_unlock(lock);
+            if (stored) {
+                memcpy(stored[nstored].key, key, PAGE_CACHE_KEY_LEN);
+                stored[nstored].lines = lines;
+                stored[nstored].start = start;
+                stored[nstored].size = out.size - start;
+                nstored++;
+            }
+        }
+    }
+
+    if (out.failed) {
+        free(out.data);
+        free(stored);
+        return NULL;
+    }
+
+    /* A stripe is quick to code again, so it is stored without fsync */
+    if (nstored) {
+        uint64_t span = gdi_trace_begin();
+        for (size_t i = 0; i < nstored; i++)
+            page_cache_put(cache->disk, stored[i].key, width, stored[i].lines,
+                           out.data + stored[i].start, stored[i].size, 0);
+        gdi_trace_end("stripe cache store", span, -1);
+    }
+    free(stored);
+    *out_size = out.size;
+    return out.data;
+}
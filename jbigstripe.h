@@ -0,0 +1,79 @@
+/*
+ * jbigstripe - JBIG1 encoding with independently coded stripes
+ *
+ * With SDRST stripe ends the arithmetic coder starts afresh in every
+ * stripe, so the bytes of a stripe depend only on its own lines and the
+ * two lines above it (the context template). Identical stripes under
+ * identical context therefore encode to identical bytes, and a stripe
+ * cache can hand them out again instead of re-encoding.
+ *
+ * Stripes are coded with the line-by-line jbig85 encoder, one encoder
+ * per stripe. The result is byte-for-byte what jbg_enc_out() produces
+ * with JBG_SDRST for the same settings.
+ */
+
+#ifndef JBIGSTRIPE_H
+#define JBIGSTRIPE_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include "pagecache.h"
+
+typedef struct stripe_entry stripe_entry_t;
+
+typedef struct {
+    stripe_entry_t **slots;     /* open addressing, power-of-two size */
+    size_t nslots;
+    size_t count;
+    size_t bytes;               /* compressed bytes held in memory */
+    size_t max_bytes;
+    page_cache_t *disk;         /* optional persistent store, may be NULL */
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long disk_hits;
+} stripe_cache_t;
+
+/* Per-job cache holding up to max_bytes of stripes in memory. When disk
+ * is given, stripes are also looked up in and stored to that cache. */
+void stripe_cache_init(stripe_cache_t *cache, size_t max_bytes, page_cache_t *disk);
+void stripe_cache_free(stripe_cache_t *cache);
+
+/* Encode a packed bitmap with l0 lines per stripe, HITOLO|SEQ, TPBON,
+ * no AT moves and SDRST between stripes. cache may be NULL; lock, if
+ * given, is held only while the cache is looked up or added to, so
+ * threads sharing a cache encode their misses in parallel. Returns a
+ * malloc'd BIE and its size, or NULL on failure or once *cancel is set
+ * (checked between stripes; cancel may be NULL). */
+unsigned char *jbig_encode_stripes(const unsigned char *bitmap,
+                                   unsigned int width, unsigned int height,
+                                   unsigned long l0, stripe_cache_t *cache,
+                                   pthread_mutex_t *lock,
+                                   const volatile sig_atomic_t *cancel,
+                                   size_t *out_size);
+
+/* Worst-case guard for jbig_encode_page(). Noise-like content codes
+ * slowly and to about its raw size. Once a stripe codes to more than
+ * max_ratio of its raw bytes, or the page has used more than its share
+ * of page_ms (checked from a quarter of page_ms on, so short hiccups do
+ * not count), the rest of the page is replaced by an 8x8 ordered dither
+ * of the same local density, which codes fast and small. */
+typedef struct {
+    double page_ms;             /* time budget, 0 for none */
+    double max_ratio;           /* size budget, 0 for none */
+    int tripped;                /* set when the rest of the page was dithered */
+    unsigned long stripe;       /* the stripe that crossed a limit */
+    double elapsed_ms;          /* page time up to and including it */
+    size_t stripe_bytes;        /* and its coded size */
+} jbig_guard_t;
+
+/* The same settings with ordinary SDNORM stripe ends, coded line by
+ * line so that *cancel can stop it between stripes. Unless the guard
+ * trips, the output is byte-for-byte what jbg_enc_out() produces.
+ * guard may be NULL. */
+unsigned char *jbig_encode_page(const unsigned char *bitmap,
+                                unsigned int width, unsigned int height,
+                                unsigned long l0, const volatile sig_atomic_t *cancel,
+                                jbig_guard_t *guard, size_t *out_size);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * pagecache - persistent cache of JBIG-compressed pages
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <cups/cups.h>
+#include "pagecache.h"
+#include "gdilog.h"
+
+/* Entry file: magic, key, width, height, data checksum, IMAGELEN, then
+ * the JBIG data. Integers are big-endian. */
+#define ENTRY_MAGIC      "RJC2"
+#define ENTRY_HEADER_LEN (4 + PAGE_CACHE_KEY_LEN + 4 + 4 + 4 + 8)
+#define ENTRY_SUFFIX     ".jbg"
+#define TEMP_PREFIX      ".tmp-"
+
+/* Temp files older than this belong to a writer that died */
+#define STALE_TEMP_SECS  3600
+
+/* Evict down to this share of the limit, so eviction is not rerun on
+ * every store once the cache is full */
+#define EVICT_TARGET(max) ((max) / 10 * 9)
+
+typedef struct {
+    char name[96];
+    time_t mtime;
+    off_t size;
+} entry_t;
+
+static void put_be32(unsigned char *p, unsigned long v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static unsigned long get_be32(const unsigned char *p)
+{
+    return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+           ((unsigned long)p[2] << 8) | p[3];
+}
+
+/* FNV-1a over the data: entries stored without fsync may come back
+ * from a crash zero-filled but at their full length */
+static unsigned long checksum(const unsigned char *data, size_t len)
+{
+    unsigned long h = 2166136261UL;
+    for (size_t i = 0; i < len; i++)
+        h = ((h ^ data[i]) * 16777619UL) & 0xffffffffUL;
+    return h;
+}
+
+static void entry_path(const page_cache_t *cache,
+                       const unsigned char key[PAGE_CACHE_KEY_LEN],
+                       char *path, size_t size)
+{
+    char hex[2 * PAGE_CACHE_KEY_LEN + 1];
+    cupsHashString(key, PAGE_CACHE_KEY_LEN, hex, sizeof(hex));
+    snprintf(path, size, "%s/%s%s", cache->dir, hex, ENTRY_SUFFIX);
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int cmp_mtime(const void *a, const void *b)
+{
+    const entry_t *x = a, *y = b;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/* Total up the cache directory and, if it is over its limit, delete
+ * least recently used entries. Also clears out abandoned temp files. */
+static void scan_and_evict(page_cache_t *cache)
+{
+    DIR *dir = opendir(cache->dir);
+    if (!dir) return;
+
+    entry_t *entries = NULL;
+    size_t count = 0, cap = 0;
+    off_t total = 0;
+    time_t now = time(NULL);
+    struct dirent *de;
+    char path[1200];
+    struct stat st;
+
+    while ((de = readdir(dir)) != NULL) {
+        size_t nlen = strlen(de->d_name);
+        int is_temp = strncmp(de->d_name, TEMP_PREFIX, strlen(TEMP_PREFIX)) == 0;
+        int is_entry = nlen > strlen(ENTRY_SUFFIX) &&
+            strcmp(de->d_name + nlen - strlen(ENTRY_SUFFIX), ENTRY_SUFFIX) == 0;
+        if ((!is_temp && !is_entry) || nlen >= sizeof(entries->name))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, de->d_name);
+        if (stat(path, &st) < 0) continue;
+
+        if (is_temp) {
+            if (now - st.st_mtime > STALE_TEMP_SECS) unlink(path);
+            continue;
+        }
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            entry_t *grown = realloc(entries, cap * sizeof(*entries));
+            if (!grown) break;
+            entries = grown;
+        }
+        memcpy(entries[count].name, de->d_name, nlen + 1);
+        entries[count].mtime = st.st_mtime;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > cache->max_bytes) {
+        size_t evicted = 0;
+        qsort(entries, count, sizeof(*entries), cmp_mtime);
+        for (size_t i = 0; i < count && total > EVICT_TARGET(cache->max_bytes); i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+            if (unlink(path) == 0 || errno == ENOENT) {
+                total -= entries[i].size;
+                evicted++;
+            }
+        }
+        gdi_log(LOG_INFO, "page cache: evicted %zu entries, %lld bytes in use",
+                evicted, (long long)total);
+    }
+    cache->used_bytes = total;
+    free(entries);
+}
+
+int page_cache_open(page_cache_t *cache, const char *dir, off_t max_bytes)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (snprintf(cache->dir, sizeof(cache->dir), "%s", dir) >= (int)sizeof(cache->dir))
+        return -1;
+    cache->max_bytes = max_bytes;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        gdi_log(LOG_WARNING, "page cache: cannot create %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    if (access(dir, R_OK | W_OK | X_OK) < 0) {
+        gdi_log(LOG_WARNING, "page cache: cannot use %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    scan_and_evict(cache);
+    return 0;
+}
+
+void page_cache_key(const unsigned char *bitmap, size_t size,
+                    unsigned int width, unsigned int height,
+                    const char *profile, unsigned char key[PAGE_CACHE_KEY_LEN])
+{
+    unsigned char material[PAGE_CACHE_KEY_LEN + 8 + 128];
+    size_t plen = strlen(profile);
+
+    if (plen > 128) plen = 128;
+    cupsHashData("sha2-256", bitmap, size, material, PAGE_CACHE_KEY_LEN);
+    put_be32(material + PAGE_CACHE_KEY_LEN, width);
+    put_be32(material + PAGE_CACHE_KEY_LEN + 4, height);
+    memcpy(material + PAGE_CACHE_KEY_LEN + 8, profile, plen);
+    cupsHashData("sha2-256", material, PAGE_CACHE_KEY_LEN + 8 + plen,
+                 key, PAGE_CACHE_KEY_LEN);
+}
+
+unsigned char *page_cache_get(page_cache_t *cache,
+                              const unsigned char key[PAGE_CACHE_KEY_LEN],
+                              unsigned int width, unsigned int height,
+                              size_t *len)
+{
+    char path[PAGE_CACHE_PATH_LEN];
+    unsigned char header[ENTRY_HEADER_LEN];
+    unsigned char *data = NULL;
+    struct stat st;
+    int fd;
+
+    entry_path(cache, key, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        cache->misses++;
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < ENTRY_HEADER_LEN ||
+        read_full(fd, header, sizeof(header)) < 0)
+        goto corrupt;
+
+    unsigned long long imagelen =
+        ((unsigned long long)get_be32(header + ENTRY_HEADER_LEN - 8) << 32) |
+        get_be32(header + ENTRY_HEADER_LEN - 4);
+    if (memcmp(header, ENTRY_MAGIC, 4) != 0 ||
+        memcmp(header + 4, key, PAGE_CACHE_KEY_LEN) != 0 ||
+        get_be32(header + 4 + PAGE_CACHE_KEY_LEN) != width ||
+        get_be32(header + 8 + PAGE_CACHE_KEY_LEN) != height ||
+        imagelen == 0 || (off_t)(ENTRY_HEADER_LEN + imagelen) != st.st_size)
+        goto corrupt;
+
+    data = malloc(imagelen);
+    if (!data) {
+        close(fd);
+        cache->misses++;
+        return NULL;
+    }
+    if (read_full(fd, data, imagelen) < 0 ||
+        checksum(data, imagelen) != get_be32(header + 12 + PAGE_CACHE_KEY_LEN))
+        goto corrupt;
+    close(fd);
+
+    /* Refresh the entry's age for LRU eviction */
+    utimes(path, NULL);
+    cache->hits++;
+    *len = imagelen;
+    return data;
+
+corrupt:
+    gdi_log(LOG_WARNING, "page cache: dropping damaged entry %s", path);
+    free(data);
+    close(fd);
+    unlink(path);
+    cache->misses++;
+    return NULL;
+}
+
+off_t page_cache_write(const page_cache_t *cache,
+                       const unsigned char key[PAGE_CACHE_KEY_LEN],
+                       unsigned int width, unsigned int height,
+                       const unsigned char *data, size_t len, int sync,
+                       char temp[PAGE_CACHE_PATH_LEN])
+{
+    unsigned char header[ENTRY_HEADER_LEN];
+    off_t size = ENTRY_HEADER_LEN + (off_t)len;
+    int fd;
+
+    if (size > cache->max_bytes) return -1;
+
+    memcpy(header, ENTRY_MAGIC, 4);
+    memcpy(header + 4, key, PAGE_CACHE_KEY_LEN);
+    put_be32(header + 4 + PAGE_CACHE_KEY_LEN, width);
+    put_be32(header + 8 + PAGE_CACHE_KEY_LEN, height);
+    put_be32(header + 12 + PAGE_CACHE_KEY_LEN, checksum(data, len));
+    put_be32(header + ENTRY_HEADER_LEN - 8, (unsigned long)((unsigned long long)len >> 32));
+    put_be32(header + ENTRY_HEADER_LEN - 4, (unsigned long)(len & 0xffffffffUL));
+
+    /* A unique name: threads of one process may store at once */
+    snprintf(temp, PAGE_CACHE_PATH_LEN, "%s/%sXXXXXX", cache->dir, TEMP_PREFIX);
+    fd = mkstemp(temp);
+    if (fd < 0) return -1;
+    if (write_full(fd, header, sizeof(header)) < 0 ||
+        write_full(fd, data, len) < 0 || (sync && fsync(fd) < 0)) {
+        gdi_log(LOG_WARNING, "page cache: cannot write %s: %s", temp, strerror(errno));
+        close(fd);
+        unlink(temp);
+        return -1;
+    }
+    close(fd);
+    return size;
+}
+
+void page_cache_commit(page_cache_t *cache,
+                       const unsigned char key[PAGE_CACHE_KEY_LEN],
+                       const char *temp, off_t size)
+{
+    char path[PAGE_CACHE_PATH_LEN];
+
+    entry_path(cache, key, path, sizeof(path));
+    if (rename(temp, path) < 0) {
+        unlink(temp);
+        return;
+    }
+    cache->stores++;
+    cache->used_bytes += size;
+    if (cache->used_bytes > cache->max_bytes)
+        scan_and_evict(cache);
+}
+
+void page_cache_put(page_cache_t *cache,
+                    const unsigned char key[PAGE_CACHE_KEY_LEN],
+                    unsigned int width, unsigned int height,
+                    const unsigned char *data, size_t len, int sync)
+{
+    char temp[PAGE_CACHE_PATH_LEN];
+    off_t size = page_cache_write(cache, key, width, height, data, len, sync, temp);
+    if (size >= 0)
+        page_cache_commit(cache, key, temp, size);
+}
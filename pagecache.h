@@ -0,0 +1,75 @@
+/*
+ * pagecache - persistent cache of JBIG-compressed pages
+ *
+ * Entries live as one file each in a directory under the CUPS-provided
+ * $TMPDIR, named after a SHA-256 key over the page bitmap, its geometry
+ * and the encoder profile. Each file stores the key, the dimensions, a
+ * checksum of the data and IMAGELEN ahead of the compressed bytes. Files
+ * are written to a temporary name and renamed into place. Pages are
+ * synced first, so a crash never leaves a partial page behind; stripe
+ * entries skip the sync (the sync flag below), and any a crash damages
+ * fail the checksum and are dropped. Hits refresh the file time, and
+ * the oldest entries are evicted once the directory grows past its
+ * size limit.
+ */
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PAGE_CACHE_KEY_LEN 32
+
+/* Room for an entry's path, or its temporary one */
+#define PAGE_CACHE_PATH_LEN 1200
+
+typedef struct {
+    char dir[1024];
+    off_t max_bytes;
+    off_t used_bytes;       /* as of the last directory scan plus our stores */
+    unsigned int hits;
+    unsigned int misses;
+    unsigned int stores;
+} page_cache_t;
+
+/* Create or open the cache directory. Returns 0, or -1 if the cache
+ * cannot be used (the filter then simply compresses every page). */
+int page_cache_open(page_cache_t *cache, const char *dir, off_t max_bytes);
+
+/* Key for a packed bitmap; profile describes the encoder settings so
+ * that changing them never returns stale data. */
+void page_cache_key(const unsigned char *bitmap, size_t size,
+                    unsigned int width, unsigned int height,
+                    const char *profile, unsigned char key[PAGE_CACHE_KEY_LEN]);
+
+/* Look up a key. Returns a malloc'd copy of the compressed page and its
+ * length, or NULL on a miss. */
+unsigned char *page_cache_get(page_cache_t *cache,
+                              const unsigned char key[PAGE_CACHE_KEY_LEN],
+                              unsigned int width, unsigned int height,
+                              size_t *len);
+
+/* Store a compressed page; failures only cost a future miss. Entries
+ * cheap to rebuild, like stripes, can skip the fsync (sync = 0): a crash
+ * may lose them, and the checksum catches any it leaves damaged. */
+void page_cache_put(page_cache_t *cache,
+                    const unsigned char key[PAGE_CACHE_KEY_LEN],
+                    unsigned int width, unsigned int height,
+                    const unsigned char *data, size_t len, int sync);
+
+/* page_cache_put() in two steps, for a cache shared between threads:
+ * page_cache_write() only reads the cache's settings, so the file is
+ * written and synced without the caller's lock, which is then needed
+ * for page_cache_commit() to rename it into place and account for it.
+ * Returns the entry's size, or -1 with nothing to commit. */
+off_t page_cache_write(const page_cache_t *cache,
+                       const unsigned char key[PAGE_CACHE_KEY_LEN],
+                       unsigned int width, unsigned int height,
+                       const unsigned char *data, size_t len, int sync,
+                       char temp[PAGE_CACHE_PATH_LEN]);
+void page_cache_commit(page_cache_t *cache,
+                       const unsigned char key[PAGE_CACHE_KEY_LEN],
+                       const char *temp, off_t size);
+
+#endif
@@ -0,0 +1,554 @@
+/*
+ * pdftoricoh - CUPS filter from PDF straight to Ricoh GDI, for Linux
+ *
+ * Renders each page with MuPDF into 8-bit gray bands of a few stripes,
+ * thresholds them into the packed page and hands that to the same
+ * adaptation, overlay, cleanup and JBIG stages as rastertericoh, so no
+ * CUPS raster is written, piped and parsed. Sheets are converted on
+ * several threads, each with its own MuPDF context and document, and
+ * written in order.
+ *
+ * CUPS filter chain: PDF -> pdftopdf -> pdftoricoh -> backend
+ *
+ * Registered by the *cupsFilter2 lines of the PPD, which are commented
+ * out since the macOS chain goes through cgpdftoraster instead. The
+ * filter takes application/vnd.cups-pdf, so pdftopdf has already made
+ * the copies and applied page-ranges and the other page selection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <cups/cups.h>
+#include <cups/raster.h>
+#include <mupdf/fitz.h>
+#include "ricohgdi.h"
+
+/* Rows rendered at a time: a few stripes of gray rather than a page */
+#define BAND_LINES (8 * RGDI_STRIPE_LINES)
+
+/* Threads converting sheets; more rarely pays for their memory */
+#define MAX_WORKERS 4
+
+/* Set by SIGTERM, which CUPS sends when the job is cancelled */
+static volatile sig_atomic_t cancelled;
+
+static void on_sigterm(int sig)
+{
+    (void)sig;
+    cancelled = 1;
+}
+
+/* MuPDF's locks, for contexts cloned across threads */
+static pthread_mutex_t fz_mutexes[FZ_LOCK_MAX];
+
+static void lock_fz(void *user, int lock)
+{
+    (void)user;
+    pthread_mutex_lock(&fz_mutexes[lock]);
+}
+
+static void unlock_fz(void *user, int lock)
+{
+    (void)user;
+    pthread_mutex_unlock(&fz_mutexes[lock]);
+}
+
+/* One output sheet: a page, or several with ricoh-number-up */
+typedef struct {
+    unsigned char *jbig;        /* NULL if the sheet failed */
+    size_t jbig_size;
+    unsigned long dots;
+    rgdi_page_info_t info;
+    int done;
+} sheet_t;
+
+typedef struct {
+    const unsigned char *pdf;
+    size_t pdf_size;
+    fz_context *ctx;            /* cloned by each worker */
+    int pages, sheets, number_up;
+    char paper[64];             /* CUPS size name, "" to keep the PDF's */
+    int manual_feed;
+    int num_options;
+    cups_option_t *options;
+    rgdi_adapt_t adapt;
+    rgdi_overlays_t overlays;
+    int despeckle, toner_save;
+    rgdi_encoder_t encoder;     /* copied per sheet */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sheet_t *sheet;
+    int next;                   /* next sheet to hand out */
+    int written;                /* sheets written so far */
+    int window;                 /* sheets converted ahead of the writer */
+    int live;                   /* workers that may still convert a sheet */
+} job_t;
+
+/* A raster header as cgpdftoraster would have written for the page, for
+ * the adaptation and PJL settings and the gray threshold */
+static void page_header(const job_t *job, unsigned int width, unsigned int height,
+                        cups_page_header2_t *header)
+{
+    memset(header, 0, sizeof(*header));
+    header->HWResolution[0] = header->HWResolution[1] = RGDI_RESOLUTION;
+    header->cupsWidth = width;
+    header->cupsHeight = height;
+    header->cupsBitsPerColor = 8;
+    header->cupsBitsPerPixel = 8;
+    header->cupsBytesPerLine = width;
+    header->cupsColorSpace = CUPS_CSPACE_SW;
+    header->MediaPosition = job->manual_feed;
+    snprintf(header->cupsPageSizeName, sizeof(header->cupsPageSizeName), "%s", job->paper);
+}
+
+/* Render page number (from 0) at 600 dpi into a packed bitmap, band by
+ * band from a display list, so the page is interpreted once */
+static unsigned char *render_page(const job_t *job, fz_context *ctx, fz_document *doc,
+                                  int number, cups_page_header2_t *header,
+                                  unsigned int *out_width, unsigned int *out_height,
+                                  size_t *out_size)
+{
+    fz_page *page = NULL;
+    fz_display_list *list = NULL;
+    fz_pixmap *pix = NULL;
+    fz_device *dev = NULL;
+    unsigned char *pbm = NULL;
+
+    fz_var(page);
+    fz_var(list);
+    fz_var(pix);
+    fz_var(dev);
+    fz_var(pbm);
+    fz_try(ctx) {
+        page = fz_load_page(ctx, doc, number);
+        fz_matrix ctm = fz_scale(RGDI_RESOLUTION / 72.0f, RGDI_RESOLUTION / 72.0f);
+        fz_irect box = fz_round_rect(fz_transform_rect(fz_bound_page(ctx, page), ctm));
+        unsigned int width = box.x1 - box.x0, height = box.y1 - box.y0;
+        size_t stride = GDI_BITMAP_STRIDE(width);
+
+        page_header(job, width, height, header);
+        pbm = calloc(stride ? stride : 1, height ? height : 1);
+        if (!pbm)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "out of memory for the page");
+        list = fz_new_display_list_from_page(ctx, page);
+
+        for (unsigned int y = 0; y < height && !cancelled; y += BAND_LINES) {
+            fz_irect band = box;
+            band.y0 = box.y0 + y;
+            band.y1 = height - y < BAND_LINES ? box.y1 : band.y0 + BAND_LINES;
+            pix = fz_new_pixmap_with_bbox(ctx, fz_device_gray(ctx), band, NULL, 0);
+            fz_clear_pixmap_with_value(ctx, pix, 255);
+            dev = fz_new_draw_device(ctx, fz_identity, pix);
+            fz_run_display_list(ctx, list, dev, ctm, fz_rect_from_irect(band), NULL);
+            fz_close_device(ctx, dev);
+            fz_drop_device(ctx, dev);
+            dev = NULL;
+
+            const unsigned char *samples = fz_pixmap_samples(ctx, pix);
+            size_t samples_stride = fz_pixmap_stride(ctx, pix);
+            for (int row = 0; row < band.y1 - band.y0; row++)
+                rgdi_pack_line(header, samples + row * samples_stride,
+                               pbm + (y + row) * stride);
+            fz_drop_pixmap(ctx, pix);
+            pix = NULL;
+        }
+        *out_width = width;
+        *out_height = height;
+        *out_size = stride * height;
+    }
+    fz_always(ctx) {
+        fz_drop_device(ctx, dev);
+        fz_drop_pixmap(ctx, pix);
+        fz_drop_display_list(ctx, list);
+        fz_drop_page(ctx, page);
+    }
+    fz_catch(ctx) {
+        gdi_log(LOG_ERR, "cannot render page %d: %s", number + 1, fz_caught_message(ctx));
+        free(pbm);
+        return NULL;
+    }
+    return pbm;
+}
+
+/* Render, adapt, impose, clean up and encode sheet s */
+static void convert_sheet(job_t *job, fz_context *ctx, fz_document *doc, rgdi_nup_t *nup,
+                          int s, sheet_t *out)
+{
+    int first = s * job->number_up;
+    int last = first + job->number_up < job->pages ? first + job->number_up : job->pages;
+    cups_page_header2_t header;
+    unsigned char *pbm = NULL;
+    unsigned int width = 0, height = 0;
+    size_t size;
+
+    for (int p = first; p < last && !cancelled; p++) {
+        unsigned char *page = render_page(job, ctx, doc, p, &header, &width, &height, &size);
+        if (!page)
+            continue;
+        if (rgdi_adapt_page(&job->adapt, &header, p + 1, &page, &width, &height, &size) < 0) {
+            gdi_log(LOG_ERR, "failed to adapt page %d", p + 1);
+            free(page);
+            continue;
+        }
+        rgdi_overlays_apply(&job->overlays, page, width, height);
+        if (job->number_up == 1) {
+            pbm = page;
+            break;
+        }
+        if (rgdi_nup_add(nup, &header, page, width, height) < 0)
+            gdi_log(LOG_ERR, "failed to impose page %d", p + 1);
+        free(page);
+    }
+    if (job->number_up > 1)
+        pbm = rgdi_nup_take(nup, &header, &width, &height, &size);
+    if (!pbm || cancelled) {
+        free(pbm);
+        return;
+    }
+
+    if (job->despeckle && gdi_bitmap_despeckle(pbm, width, height, job->despeckle) < 0)
+        gdi_log(LOG_WARNING, "sheet %d: out of memory for despeckling", s + 1);
+    if (job->toner_save && gdi_bitmap_thin(pbm, width, height) < 0)
+        gdi_log(LOG_WARNING, "sheet %d: out of memory for toner saving", s + 1);
+
+    rgdi_encoder_t enc = job->encoder;
+    out->jbig = rgdi_encode(&enc, pbm, width, height, &out->jbig_size);
+    out->dots = enc.dots;
+    rgdi_page_info_from_header(&out->info, &header, width, height);
+    if (!out->jbig && !cancelled)
+        gdi_log(LOG_ERR, "failed to JBIG-compress sheet %d", s + 1);
+    free(pbm);
+}
+
+/* A worker is done taking sheets; the writer stops waiting once none is left */
+static void worker_exit(job_t *job)
+{
+    pthread_mutex_lock(&job->lock);
+    job->live--;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Take sheets in order, up to the window ahead of the writer */
+static void *worker_main(void *arg)
+{
+    job_t *job = arg;
+    fz_context *ctx = fz_clone_context(job->ctx);
+    fz_document *doc = NULL;
+    fz_stream *stream = NULL;
+    rgdi_nup_t nup;
+
+    if (!ctx) {
+        gdi_log(LOG_ERR, "cannot clone the MuPDF context");
+        worker_exit(job);
+        return NULL;
+    }
+    fz_var(doc);
+    fz_var(stream);
+    fz_try(ctx) {
+        stream = fz_open_memory(ctx, job->pdf, job->pdf_size);
+        doc = fz_open_document_with_stream(ctx, "application/pdf", stream);
+    }
+    fz_always(ctx) {
+        fz_drop_stream(ctx, stream);
+    }
+    fz_catch(ctx) {
+        gdi_log(LOG_ERR, "cannot open the document: %s", fz_caught_message(ctx));
+        fz_drop_context(ctx);
+        worker_exit(job);
+        return NULL;
+    }
+    rgdi_nup_from_options(&nup, job->num_options, job->options);
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        while (!cancelled && job->next < job->sheets && job->next >= job->written + job->window)
+            pthread_cond_wait(&job->cond, &job->lock);
+        int s = !cancelled && job->next < job->sheets ? job->next++ : -1;
+        pthread_mutex_unlock(&job->lock);
+        if (s < 0)
+            break;
+
+        sheet_t *out = &job->sheet[s];
+        convert_sheet(job, ctx, doc, &nup, s, out);
+
+        pthread_mutex_lock(&job->lock);
+        out->done = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    rgdi_nup_free(&nup);
+    fz_drop_document(ctx, doc);
+    fz_drop_context(ctx);
+    worker_exit(job);
+    return NULL;
+}
+
+/* The whole input, which MuPDF needs to seek in */
+static unsigned char *read_all(int fd, size_t *size)
+{
+    rgdi_buffer_t buf = { NULL, 0, 0, 0 };
+    unsigned char chunk[65536];
+    for (;;) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR && !cancelled) continue;
+        if (n < 0) {
+            rgdi_buffer_free(&buf);
+            return NULL;
+        }
+        if (n == 0) break;
+        if (rgdi_buffer_append(&buf, chunk, (size_t)n) < 0) {
+            rgdi_buffer_free(&buf);
+            return NULL;
+        }
+    }
+    *size = buf.size;
+    return buf.data;
+}
+
+/* Threads from the PPD's RicohWorkers choice, else one per CPU */
+static int worker_count(int num_options, cups_option_t *options, int sheets)
+{
+    const char *choice = cupsGetOption("RicohWorkers", num_options, options);
+    long n = choice ? atol(choice) : 0;
+    if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > MAX_WORKERS) n = MAX_WORKERS;
+    if (n > sheets) n = sheets;
+    return n > 0 ? (int)n : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *user = argc > 2 ? argv[2] : "unknown";
+    cups_option_t *options = NULL;
+    int num_options = 0;
+    int page_count = 0, write_failed = 0, convert_failed = 0;
+    job_t job;
+
+    gdi_log_open("pdftoricoh");
+    if (argc < 6 || argc > 7) {
+        fprintf(stderr, "Usage: %s job user title copies options [file]\n", argv[0]);
+        return 1;
+    }
+    num_options = cupsParseOptions(argv[5], 0, &options);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigterm;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = argc == 7 ? open(argv[6], O_RDONLY) : 0;
+    if (fd < 0) {
+        gdi_log(LOG_ERR, "cannot open input file %s", argv[6]);
+        return 1;
+    }
+    memset(&job, 0, sizeof(job));
+    job.pdf = read_all(fd, &job.pdf_size);
+    if (fd > 0) close(fd);
+    if (!job.pdf) {
+        gdi_log(LOG_ERR, "cannot read the PDF: %s", strerror(errno));
+        return 1;
+    }
+
+    fz_locks_context locks = { NULL, lock_fz, unlock_fz };
+    for (int i = 0; i < FZ_LOCK_MAX; i++)
+        pthread_mutex_init(&fz_mutexes[i], NULL);
+    job.ctx = fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
+    if (!job.ctx) {
+        gdi_log(LOG_ERR, "cannot create the MuPDF context");
+        return 1;
+    }
+    fz_register_document_handlers(job.ctx);
+
+    /* No anti-aliasing: the gray is thresholded to 1 bit anyway, and
+     * hard edges render faster and match cgpdftoraster's output */
+    fz_set_aa_level(job.ctx, 0);
+
+    fz_document *doc = NULL;
+    fz_stream *stream = NULL;
+    fz_var(doc);
+    fz_var(stream);
+    fz_try(job.ctx) {
+        stream = fz_open_memory(job.ctx, job.pdf, job.pdf_size);
+        doc = fz_open_document_with_stream(job.ctx, "application/pdf", stream);
+        job.pages = fz_count_pages(job.ctx, doc);
+    }
+    fz_always(job.ctx) {
+        fz_drop_stream(job.ctx, stream);
+        fz_drop_document(job.ctx, doc);
+    }
+    fz_catch(job.ctx) {
+        gdi_log(LOG_ERR, "cannot open the PDF: %s", fz_caught_message(job.ctx));
+        fz_drop_context(job.ctx);
+        return 1;
+    }
+
+    /* The paper and tray come as job options here, not in a raster
+     * header; without a size the PDF's own page size is kept */
+    const char *paper = cupsGetOption("PageSize", num_options, options);
+    if (!paper) paper = cupsGetOption("media", num_options, options);
+    if (paper)
+        snprintf(job.paper, sizeof(job.paper), "%.*s", (int)strcspn(paper, ","), paper);
+    const char *slot = cupsGetOption("InputSlot", num_options, options);
+    job.manual_feed = slot && strcasecmp(slot, "MANUALFEED") == 0;
+
+    /* The same stages and options as rastertericoh */
+    job.num_options = num_options;
+    job.options = options;
+    rgdi_adapt_t adapt = RGDI_ADAPT_INIT;
+    job.adapt = adapt;
+    rgdi_adapt_from_options(&job.adapt, num_options, options);
+    rgdi_overlays_from_options(&job.overlays, num_options, options);
+    job.despeckle = rgdi_despeckle_from_options(num_options, options);
+    job.toner_save = rgdi_option_enabled("ricoh-toner-save", num_options, options);
+    rgdi_encoder_t encoder = RGDI_ENCODER_INIT;
+    job.encoder = encoder;
+    job.encoder.cancel = &cancelled;
+    rgdi_guard_from_options(&job.encoder, num_options, options);
+    rgdi_nup_t nup;
+    rgdi_nup_from_options(&nup, num_options, options);
+    job.number_up = nup.number_up;
+    job.sheets = (job.pages + job.number_up - 1) / job.number_up;
+    rgdi_nup_free(&nup);
+
+    gdi_log(LOG_INFO, "event=start job=%s pages=%d sheets=%d", argv[1], job.pages,
+            job.sheets);
+
+    rgdi_sink_t *sink;
+    const char *socket_address = cupsGetOption("ricoh-socket", num_options, options);
+    if (socket_address && *socket_address)
+        sink = rgdi_sink_socket(socket_address, &cancelled);
+    else
+        sink = rgdi_sink_fd(1);
+    rgdi_writer_t writer;
+    if (!sink || rgdi_writer_start(&writer, sink) < 0) {
+        if (sink) rgdi_sink_close(sink);
+        fz_drop_context(job.ctx);
+        return cancelled ? 0 : 1;
+    }
+
+    char timestamp[64];
+    rgdi_pjl_timestamp(timestamp, sizeof(timestamp),
+                       rgdi_option_enabled("ricoh-fixed-timestamp", num_options, options));
+
+    /* Convert on the workers, write here in order */
+    int workers = worker_count(num_options, options, job.sheets);
+    pthread_t threads[MAX_WORKERS];
+    int started = 0;
+    job.sheet = calloc(job.sheets ? job.sheets : 1, sizeof(sheet_t));
+    job.window = 2 * workers;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    job.live = workers;
+    for (int i = 0; job.sheet && i < workers; i++)
+        if (pthread_create(&threads[started], NULL, worker_main, &job) == 0)
+            started++;
+    if (!started)
+        gdi_log(LOG_ERR, "cannot start the conversion threads");
+    pthread_mutex_lock(&job.lock);
+    job.live -= workers - started;
+    pthread_mutex_unlock(&job.lock);
+
+    for (int s = 0; started && s < job.sheets && !cancelled; s++) {
+        sheet_t *sheet = &job.sheet[s];
+
+        /* Timed, so a cancel is noticed while a sheet is converted */
+        pthread_mutex_lock(&job.lock);
+        while (!sheet->done && !cancelled && job.live > 0) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += 100 * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&job.cond, &job.lock, &until);
+        }
+        int orphaned = !sheet->done && !cancelled;
+        pthread_mutex_unlock(&job.lock);
+        if (orphaned) {
+            /* Every worker failed before it got to this sheet */
+            gdi_log(LOG_ERR, "no conversion thread left for sheet %d", s + 1);
+            convert_failed = 1;
+            break;
+        }
+        if (cancelled || !sheet->jbig)
+            goto next;
+
+        gdi_log(LOG_INFO, "event=page page=%d bytes=%zu", page_count + 1, sheet->jbig_size);
+        rgdi_page_t *page = rgdi_page_new(sheet->jbig, sheet->jbig_size);
+        if (!page) {
+            free(sheet->jbig);
+        } else {
+            if (page_count == 0)
+                rgdi_pjl_job_header(&page->head, timestamp, user);
+            rgdi_pjl_page_header(&page->head, &sheet->info, sheet->jbig_size);
+            rgdi_pjl_page_footer(&page->tail, sheet->dots);
+            if (rgdi_writer_submit(&writer, page) < 0) {
+                write_failed = 1;
+                cancelled = 1;      /* stop the workers too */
+            } else {
+                page_count++;
+            }
+        }
+        sheet->jbig = NULL;
+next:
+        pthread_mutex_lock(&job.lock);
+        job.written = s + 1;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+    }
+
+    pthread_mutex_lock(&job.lock);
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    if (cancelled && !write_failed)
+        page_count -= rgdi_writer_cancel(&writer);
+    if (page_count > 0 && !write_failed) {
+        rgdi_page_t *footer = rgdi_page_new(NULL, 0);
+        if (footer) {
+            rgdi_pjl_job_footer(&footer->head);
+            if (rgdi_writer_submit(&writer, footer) < 0)
+                write_failed = 1;
+        }
+    }
+    if (rgdi_writer_finish(&writer) < 0)
+        write_failed = 1;
+
+    if (write_failed || convert_failed)
+        gdi_log(LOG_ERR, "job aborted after %d page(s)", page_count);
+    else if (cancelled)
+        gdi_log(LOG_INFO, "job cancelled after %d page(s)", page_count);
+    else
+        gdi_log(LOG_INFO, "event=end pages=%d", page_count);
+
+    for (int s = 0; job.sheet && s < job.sheets; s++)
+        free(job.sheet[s].jbig);
+    free(job.sheet);
+    if (cancelled)
+        rgdi_sink_close_cancelled(sink);
+    else
+        rgdi_sink_close(sink);
+    rgdi_overlays_free(&job.overlays);
+    fz_drop_context(job.ctx);
+    free((void *)job.pdf);
+    cupsFreeOptions(num_options, options);
+    gdi_log_close();
+
+    if (cancelled && !write_failed) return 0;
+    return page_count > 0 && !write_failed && !convert_failed ? 0 : 1;
+}
@@ -6,175 +6,203 @@
  * with libjbig statically linked.
  *
  * CUPS filter chain: PDF -> cgpdftoraster -> rastertericoh -> USB backend
+ *                    text/plain -> rastertericoh -> USB backend (opt-in)
+ *                    PBM, PGM -> rastertericoh -> USB backend
+ *
+ * The conversion itself lives in libricohgdi (ricohgdi.h); this file
+ * only handles the filter's arguments, options and logging.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <syslog.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <cups/cups.h>
 #include <cups/raster.h>
-#include <jbig.h>
+#include "ricohgdi.h"
+#include "gdicapture.h"
+
+/* Memory for the per-job stripe cache (ricoh-stripe-cache=on) */
+#define STRIPE_CACHE_BYTES (16 * 1024 * 1024)
+
+/* Page cache defaults (ricoh-cache=on, ricoh-cache-size=<MB>) */
+#define PAGE_CACHE_DIR     "ricoh-page-cache"
+#define PAGE_CACHE_SIZE_MB 64
 
-/* Write PJL line with CR+LF ending */
-static void pjl_printf(const char *fmt, ...)
+/* Set by SIGTERM, which CUPS sends when the job is cancelled */
+static volatile sig_atomic_t cancelled;
+static struct timespec cancel_time;
+
+static void on_sigterm(int sig)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(stdout, fmt, ap);
-    va_end(ap);
-    fputc('\r', stdout);
-    fputc('\n', stdout);
+    (void)sig;
+    if (!cancelled)
+        clock_gettime(CLOCK_MONOTONIC, &cancel_time);
+    cancelled = 1;
 }
 
-/* Write raw bytes to stdout */
-static void write_bytes(const unsigned char *data, size_t len)
+/* Milliseconds since the job was cancelled */
+static double cancel_latency_ms(void)
 {
-    fwrite(data, 1, len, stdout);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - cancel_time.tv_sec) * 1e3 +
+           (now.tv_nsec - cancel_time.tv_nsec) / 1e6;
 }
 
-/* Convert CUPS raster page to packed PBM (1-bit) format.
- * CUPS raster for a B&W printer should already be 1-bit,
- * but we handle 8-bit grayscale too just in case. */
-static unsigned char *raster_to_pbm(cups_page_header2_t *header,
-                                     cups_raster_t *ras,
-                                     unsigned int *out_width,
-                                     unsigned int *out_height,
-                                     size_t *out_size)
+static double now_ms(void)
 {
-    unsigned int width = header->cupsWidth;
-    unsigned int height = header->cupsHeight;
-    unsigned int bpl = header->cupsBytesPerLine;
-    /* PBM row stride: ceil(width/8) */
-    unsigned int pbm_stride = (width + 7) / 8;
-    size_t pbm_size = (size_t)pbm_stride * height;
-    unsigned char *pbm = calloc(1, pbm_size);
-    unsigned char *line = malloc(bpl);
-
-    if (!pbm || !line) {
-        syslog(LOG_ERR, "rastertericoh: memory allocation failed");
-        free(pbm);
-        free(line);
-        return NULL;
-    }
-
-    for (unsigned int y = 0; y < height; y++) {
-        if (cupsRasterReadPixels(ras, line, bpl) != bpl) {
-            syslog(LOG_ERR, "rastertericoh: short read at line %u", y);
-            break;
-        }
-
-        unsigned char *dst = pbm + (size_t)y * pbm_stride;
-
-        if (header->cupsBitsPerPixel == 1) {
-            /* Already 1-bit packed - but CUPS uses 0=white, 1=black
-             * which matches PBM convention. Just copy. */
-            memcpy(dst, line, pbm_stride);
-        } else if (header->cupsBitsPerPixel == 8) {
-            /* 8-bit grayscale: threshold at 128
-             * CUPS: 0=black, 255=white for COLORSPACE_W
-             * PBM: 1=black, 0=white
-             * So: if pixel < 128 -> black (1), else white (0) */
-            memset(dst, 0, pbm_stride);
-            for (unsigned int x = 0; x < width; x++) {
-                int black;
-                if (header->cupsColorSpace == CUPS_CSPACE_W ||
-                    header->cupsColorSpace == CUPS_CSPACE_SW) {
-                    /* White colorspace: 0=black, 255=white */
-                    black = (line[x] < 128);
-                } else {
-                    /* K colorspace: 0=white, 255=black */
-                    black = (line[x] >= 128);
-                }
-                if (black) {
-                    dst[x / 8] |= (0x80 >> (x % 8));
-                }
-            }
-        } else {
-            syslog(LOG_WARNING, "rastertericoh: unsupported bpp=%u, treating as 1-bit",
-                   header->cupsBitsPerPixel);
-            memcpy(dst, line, pbm_stride < bpl ? pbm_stride : bpl);
-        }
-    }
-
-    free(line);
-    *out_width = width;
-    *out_height = height;
-    *out_size = pbm_size;
-    return pbm;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
 }
 
-/* JBIG output callback - collect compressed data */
-typedef struct {
-    unsigned char *data;
-    size_t size;
-    size_t capacity;
-} jbig_buffer_t;
+/* What the filter was given: CUPS raster, or plain text or a PBM/PGM
+ * image, which CUPS routes here instead of through PDF and raster */
+enum { INPUT_RASTER, INPUT_TEXT, INPUT_IMAGE };
 
-static void jbig_data_cb(unsigned char *start, size_t len, void *file)
+/* CONTENT_TYPE names the job's type for every filter in the chain, so
+ * the start of the file must agree: no raster sync word for text, a
+ * netpbm magic number for images. CUPS hands the first filter a file,
+ * which pread() can peek at; a pipe is always raster. */
+static int input_kind(int fd)
 {
-    jbig_buffer_t *buf = (jbig_buffer_t *)file;
-    if (buf->size + len > buf->capacity) {
-        size_t new_cap = buf->capacity * 2;
-        if (new_cap < buf->size + len)
-            new_cap = buf->size + len + 65536;
-        unsigned char *new_data = realloc(buf->data, new_cap);
-        if (!new_data) {
-            syslog(LOG_ERR, "rastertericoh: JBIG buffer realloc failed");
-            return;
-        }
-        buf->data = new_data;
-        buf->capacity = new_cap;
-    }
-    memcpy(buf->data + buf->size, start, len);
-    buf->size += len;
+    static const char *const sync[] = { "RaSt", "tSaR", "RaS2", "2SaR", "RaS3", "3SaR" };
+    const char *type = getenv("CONTENT_TYPE");
+    char head[4];
+
+    if (!type)
+        return INPUT_RASTER;
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    if (n < 0)
+        return INPUT_RASTER;
+    if (strncasecmp(type, "image/x-portable-", 17) == 0)
+        return n >= 2 && head[0] == 'P' && head[1] >= '1' && head[1] <= '6'
+            ? INPUT_IMAGE : INPUT_RASTER;
+    if (strncasecmp(type, "text/plain", 10) != 0)
+        return INPUT_RASTER;
+    for (size_t i = 0; n == 4 && i < sizeof(sync) / sizeof(sync[0]); i++)
+        if (memcmp(head, sync[i], 4) == 0) return INPUT_RASTER;
+    return INPUT_TEXT;
 }
 
-/* Compress PBM data to JBIG1 with the specific parameters for Ricoh printers */
-static unsigned char *pbm_to_jbig(const unsigned char *pbm,
-                                   unsigned int width,
-                                   unsigned int height,
-                                   size_t *out_size)
+/* Next page of text or image input, with the header it stands for */
+static int next_page(gdi_text_t *text, rgdi_pnm_t *pnm, const cups_page_header2_t *job,
+                     cups_page_header2_t *header, unsigned char **pbm,
+                     unsigned int *width, unsigned int *height, size_t *size)
 {
-    struct jbg_enc_state enc;
-    jbig_buffer_t buf = {NULL, 0, 0};
-
-    buf.capacity = 65536;
-    buf.data = malloc(buf.capacity);
-    if (!buf.data) return NULL;
-
-    unsigned char *pbm_mut = (unsigned char *)pbm;
-    jbg_enc_init(&enc, width, height, 1, &pbm_mut, jbig_data_cb, &buf);
-
-    /* Parameters matching the original driver:
-     * -p 72  -> l0 = 72 (lines per stripe)
-     * -o 3   -> order = JBG_HITOLO | JBG_SEQ = 3
-     * -m 0   -> mx = 0 (no AT moves)
-     * -q     -> options = JBG_TPBON (typical prediction) */
-    jbg_enc_options(&enc, JBG_HITOLO | JBG_SEQ, JBG_TPBON, 72, 0, 0);
-    jbg_enc_out(&enc);
-    jbg_enc_free(&enc);
-
-    *out_size = buf.size;
-    return buf.data;
+    *header = *job;
+    if (!text)
+        return rgdi_pnm_read(pnm, header, pbm, width, height, size);
+    int more = gdi_text_next(text, pbm);
+    *width = header->cupsWidth;
+    *height = header->cupsHeight;
+    *size = (size_t)header->cupsBytesPerLine * header->cupsHeight;
+    if (more < 0 && !cancelled)
+        gdi_log(LOG_ERR, "cannot lay out text: %s", strerror(errno));
+    return more;
 }
 
-/* Map CUPS page size name to PJL paper name */
-static const char *cups_to_pjl_paper(const char *cups_size)
+/* Hand the job to the conversion daemon: send it our input and output
+ * fds and wait for its verdict. Returns the filter's exit status, or -1
+ * if the daemon cannot be reached, in which case we convert in-process. */
+static int run_in_daemon(const char *path, int in_fd, int argc, char *argv[])
 {
-    if (!cups_size) return "A4";
-    if (strcasecmp(cups_size, "A4") == 0) return "A4";
-    if (strcasecmp(cups_size, "Letter") == 0) return "LETTER";
-    if (strcasecmp(cups_size, "Legal") == 0) return "LEGAL";
-    if (strcasecmp(cups_size, "A5") == 0) return "A5";
-    if (strcasecmp(cups_size, "A6") == 0) return "A6";
-    if (strcasecmp(cups_size, "B5") == 0) return "B5";
-    if (strcasecmp(cups_size, "B6") == 0) return "B6";
-    if (strcasecmp(cups_size, "Monarch") == 0) return "MONARCH";
-    return "A4";
+    struct sockaddr_un addr;
+    char request[8192];
+    const char *queue = getenv("PRINTER");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path) >=
+        (int)sizeof(addr.sun_path))
+        return -1;
+
+    int len = snprintf(request, sizeof(request), "JOB\n%s\n%s\n%s\n%s\n\n",
+                       queue ? queue : "default", argc > 1 ? argv[1] : "0",
+                       argc > 2 ? argv[2] : "unknown", argc > 5 ? argv[5] : "");
+    if (len < 0 || len >= (int)sizeof(request)) return -1;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        gdi_log(LOG_WARNING, "daemon %s not available (%s), converting here",
+                path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int fds[2] = { in_fd, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = { request, (size_t)len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) != len) {
+        gdi_log(LOG_WARNING, "cannot hand job to daemon: %s, converting here",
+                strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    /* From here on the daemon owns the input, so there is no fallback.
+     * A cancel is passed on and the daemon still replies. */
+    char reply[256];
+    size_t got = 0;
+    int cancel_sent = 0;
+    while (got < sizeof(reply) - 1) {
+        if (cancelled && !cancel_sent) {
+            cancel_sent = 1;
+            if (write(sock, "CANCEL\n", 7) != 7)
+                break;
+        }
+        ssize_t n = read(sock, reply + got, sizeof(reply) - 1 - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+        if (memchr(reply, '\n', got)) break;
+    }
+    close(sock);
+    reply[got] = '\0';
+    reply[strcspn(reply, "\n")] = '\0';
+
+    /* Page accounting for CUPS; with ricoh-coalesce the printer may
+     * count this job's pages as part of an earlier one */
+    int pages = 0, earlier = 0;
+    if (cancelled) {
+        gdi_log(LOG_INFO, "job cancelled in daemon, %.1f ms to tear down",
+                cancel_latency_ms());
+        return 0;
+    }
+    if (sscanf(reply, "OK %d %d", &pages, &earlier) >= 1) {
+        gdi_log(LOG_INFO, "job complete in daemon, %d page(s)", pages);
+        fprintf(stderr, "PAGE: total %d\n", pages);
+        if (earlier > 0)
+            fprintf(stderr, "INFO: Printed in one printer job with %d earlier job(s)\n",
+                    earlier);
+        return pages > 0 ? 0 : 1;
+    }
+    gdi_log(LOG_ERR, "daemon failed the job: %s", got ? reply : "no reply");
+    return 1;
 }
 
 int main(int argc, char *argv[])
@@ -183,119 +211,386 @@ int main(int argc, char *argv[])
     cups_page_header2_t header;
     int fd;
     int page_count = 0;
+    int write_failed = 0;
     const char *user = argc > 2 ? argv[2] : "unknown";
-
-    openlog("rastertericoh", LOG_PID, LOG_LPR);
-    syslog(LOG_INFO, "starting, argc=%d", argc);
+    cups_option_t *options = NULL;
+    int num_options = 0;
+    rgdi_sink_t *sink;
+    rgdi_writer_t writer;
+    rgdi_encoder_t encoder = RGDI_ENCODER_INIT;
+    rgdi_adapt_t adapt = RGDI_ADAPT_INIT;
+    rgdi_overlays_t overlays;
+    rgdi_nup_t nup;
+    page_cache_t cache;
+    stripe_cache_t stripes;
+
+    /* Per-page records are key=value and only formatted at RICOH_GDI_LOG
+     * info or debug; messages are passed to syslog off the hot path */
+    gdi_log_open("rastertericoh");
+    gdi_log(LOG_INFO, "event=start job=%s argc=%d", argc > 1 ? argv[1] : "-", argc);
+
+    if (argc > 5)
+        num_options = cupsParseOptions(argv[5], 0, &options);
 
     /* Open raster input */
     if (argc >= 7) {
         fd = open(argv[6], O_RDONLY);
         if (fd < 0) {
-            syslog(LOG_ERR, "cannot open input file %s", argv[6]);
+            gdi_log(LOG_ERR, "cannot open input file %s", argv[6]);
             return 1;
         }
     } else {
         fd = 0; /* stdin */
     }
 
-    ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
-    if (!ras) {
-        syslog(LOG_ERR, "cannot open raster stream");
+    /* Cancellation: no SA_RESTART, so blocking reads return early */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigterm;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int input = input_kind(fd);
+
+    /* Optional conversion daemon (ricoh-daemon=on or a socket path),
+     * which takes raster only */
+    const char *daemon_opt = cupsGetOption("ricoh-daemon", num_options, options);
+    if (input == INPUT_RASTER && daemon_opt && *daemon_opt && strcasecmp(daemon_opt, "off") != 0 &&
+        strcasecmp(daemon_opt, "false") != 0 && strcasecmp(daemon_opt, "no") != 0) {
+        const char *path = daemon_opt[0] == '/' ? daemon_opt : RGDI_DAEMON_SOCKET;
+        int status = run_in_daemon(path, fd, argc, argv);
+        if (status >= 0) {
+            if (fd > 0) close(fd);
+            cupsFreeOptions(num_options, options);
+            gdi_log_close();
+            return status;
+        }
+    }
+
+    /* Optional capture for offline replay: ricoh-capture=on keeps the
+     * raster, ricoh-capture=hashes only stripe hashes and a few samples */
+    const char *capture_opt = cupsGetOption("ricoh-capture", num_options, options);
+    const char *tmpdir = getenv("TMPDIR");
+    gdi_capture_t *capture = NULL;
+    if (input == INPUT_RASTER && capture_opt && tmpdir &&
+        (rgdi_option_enabled("ricoh-capture", num_options, options) ||
+         strcasecmp(capture_opt, "hashes") == 0)) {
+        char capture_dir[1024];
+        snprintf(capture_dir, sizeof(capture_dir), "%s/%s", tmpdir, GDI_CAPTURE_DIR);
+        capture = gdi_capture_open(capture_dir,
+                                   strcasecmp(capture_opt, "hashes") == 0
+                                       ? GDI_CAPTURE_HASHES : GDI_CAPTURE_FULL,
+                                   fd, argv);
+    }
+
+    /* Plain text pages are laid out with the built-in font at the
+     * paper, margins and pitch of the job's options (cpi, lpi, page-*);
+     * images take their paper and resolution from the options */
+    gdi_text_t *text = NULL;
+    rgdi_pnm_t pnm;
+    cups_page_header2_t job_header;
+    ras = NULL;
+    if (input == INPUT_TEXT) {
+        gdi_text_layout_t layout;
+        rgdi_text_from_options(&layout, &job_header, num_options, options);
+        text = gdi_text_open(fd, &layout);
+        if (!text) {
+            gdi_log(LOG_ERR, "cannot lay out text on %s (%u x %u characters)",
+                    job_header.cupsPageSizeName, layout.columns, layout.lines);
+            gdi_capture_close(capture);
+            return 1;
+        }
+        gdi_log(LOG_INFO, "event=text paper=%s columns=%u lines=%u",
+                job_header.cupsPageSizeName, layout.columns, layout.lines);
+    } else if (input == INPUT_IMAGE) {
+        rgdi_job_header_from_options(&job_header, num_options, options);
+        rgdi_pnm_open(&pnm, fd);
+    } else {
+        ras = capture ? gdi_capture_raster(capture) : cupsRasterOpen(fd, CUPS_RASTER_READ);
+        if (!ras) {
+            gdi_log(LOG_ERR, "cannot open raster stream");
+            gdi_capture_close(capture);
+            return 1;
+        }
+    }
+
+    /* Write errors are reported by write(), not by a signal */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Timeline of this job's internals with RICOH_GDI_TRACE=1 */
+    gdi_trace_open(argv[1]);
+    gdi_trace_thread("main");
+
+    /* Raw socket output (ricoh-socket=host[:port]) bypasses the backend */
+    const char *socket_address = cupsGetOption("ricoh-socket", num_options, options);
+    if (socket_address && *socket_address)
+        sink = rgdi_sink_socket(socket_address, &cancelled);
+    else
+        sink = rgdi_sink_fd(1);
+    if (!sink) {
+        cupsRasterClose(ras);
+        gdi_text_close(text);
+        gdi_capture_close(capture);
+        return cancelled ? 0 : 1;
+    }
+
+    if (rgdi_writer_start(&writer, sink) < 0) {
+        rgdi_sink_close(sink);
+        cupsRasterClose(ras);
+        gdi_text_close(text);
+        gdi_capture_close(capture);
         return 1;
     }
 
-    /* Timestamp for PJL */
-    time_t now = time(NULL);
-    struct tm *tm = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y/%m/%d %H:%M:%S", tm);
+    /* Encoding stops at the next stripe boundary on cancel */
+    encoder.cancel = &cancelled;
+
+    /* Compressed page cache under the CUPS-provided $TMPDIR */
+    if (rgdi_option_enabled("ricoh-cache", num_options, options) && tmpdir) {
+        const char *size_opt = cupsGetOption("ricoh-cache-size", num_options, options);
+        long size_mb = size_opt ? atol(size_opt) : PAGE_CACHE_SIZE_MB;
+        char cache_dir[1024];
+        snprintf(cache_dir, sizeof(cache_dir), "%s/%s", tmpdir, PAGE_CACHE_DIR);
+        if (size_mb > 0 && page_cache_open(&cache, cache_dir, (off_t)size_mb << 20) == 0)
+            encoder.page_cache = &cache;
+    }
+
+    /* Independently coded (SDRST) stripes, so repeated stripes such as
+     * letterheads and footers are copied instead of re-encoded. With the
+     * page cache on they persist across jobs too. */
+    if (rgdi_option_enabled("ricoh-stripe-cache", num_options, options)) {
+        stripe_cache_init(&stripes, STRIPE_CACHE_BYTES, encoder.page_cache);
+        encoder.stripe_cache = &stripes;
+    }
+
+    /* Latency guard: pages that blow the ricoh-page-budget=<ms> time or
+     * size budget have their remaining stripes dithered */
+    rgdi_guard_from_options(&encoder, num_options, options);
 
-    /* Process pages */
-    while (cupsRasterReadHeader2(ras, &header)) {
+    /* Resolution, orientation and paper adaptation (ricoh-downsample,
+     * ricoh-rotate, ricoh-mirror, ricoh-transform-pages, ricoh-fit) */
+    rgdi_adapt_from_options(&adapt, num_options, options);
+
+    /* Forms and stamps drawn into every page (ricoh-overlay,
+     * ricoh-overlay-knockout), mapped once for the job */
+    rgdi_overlays_from_options(&overlays, num_options, options);
+
+    /* 2-up and 4-up sheets (ricoh-number-up, ricoh-number-up-border) */
+    rgdi_nup_from_options(&nup, num_options, options);
+
+    /* Toner economy: solid black thinned to half density inside its
+     * outlines (ricoh-toner-save=on) */
+    int toner_save = rgdi_option_enabled("ricoh-toner-save", num_options, options);
+
+    /* Scan cleanup: isolated pixels (ricoh-despeckle=pixels), and
+     * isolated pairs too (ricoh-despeckle=on) */
+    int despeckle = rgdi_despeckle_from_options(num_options, options);
+    unsigned long despeckled_total = 0;
+
+    /* Timestamp for PJL. The fixed-timestamp mode makes the output of a
+     * job depend only on its input, so whole jobs can be compared or
+     * cached downstream. */
+    char timestamp[64];
+    rgdi_pjl_timestamp(timestamp, sizeof(timestamp),
+                       rgdi_option_enabled("ricoh-fixed-timestamp", num_options, options));
+
+    /* Process pages; with ricoh-number-up each sheet collects pages
+     * until it is full and is then encoded as one page */
+    int pages_read = 0;
+
+    /* Copies of text and images are made here, as CUPS leaves them to
+     * the first filter (cupsManualCopies); raster arrives with its
+     * copies made */
+    int copies = !ras && argc > 4 ? atoi(argv[4]) : 1, copy = 1;
+    for (;;) {
         unsigned int width, height;
         size_t pbm_size, jbig_size;
+        unsigned char *pbm;
 
-        if (header.cupsBytesPerLine == 0 || header.cupsHeight == 0) {
-            syslog(LOG_WARNING, "empty page, skipping");
-            continue;
-        }
+        uint64_t span = gdi_trace_begin();
+        if (cancelled)
+            break;
+        int more;
+        if (!ras)
+            more = next_page(text, &pnm, &job_header, &header, &pbm, &width, &height,
+                             &pbm_size);
+        else
+            more = cupsRasterReadHeader2(ras, &header);
+        if (more <= 0) {
+            /* A partly filled sheet is the last page of the copy or job */
+            if (!(pbm = rgdi_nup_take(&nup, &header, &width, &height, &pbm_size))) {
+                if (more < 0 || copy >= copies)
+                    break;
+                if ((text ? gdi_text_rewind(text) : rgdi_pnm_rewind(&pnm)) < 0) {
+                    gdi_log(LOG_WARNING, "cannot reread the input, printed %d of %d "
+                            "copies", copy, copies);
+                    break;
+                }
+                /* Page selection and parity start over with each copy */
+                copy++;
+                pages_read = 0;
+                continue;
+            }
+        } else {
+            gdi_trace_page(page_count + 1);
+            gdi_trace_end(text ? "lay out text" : ras ? "read header" : "read image",
+                          span, -1);
+
+            if (ras) {
+                if (header.cupsBytesPerLine == 0 || header.cupsHeight == 0) {
+                    gdi_log(LOG_WARNING, "empty page, skipping");
+                    continue;
+                }
 
-        syslog(LOG_INFO, "page %d: %ux%u, %u bpp, %u bpl, colorspace=%u",
-               page_count + 1, header.cupsWidth, header.cupsHeight,
-               header.cupsBitsPerPixel, header.cupsBytesPerLine,
-               header.cupsColorSpace);
+                gdi_log(LOG_DEBUG, "event=header page=%d width=%u height=%u bpp=%u bpl=%u colorspace=%u",
+                        pages_read + 1, header.cupsWidth, header.cupsHeight,
+                        header.cupsBitsPerPixel, header.cupsBytesPerLine,
+                        header.cupsColorSpace);
 
-        /* Read and convert raster to PBM */
-        unsigned char *pbm = raster_to_pbm(&header, ras, &width, &height, &pbm_size);
-        if (!pbm) {
-            syslog(LOG_ERR, "failed to convert raster page %d", page_count + 1);
-            continue;
+                /* Read and convert raster to PBM */
+                pbm = rgdi_raster_to_pbm(&header, ras, &width, &height, &pbm_size);
+                if (!pbm) {
+                    gdi_log(LOG_ERR, "failed to convert raster page %d", pages_read + 1);
+                    continue;
+                }
+                gdi_capture_page(capture, &header, pbm, width, height);
+            }
+
+            /* 300/1200 dpi to 600, turned, and cropped or padded to the paper */
+            if (rgdi_adapt_page(&adapt, &header, ++pages_read, &pbm, &width, &height,
+                                &pbm_size) < 0) {
+                gdi_log(LOG_ERR, "failed to adapt page %d", pages_read);
+                free(pbm);
+                continue;
+            }
+            rgdi_overlays_apply(&overlays, pbm, width, height);
+
+            if (nup.number_up > 1) {
+                int full = rgdi_nup_add(&nup, &header, pbm, width, height);
+                free(pbm);
+                if (full < 0)
+                    gdi_log(LOG_ERR, "failed to impose page %d", pages_read);
+                if (full <= 0)
+                    continue;
+                pbm = rgdi_nup_take(&nup, &header, &width, &height, &pbm_size);
+            }
         }
 
-        /* Compress to JBIG */
-        unsigned char *jbig = pbm_to_jbig(pbm, width, height, &jbig_size);
+        long despeckled = despeckle ? gdi_bitmap_despeckle(pbm, width, height, despeckle) : 0;
+        if (despeckled < 0)
+            gdi_log(LOG_WARNING, "page %d: out of memory for despeckling", page_count + 1);
+        else
+            despeckled_total += despeckled;
+        if (toner_save && gdi_bitmap_thin(pbm, width, height) < 0)
+            gdi_log(LOG_WARNING, "page %d: out of memory for toner saving, printed "
+                    "at full density", page_count + 1);
+
+        /* Compress to JBIG, unless an identical page is cached */
+        unsigned long stripe_hits = encoder.stripe_cache ? stripes.hits : 0;
+        unsigned long stripe_lookups = encoder.stripe_cache ? stripes.lookups : 0;
+        double encode_start = now_ms();
+        unsigned char *jbig = cancelled ? NULL :
+            rgdi_encode(&encoder, pbm, width, height, &jbig_size);
+        double encode_ms = now_ms() - encode_start;
         free(pbm);
+        if (cancelled) {
+            free(jbig);
+            break;
+        }
         if (!jbig) {
-            syslog(LOG_ERR, "failed to JBIG-compress page %d", page_count + 1);
+            gdi_log(LOG_ERR, "failed to JBIG-compress page %d", page_count + 1);
             continue;
         }
-
-        syslog(LOG_INFO, "page %d: JBIG compressed %zu -> %zu bytes",
-               page_count + 1, pbm_size, jbig_size);
-
-        /* Emit PJL job header before first page */
-        if (page_count == 0) {
-            fprintf(stdout, "\033%%-12345X@PJL\r\n");
-            pjl_printf("@PJL SET TIMESTAMP=%s", timestamp);
-            pjl_printf("@PJL SET FILENAME=Document");
-            pjl_printf("@PJL SET COMPRESS=JBIG");
-            pjl_printf("@PJL SET USERNAME=%s", user);
-            pjl_printf("@PJL SET COVER=OFF");
-            pjl_printf("@PJL SET HOLD=OFF");
+        gdi_log(LOG_INFO, "event=page page=%d raw=%zu bytes=%zu source=%s "
+                "stripes_reused=%lu stripes=%lu encode_ms=%.1f despeckled=%ld",
+                page_count + 1, pbm_size, jbig_size,
+                encoder.from_cache ? "page-cache" : "encoder",
+                encoder.stripe_cache ? stripes.hits - stripe_hits : 0,
+                encoder.stripe_cache ? stripes.lookups - stripe_lookups : 0,
+                encode_ms, despeckled > 0 ? despeckled : 0);
+        if (!encoder.from_cache && encoder.guard.tripped)
+            gdi_log(LOG_WARNING, "page %d: stripe %lu over budget (%zu bytes, "
+                    "%.1f ms into the page), dithered the rest of the page",
+                    page_count + 1, encoder.guard.stripe + 1,
+                    encoder.guard.stripe_bytes, encoder.guard.elapsed_ms);
+
+        rgdi_page_t *page = rgdi_page_new(jbig, jbig_size);
+        if (!page) {
+            free(jbig);
+            continue;
         }
 
-        /* Page header */
-        const char *paper = cups_to_pjl_paper(header.cupsPageSizeName);
-        int resolution = header.HWResolution[0];
-        const char *mediasource = "TRAY1";
-        if (header.MediaPosition == 1)
-            mediasource = "MANUALFEED";
-
-        pjl_printf("@PJL SET PAGESTATUS=START");
-        pjl_printf("@PJL SET COPIES=1");
-        pjl_printf("@PJL SET MEDIASOURCE=%s", mediasource);
-        pjl_printf("@PJL SET MEDIATYPE=PLAINRECYCLE");
-        pjl_printf("@PJL SET PAPER=%s", paper);
-        pjl_printf("@PJL SET PAPERWIDTH=%u", width);
-        pjl_printf("@PJL SET PAPERLENGTH=%u", height);
-        pjl_printf("@PJL SET RESOLUTION=%d", resolution);
-        pjl_printf("@PJL SET IMAGELEN=%zu", jbig_size);
-
-        /* JBIG raster data */
-        write_bytes(jbig, jbig_size);
-        free(jbig);
-
-        /* Page footer */
-        pjl_printf("@PJL SET DOTCOUNT=1132782");
-        pjl_printf("@PJL SET PAGESTATUS=END");
+        /* PJL job header before the first page, then the page framing */
+        rgdi_page_info_t info;
+        rgdi_page_info_from_header(&info, &header, width, height);
+        if (page_count == 0)
+            rgdi_pjl_job_header(&page->head, timestamp, user);
+        rgdi_pjl_page_header(&page->head, &info, jbig_size);
+        rgdi_pjl_page_footer(&page->tail, encoder.dots);
+
+        /* The writer sends this page while we compress the next one */
+        if (rgdi_writer_submit(&writer, page) < 0) {
+            write_failed = 1;
+            break;
+        }
 
         page_count++;
     }
 
+    /* On cancel the page waiting for the writer is dropped; one being
+     * written is completed, and the job is ended properly */
+    if (cancelled)
+        page_count -= rgdi_writer_cancel(&writer);
+
     /* Job footer */
-    if (page_count > 0) {
-        pjl_printf("@PJL EOJ");
-        fprintf(stdout, "\033%%-12345X");
-        fflush(stdout);
-        syslog(LOG_INFO, "job complete, %d page(s)", page_count);
+    if (page_count > 0 && !write_failed) {
+        rgdi_page_t *footer = rgdi_page_new(NULL, 0);
+        if (footer) {
+            rgdi_pjl_job_footer(&footer->head);
+            if (rgdi_writer_submit(&writer, footer) < 0)
+                write_failed = 1;
+        }
+    }
+    if (rgdi_writer_finish(&writer) < 0)
+        write_failed = 1;
+    rgdi_nup_free(&nup);
+    rgdi_overlays_free(&overlays);
+    gdi_trace_close();
+
+    /* A cancelled job's end reaches the printer within a bounded wait,
+     * which is part of the teardown measured */
+    if (cancelled) {
+        rgdi_sink_close_cancelled(sink);
+        gdi_log(LOG_INFO, "job cancelled after %d page(s), %.1f ms to tear down",
+                page_count, cancel_latency_ms());
     } else {
-        syslog(LOG_WARNING, "no pages processed");
+        rgdi_sink_close(sink);
+        if (write_failed)
+            gdi_log(LOG_ERR, "job aborted after %d page(s)", page_count);
+        else if (page_count > 0)
+            gdi_log(LOG_INFO, "event=end pages=%d", page_count);
+        else
+            gdi_log(LOG_WARNING, "no pages processed");
     }
 
+    if (encoder.page_cache)
+        gdi_log(LOG_INFO, "event=page-cache pages_reused=%u pages=%d",
+                encoder.page_hits, page_count);
+    if (despeckle)
+        gdi_log(LOG_INFO, "event=despeckle pixels_removed=%lu pages=%d",
+                despeckled_total, page_count);
+    if (encoder.stripe_cache) {
+        gdi_log(LOG_INFO, "event=stripe-cache stripes_reused=%lu stripes=%lu disk_hits=%lu",
+                stripes.hits, stripes.lookups, stripes.disk_hits);
+        stripe_cache_free(&stripes);
+    }
     cupsRasterClose(ras);
+    gdi_text_close(text);
+    gdi_capture_close(capture);
     if (fd > 0) close(fd);
-    closelog();
+    cupsFreeOptions(num_options, options);
+    gdi_log_close();
 
-    return page_count > 0 ? 0 : 1;
+    if (cancelled) return 0;
+    return page_count > 0 && !write_failed ? 0 : 1;
 }
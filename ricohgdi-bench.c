@@ -0,0 +1,510 @@
+/*
+ * ricohgdi-bench - microbenchmarks of the filter's hot routines
+ *
+ * Times each routine on its own, on synthetic A4 600 dpi content, and
+ * reports its cost per input byte. A kernel runs in samples of at least
+ * 20 ms each; the median sample is reported with the median absolute
+ * deviation as its spread, so a stray context switch does not move the
+ * result. Run builds with different -march flags, or before and after
+ * a change, to pin a difference on one routine rather than a whole job.
+ *
+ *   ricohgdi-bench                   all kernels
+ *   ricohgdi-bench -k encode         kernels whose name contains "encode"
+ *   ricohgdi-bench -c 3.2            cycles at a 3.2 GHz clock
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "ricohgdi.h"
+
+/* A4 at 600 dpi, as cgpdftoraster renders it */
+#define PAGE_WIDTH   4960
+#define PAGE_HEIGHT  7016
+#define STRIDE       ((PAGE_WIDTH + 7) / 8)
+
+#define MIN_SAMPLE_SECS  0.02
+#define DEFAULT_SAMPLES  15
+#define MAX_SAMPLES      101
+
+/* jbg_enc hands over its output in blocks of this size */
+#define CALLBACK_CHUNK   4000
+
+typedef struct {
+    const char *name;
+    const char *what;
+    size_t (*run)(void);        /* one operation; returns input bytes */
+} kernel_t;
+
+static unsigned char *gray_line;
+static unsigned char *packed_line;
+static unsigned char *text_page, *halftone_page, *blank_page, *scratch_page, *scan_page;
+static cups_page_header2_t gray_header, mono_header;
+static volatile unsigned long sink;    /* keeps results alive */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Small deterministic generator, so every run measures the same data */
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void set_black(unsigned char *page, unsigned int x, unsigned int y)
+{
+    page[(size_t)y * STRIDE + x / 8] |= 0x80 >> (x % 8);
+}
+
+static void fill_rect(unsigned char *page, unsigned int x0, unsigned int y0,
+                      unsigned int w, unsigned int h)
+{
+    for (unsigned int y = y0; y < y0 + h && y < PAGE_HEIGHT; y++)
+        for (unsigned int x = x0; x < x0 + w && x < PAGE_WIDTH; x++)
+            set_black(page, x, y);
+}
+
+/* Lines of word-like runs of glyphs built from strokes, 12 pt at 600 dpi */
+static void make_text(unsigned char *page)
+{
+    for (unsigned int base = 300; base + 80 < PAGE_HEIGHT - 300; base += 100) {
+        unsigned int x = 300;
+        while (x + 60 < PAGE_WIDTH - 300) {
+            unsigned int letters = 2 + rng() % 8;
+            for (unsigned int i = 0; i < letters && x + 60 < PAGE_WIDTH - 300; i++) {
+                unsigned int w = 30 + rng() % 20;
+                for (int s = 0; s < 3; s++) {
+                    if (rng() & 1)
+                        fill_rect(page, x + rng() % (w - 6), base, 6, 60);
+                    else
+                        fill_rect(page, x, base + rng() % 54, w, 6);
+                }
+                x += w + 8;
+            }
+            x += 40;
+        }
+    }
+}
+
+/* Scanned-photo texture: scattered dots whose density follows a gradient */
+static void make_halftone(unsigned char *page)
+{
+    for (unsigned int y = 0; y < PAGE_HEIGHT; y++)
+        for (unsigned int x = 0; x < PAGE_WIDTH; x++)
+            if ((rng() & 0xff) < x * 256 / PAGE_WIDTH)
+                set_black(page, x, y);
+}
+
+/* The text page as a thresholded scan: speckled with single pixels
+ * and pairs, one in 150 pixels */
+static void make_scan(unsigned char *page)
+{
+    memcpy(page, text_page, (size_t)STRIDE * PAGE_HEIGHT);
+    for (unsigned long n = (unsigned long)PAGE_WIDTH * PAGE_HEIGHT / 150; n > 0; n--) {
+        unsigned int x = rng() % (PAGE_WIDTH - 1), y = rng() % PAGE_HEIGHT;
+        set_black(page, x, y);
+        if (rng() & 1) set_black(page, x + 1, y);
+    }
+}
+
+static size_t run_pack_gray(void)
+{
+    rgdi_pack_line(&gray_header, gray_line, packed_line);
+    sink += packed_line[STRIDE / 2];
+    return PAGE_WIDTH;
+}
+
+static size_t run_copy_mono(void)
+{
+    rgdi_pack_line(&mono_header, text_page + 1000 * STRIDE, packed_line);
+    sink += packed_line[STRIDE / 2];
+    return STRIDE;
+}
+
+static size_t run_page_hash(void)
+{
+    unsigned char key[PAGE_CACHE_KEY_LEN];
+    size_t size = (size_t)STRIDE * PAGE_HEIGHT;
+
+    page_cache_key(text_page, size, PAGE_WIDTH, PAGE_HEIGHT, RGDI_PROFILE, key);
+    sink += key[0];
+    return size;
+}
+
+static size_t run_buffer_growth(void)
+{
+    static unsigned char chunk[CALLBACK_CHUNK];
+    rgdi_buffer_t buf = { NULL, 0, 0, 0 };
+    size_t total = 1 << 20;
+
+    for (size_t n = 0; n < total; n += sizeof(chunk))
+        rgdi_buffer_append(&buf, chunk, sizeof(chunk));
+    sink += buf.size;
+    rgdi_buffer_free(&buf);
+    return total;
+}
+
+/* A 300 dpi page scaled to 600; the text page's bytes stand in for it */
+static size_t run_double_300(void)
+{
+    unsigned int width = PAGE_WIDTH / 2, height = PAGE_HEIGHT / 2;
+    unsigned char *page = gdi_bitmap_double(text_page, width, height);
+    if (page) sink += page[0];
+    free(page);
+    return GDI_BITMAP_STRIDE(width) * height;
+}
+
+/* A page halved, as a 1200 dpi quarter page would be */
+static size_t run_halve_1200(void)
+{
+    unsigned char *page = gdi_bitmap_halve(text_page, PAGE_WIDTH, PAGE_HEIGHT, 0);
+    if (page) sink += page[0];
+    free(page);
+    return (size_t)STRIDE * PAGE_HEIGHT;
+}
+
+/* A full-page form drawn onto a page; the scratch page takes the
+ * writes so the shared pages stay as generated */
+static size_t overlay_page(int knockout)
+{
+    gdi_bitmap_overlay(scratch_page, PAGE_WIDTH, PAGE_HEIGHT, text_page,
+                       PAGE_WIDTH, PAGE_HEIGHT, knockout);
+    sink += scratch_page[0];
+    return (size_t)STRIDE * PAGE_HEIGHT;
+}
+
+static size_t run_overlay_or(void)       { return overlay_page(0); }
+static size_t run_overlay_knockout(void) { return overlay_page(1); }
+
+/* Toner saving on a fresh copy of the text page; the copy is part of
+ * the cost */
+static size_t run_thin(void)
+{
+    memcpy(scratch_page, text_page, (size_t)STRIDE * PAGE_HEIGHT);
+    gdi_bitmap_thin(scratch_page, PAGE_WIDTH, PAGE_HEIGHT);
+    sink += scratch_page[0];
+    return (size_t)STRIDE * PAGE_HEIGHT;
+}
+
+static size_t despeckle_page(int level)
+{
+    memcpy(scratch_page, scan_page, (size_t)STRIDE * PAGE_HEIGHT);
+    sink += gdi_bitmap_despeckle(scratch_page, PAGE_WIDTH, PAGE_HEIGHT, level);
+    return (size_t)STRIDE * PAGE_HEIGHT;
+}
+
+static size_t run_despeckle_pixels(void) { return despeckle_page(1); }
+static size_t run_despeckle_pairs(void)  { return despeckle_page(2); }
+
+static size_t run_dot_count(void)
+{
+    sink += gdi_bitmap_count(text_page, (size_t)STRIDE * PAGE_HEIGHT);
+    return (size_t)STRIDE * PAGE_HEIGHT;
+}
+
+static size_t rotate_page(int degrees)
+{
+    unsigned char *page = gdi_bitmap_rotate(text_page, PAGE_WIDTH, PAGE_HEIGHT, degrees);
+    if (page) sink += page[0];
+    free(page);
+    return (size_t)STRIDE * PAGE_HEIGHT;
+}
+
+static size_t run_rotate_90(void)  { return rotate_page(90); }
+static size_t run_rotate_180(void) { return rotate_page(180); }
+
+/* One stripe, the unit the encoders work in, from the middle of a page */
+static size_t encode_stripe(const unsigned char *page, int jbg85)
+{
+    const unsigned char *stripe = page + (size_t)3000 * STRIDE;
+    size_t len;
+    unsigned char *jbig = jbg85
+        ? jbig_encode_page(stripe, PAGE_WIDTH, RGDI_STRIPE_LINES, RGDI_STRIPE_LINES,
+                           NULL, NULL, &len)
+        : rgdi_pbm_to_jbig(stripe, PAGE_WIDTH, RGDI_STRIPE_LINES, &len);
+    if (jbig) sink += len;
+    free(jbig);
+    return (size_t)STRIDE * RGDI_STRIPE_LINES;
+}
+
+static size_t run_encode_text(void)      { return encode_stripe(text_page, 0); }
+static size_t run_encode_halftone(void)  { return encode_stripe(halftone_page, 0); }
+static size_t run_encode_blank(void)     { return encode_stripe(blank_page, 0); }
+static size_t run_encode85_text(void)    { return encode_stripe(text_page, 1); }
+static size_t run_encode85_halftone(void){ return encode_stripe(halftone_page, 1); }
+static size_t run_encode85_blank(void)   { return encode_stripe(blank_page, 1); }
+
+static const kernel_t kernels[] = {
+    { "pack-gray",        "8-bit gray line thresholded to 1 bit", run_pack_gray },
+    { "copy-mono",        "1-bit line copied into the bitmap", run_copy_mono },
+    { "page-hash",        "page cache key (SHA-256) of a page", run_page_hash },
+    { "buffer-growth",    "output buffer filled in callback chunks", run_buffer_growth },
+    { "double-300",       "300 dpi page doubled to 600 dpi", run_double_300 },
+    { "halve-1200",       "1200 dpi page halved to 600 dpi (bit OR)", run_halve_1200 },
+    { "overlay-or",       "full-page overlay ORed onto a page (16-byte vectors)", run_overlay_or },
+    { "overlay-knockout", "full-page overlay cleared from a page", run_overlay_knockout },
+    { "thin",             "toner saving of a page, copy included (16-byte vectors)", run_thin },
+    { "despeckle-pixels", "isolated pixels cleared from a scan, copy included", run_despeckle_pixels },
+    { "despeckle-pairs",  "isolated pixels and pairs cleared, copy included", run_despeckle_pairs },
+    { "dot-count",        "black pixels of a page for DOTCOUNT (popcount)", run_dot_count },
+    { "rotate-90",        "page turned by 90 degrees (8x8 bit transposes)", run_rotate_90 },
+    { "rotate-180",       "page turned by 180 degrees (bit reversal)", run_rotate_180 },
+    { "encode-text",      "jbg_enc, one stripe of text", run_encode_text },
+    { "encode-halftone",  "jbg_enc, one stripe of halftone", run_encode_halftone },
+    { "encode-blank",     "jbg_enc, one blank stripe", run_encode_blank },
+    { "encode85-text",    "jbg85 line coder, one stripe of text", run_encode85_text },
+    { "encode85-halftone","jbg85 line coder, one stripe of halftone", run_encode85_halftone },
+    { "encode85-blank",   "jbg85 line coder, one blank stripe", run_encode85_blank },
+};
+
+/* What toner saving does to a page's JBIG size and dot count */
+static void report_thin(const char *name, const unsigned char *page)
+{
+    size_t size = (size_t)STRIDE * PAGE_HEIGHT, before, after;
+    memcpy(scratch_page, page, size);
+    gdi_bitmap_thin(scratch_page, PAGE_WIDTH, PAGE_HEIGHT);
+    unsigned long dots = gdi_bitmap_count(page, size);
+    unsigned long thin_dots = gdi_bitmap_count(scratch_page, size);
+
+    unsigned char *jbig = rgdi_pbm_to_jbig(page, PAGE_WIDTH, PAGE_HEIGHT, &before);
+    free(jbig);
+    jbig = rgdi_pbm_to_jbig(scratch_page, PAGE_WIDTH, PAGE_HEIGHT, &after);
+    free(jbig);
+    printf("%-18s %10zu %10zu %+7.1f%% %10lu %10lu %+7.1f%%\n", name, before, after,
+           before ? 100.0 * ((double)after - before) / before : 0.0, dots, thin_dots,
+           dots ? 100.0 * ((double)thin_dots - dots) / dots : 0.0);
+}
+
+/* What despeckling does to the scan page's JBIG size and encode time */
+static void report_despeckle(const char *name, int level)
+{
+    size_t size = (size_t)STRIDE * PAGE_HEIGHT, before, after;
+    memcpy(scratch_page, scan_page, size);
+    long removed = gdi_bitmap_despeckle(scratch_page, PAGE_WIDTH, PAGE_HEIGHT, level);
+
+    double start = now();
+    unsigned char *jbig = rgdi_pbm_to_jbig(scan_page, PAGE_WIDTH, PAGE_HEIGHT, &before);
+    double before_ms = (now() - start) * 1e3;
+    free(jbig);
+    start = now();
+    jbig = rgdi_pbm_to_jbig(scratch_page, PAGE_WIDTH, PAGE_HEIGHT, &after);
+    double after_ms = (now() - start) * 1e3;
+    free(jbig);
+    printf("%-18s %10zu %10zu %+7.1f%% %8.1f %8.1f %10ld\n", name, before, after,
+           before ? 100.0 * ((double)after - before) / before : 0.0,
+           before_ms, after_ms, removed);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int n)
+{
+    qsort(values, n, sizeof(double), cmp_double);
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/* ns per input byte: median of the samples and its median absolute deviation */
+static void measure(const kernel_t *k, int samples, double *ns_per_byte, double *mad,
+                    size_t *bytes_per_op)
+{
+    double values[MAX_SAMPLES], dev[MAX_SAMPLES];
+    unsigned long ops = 1;
+
+    /* Warm up, and find how many operations fill a sample */
+    for (;;) {
+        double t = now();
+        for (unsigned long i = 0; i < ops; i++)
+            *bytes_per_op = k->run();
+        if (now() - t >= MIN_SAMPLE_SECS) break;
+        ops *= 2;
+    }
+
+    for (int s = 0; s < samples; s++) {
+        size_t bytes = 0;
+        double t = now();
+        for (unsigned long i = 0; i < ops; i++)
+            bytes += k->run();
+        values[s] = (now() - t) * 1e9 / bytes;
+    }
+    *ns_per_byte = median(values, samples);
+    for (int s = 0; s < samples; s++)
+        dev[s] = values[s] > *ns_per_byte ? values[s] - *ns_per_byte
+                                          : *ns_per_byte - values[s];
+    *mad = median(dev, samples);
+}
+
+/* Cycles per ns: from -c, or the timestamp counter where there is one */
+static double clock_ghz(double given, const char **source)
+{
+    if (given > 0) {
+        *source = "given clock";
+        return given;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    double t = now();
+    uint64_t c = __rdtsc();
+    while (now() - t < 0.1)
+        ;
+    *source = "TSC";
+    return (__rdtsc() - c) / ((now() - t) * 1e9);
+#else
+    *source = NULL;
+    return 0;
+#endif
+}
+
+static void print_build(void)
+{
+    printf("build:");
+#if defined(__x86_64__)
+    printf(" x86-64");
+#elif defined(__aarch64__)
+    printf(" arm64");
+#endif
+#ifdef __SSE4_2__
+    printf(" sse4.2");
+#endif
+#ifdef __POPCNT__
+    printf(" popcnt");
+#endif
+#ifdef __AVX2__
+    printf(" avx2");
+#endif
+#ifdef __AVX512F__
+    printf(" avx512f");
+#endif
+#ifdef __ARM_NEON
+    printf(" neon");
+#endif
+    printf(", %s\n", __VERSION__);
+}
+
+/* Whether -k picked the kernel with this name; reports go with their kernels */
+static int selected(const char *name, const char *filter)
+{
+    return !filter || strstr(name, filter) != NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: ricohgdi-bench [-k name] [-n samples] [-c GHz] [-l]\n"
+        "  -k  only kernels whose name contains this string\n"
+        "  -n  samples per kernel (default %d, at most %d)\n"
+        "  -c  core clock for the cycles column (default: TSC on x86)\n"
+        "  -l  list the kernels\n", DEFAULT_SAMPLES, MAX_SAMPLES);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = NULL;
+    int samples = DEFAULT_SAMPLES;
+    double ghz = 0;
+    int opt, list = 0;
+    size_t nkernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    while ((opt = getopt(argc, argv, "k:n:c:l")) != -1) {
+        switch (opt) {
+        case 'k': filter = optarg; break;
+        case 'n': samples = atoi(optarg); break;
+        case 'c': ghz = atof(optarg); break;
+        case 'l': list = 1; break;
+        default: usage();
+        }
+    }
+    if (samples < 1 || samples > MAX_SAMPLES) usage();
+
+    if (list) {
+        for (size_t i = 0; i < nkernels; i++)
+            printf("%-18s %s\n", kernels[i].name, kernels[i].what);
+        return 0;
+    }
+
+    size_t page_size = (size_t)STRIDE * PAGE_HEIGHT;
+    gray_line = malloc(PAGE_WIDTH);
+    packed_line = malloc(STRIDE);
+    text_page = calloc(1, page_size);
+    halftone_page = calloc(1, page_size);
+    blank_page = calloc(1, page_size);
+    scratch_page = calloc(1, page_size);
+    scan_page = calloc(1, page_size);
+    if (!gray_line || !packed_line || !text_page || !halftone_page || !blank_page ||
+        !scratch_page || !scan_page) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (unsigned int x = 0; x < PAGE_WIDTH; x++)
+        gray_line[x] = rng() & 0xff;
+    make_text(text_page);
+    make_halftone(halftone_page);
+    make_scan(scan_page);
+
+    gray_header.cupsWidth = PAGE_WIDTH;
+    gray_header.cupsBytesPerLine = PAGE_WIDTH;
+    gray_header.cupsBitsPerPixel = 8;
+    gray_header.cupsColorSpace = CUPS_CSPACE_SW;
+    mono_header.cupsWidth = PAGE_WIDTH;
+    mono_header.cupsBytesPerLine = STRIDE;
+    mono_header.cupsBitsPerPixel = 1;
+    mono_header.cupsColorSpace = CUPS_CSPACE_K;
+
+    const char *clock_source;
+    double cycles_per_ns = clock_ghz(ghz, &clock_source);
+
+    print_build();
+    printf("%d sample(s) per kernel, median and median absolute deviation%s%s%s\n\n",
+           samples, clock_source ? ", cycles from " : "",
+           clock_source ? clock_source : "", clock_source ? "" : " (no cycle counter, use -c)");
+    printf("%-18s %10s %10s %10s %8s %10s\n",
+           "kernel", "bytes/op", "ns/byte", "cyc/byte", "spread", "MB/s");
+
+    for (size_t i = 0; i < nkernels; i++) {
+        const kernel_t *k = &kernels[i];
+        if (!selected(k->name, filter)) continue;
+
+        double ns, mad;
+        size_t bytes;
+        measure(k, samples, &ns, &mad, &bytes);
+        printf("%-18s %10zu %10.3f ", k->name, bytes, ns);
+        if (cycles_per_ns > 0)
+            printf("%10.2f ", ns * cycles_per_ns);
+        else
+            printf("%10s ", "-");
+        printf("%7.1f%% %10.1f\n", ns > 0 ? 100.0 * mad / ns : 0.0, 1e3 / ns);
+        fflush(stdout);
+    }
+
+    if (selected("thin", filter)) {
+        printf("\n%-18s %10s %10s %8s %10s %10s %8s\n", "toner saving",
+               "jbig", "thinned", "", "dots", "thinned", "");
+        report_thin("text page", text_page);
+        report_thin("halftone page", halftone_page);
+    }
+    if (selected("despeckle-pixels", filter) || selected("despeckle-pairs", filter)) {
+        printf("\n%-18s %10s %10s %8s %8s %8s %10s\n", "despeckling (scan)",
+               "jbig", "cleaned", "", "enc ms", "after", "removed");
+        report_despeckle("pixels", 1);
+        report_despeckle("pixels and pairs", 2);
+    }
+    return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * ricohgdi-emu - printer stand-in for measuring rastertericoh end to end
+ *
+ * Consumes a PJL+JBIG job stream on stdin, from a file or over a TCP
+ * connection (as the raw socket mode would send it), checks every page
+ * by decoding it with libjbig, and models the two things that pace a
+ * real SP 201N: the host link and the print engine.
+ *
+ * Reads are throttled to the link rate, so a producer on the other end
+ * of a pipe or socket sees realistic backpressure. The engine prints one
+ * page per 60/ppm seconds once a page has fully arrived; whenever the
+ * next page arrives after the engine finished the previous one, the
+ * printer starved.
+ *
+ *   rastertericoh 1 user title 1 "" job.ras | ricohgdi-emu -L usb
+ *   ricohgdi-emu -l 9100 -L 100m -p 22
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "gdistream.h"
+
+/* USB 2.0 full-speed bulk: 19 x 64-byte packets per 1 ms frame */
+#define LINK_USB_FS   1216000.0
+/* 100 Mbit Ethernet, TCP payload after framing overhead */
+#define LINK_100M     11700000.0
+
+/* Largest read the link hands over at once, like a device FIFO */
+#define LINK_CHUNK    16384
+
+typedef struct {
+    int fd;
+    double rate;            /* bytes per second, 0 = unthrottled */
+    double start;           /* when the job began, for time-to-first-page */
+    double first_byte;      /* -1 until something arrives */
+    unsigned long long bytes;
+} link_t;
+
+typedef struct {
+    double recv;            /* page fully received */
+    double out;             /* page left the engine */
+} page_time_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+    double d = t - now();
+    if (d <= 0) return;
+    struct timespec ts;
+    ts.tv_sec = (time_t)d;
+    ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* Read callback: never lets data in faster than the modelled link */
+static ssize_t link_read(void *ctx, void *buf, size_t len)
+{
+    link_t *link = (link_t *)ctx;
+    ssize_t n;
+
+    if (len > LINK_CHUNK) len = LINK_CHUNK;
+    do {
+        n = read(link->fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return n;
+
+    if (link->first_byte < 0)
+        link->first_byte = now();
+    link->bytes += n;
+    if (link->rate > 0)
+        sleep_until(link->first_byte + link->bytes / link->rate);
+    return n;
+}
+
+static double parse_rate(const char *arg)
+{
+    if (strcasecmp(arg, "usb") == 0 || strcasecmp(arg, "usb-fs") == 0)
+        return LINK_USB_FS;
+    if (strcasecmp(arg, "100m") == 0)
+        return LINK_100M;
+    if (strcasecmp(arg, "none") == 0)
+        return 0;
+
+    char *end;
+    double rate = strtod(arg, &end);
+    if (*end == 'k' || *end == 'K') rate *= 1e3, end++;
+    else if (*end == 'M') rate *= 1e6, end++;
+    if (*end != '\0' || rate < 0) return -1;
+    return rate;
+}
+
+static int listen_once(int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (lfd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0) {
+        perror("bind");
+        close(lfd);
+        return -1;
+    }
+    fprintf(stderr, "listening on 127.0.0.1:%d\n", port);
+
+    int fd = accept(lfd, NULL, NULL);
+    if (fd < 0) perror("accept");
+    close(lfd);
+    return fd;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: ricohgdi-emu [-L usb|100m|none|RATE[k|M]] [-p ppm] [-w secs]\n"
+        "                    [-m pages] [-l port] [-q] [file]\n"
+        "  -L  link model in bytes/s (default usb = USB 2.0 full-speed)\n"
+        "  -p  engine speed in pages per minute, 0 = infinitely fast (default 22)\n"
+        "  -w  engine warm-up before the first page (default 0)\n"
+        "  -m  pages the printer buffers ahead of the engine, 0 = unlimited\n"
+        "  -l  accept one TCP connection on 127.0.0.1:port instead of reading a file\n"
+        "  -q  summary only, no per-page lines\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    link_t link = { 0, LINK_USB_FS, 0, -1, 0 };
+    double ppm = 22, warmup = 0;
+    int depth = 0, port = 0, quiet = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "L:p:w:m:l:q")) != -1) {
+        switch (opt) {
+        case 'L':
+            if ((link.rate = parse_rate(optarg)) < 0) usage();
+            break;
+        case 'p': ppm = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'm': depth = atoi(optarg); break;
+        case 'l': port = atoi(optarg); break;
+        case 'q': quiet = 1; break;
+        default: usage();
+        }
+    }
+
+    link.start = now();
+    if (port > 0) {
+        link.fd = listen_once(port);
+        if (link.fd < 0) return 1;
+        link.start = now();
+    } else if (optind < argc) {
+        link.fd = open(argv[optind], O_RDONLY);
+        if (link.fd < 0) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+
+    double period = ppm > 0 ? 60.0 / ppm : 0;
+    page_time_t *times = NULL;
+    size_t npages = 0, cap = 0;
+    int jobs = 0, bad_pages = 0, starved = 0, rc;
+    double idle = 0;
+    gdi_stream_t *s = malloc(sizeof(*s));
+    gdi_page_t page;
+
+    memset(&page, 0, sizeof(page));
+    gdi_stream_init(s, link_read, &link);
+
+    while ((rc = gdi_next(s, &page)) > 0) {
+        if (rc == GDI_JOB_START) {
+            jobs++;
+            continue;
+        }
+        if (rc != GDI_PAGE) continue;
+
+        double recv = now();
+        unsigned char *bitmap;
+        char err[160];
+        int ok = gdi_page_decode(&page, &bitmap, err, sizeof(err)) == 0;
+        if (ok) free(bitmap);
+        else bad_pages++;
+
+        if (npages == cap) {
+            cap = cap ? cap * 2 : 64;
+            times = realloc(times, cap * sizeof(*times));
+            if (!times) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+
+        /* The engine takes the page once it is here and the previous
+         * page is out; a gap in between means it ran dry. */
+        double start = recv;
+        if (npages == 0) {
+            start += warmup;
+        } else {
+            double prev_out = times[npages - 1].out;
+            if (recv > prev_out) {
+                starved++;
+                idle += recv - prev_out;
+            } else {
+                start = prev_out;
+            }
+        }
+        times[npages].recv = recv;
+        times[npages].out = start + period;
+        npages++;
+
+        if (!quiet)
+            printf("page %zu: %s %ux%u %d dpi, IMAGELEN=%zu, received %.3fs, out %.3fs%s%s\n",
+                   npages, page.paper, page.width, page.height, page.resolution,
+                   page.imagelen, recv - link.start, times[npages - 1].out - link.start,
+                   ok ? "" : ", DECODE FAILED: ", ok ? "" : err);
+        gdi_page_free(&page);
+
+        /* Limited printer memory: stop reading until the engine has
+         * made room, so the sender stalls as it would on the real link */
+        if (depth > 0 && npages > (size_t)depth)
+            sleep_until(times[npages - 1 - depth].out);
+    }
+    gdi_page_free(&page);
+    if (rc == GDI_ERROR) {
+        fprintf(stderr, "ricohgdi-emu: %s\n", s->error);
+        bad_pages++;
+    }
+
+    double end = now();
+    printf("jobs: %d, pages: %zu, bytes: %llu, link: %s\n", jobs, npages,
+           link.bytes, link.rate > 0 ? "throttled" : "unthrottled");
+    if (link.rate > 0)
+        printf("link rate: %.0f bytes/s\n", link.rate);
+    if (npages > 0) {
+        double gap_min = 0, gap_max = 0, gap_sum = 0;
+        for (size_t i = 1; i < npages; i++) {
+            double gap = times[i].out - times[i - 1].out;
+            if (i == 1 || gap < gap_min) gap_min = gap;
+            if (gap > gap_max) gap_max = gap;
+            gap_sum += gap;
+        }
+        printf("time to first page: %.3fs (first byte %.3fs, received %.3fs)\n",
+               times[0].out - link.start, link.first_byte - link.start,
+               times[0].recv - link.start);
+        if (npages > 1)
+            printf("inter-page gap: min %.3fs, avg %.3fs, max %.3fs (engine %.3fs)\n",
+                   gap_min, gap_sum / (npages - 1), gap_max, period);
+        printf("engine starved: %d of %zu page(s), idle %.3fs\n",
+               starved, npages - 1, idle);
+        printf("last page out: %.3fs, %.1f ppm overall\n",
+               times[npages - 1].out - link.start,
+               60.0 * npages / (times[npages - 1].out - link.start));
+    }
+    printf("stream read in %.3fs, %d bad page(s)\n", end - link.start, bad_pages);
+
+    free(times);
+    free(s);
+    if (link.fd > 0) close(link.fd);
+    return bad_pages > 0 ? 1 : 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * ricohgdi-inspect - analyze a captured rastertericoh job stream
+ *
+ * For every page prints the PJL settings, IMAGELEN, compression ratio
+ * against the raw 1-bit bitmap and the stripe layout of the BIE. Each
+ * page is decoded, which also gives the typical-prediction hit rate:
+ * the share of lines identical to the line above, which JBIG codes with
+ * a single bit instead of pixel by pixel. Pages whose compressed size is
+ * out of line with the rest of the job are flagged.
+ *
+ *   ricohgdi-inspect job.prn
+ *   rastertericoh 1 user title 1 "" job.ras | ricohgdi-inspect -q
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "gdistream.h"
+
+/* Link rates used for the transfer time estimate, as in ricohgdi-emu */
+#define LINK_USB_FS   1216000.0
+#define LINK_100M     11700000.0
+
+/* A page is flagged when its ratio drops below this ... */
+#define DEFAULT_MIN_RATIO  10.0
+/* ... or it is this many times the median page of the job */
+#define OUTLIER_FACTOR     3.0
+/* Stripes this many times the page's median stripe get a mark */
+#define STRIPE_OUTLIER     4.0
+
+typedef struct {
+    size_t imagelen;
+    double ratio;
+} page_info_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t median(const size_t *values, size_t n)
+{
+    if (n == 0) return 0;
+    size_t *sorted = malloc(n * sizeof(size_t));
+    if (!sorted) return 0;
+    memcpy(sorted, values, n * sizeof(size_t));
+    qsort(sorted, n, sizeof(size_t), cmp_size);
+    size_t m = sorted[n / 2];
+    free(sorted);
+    return m;
+}
+
+/* Count lines equal to the line above; the first line of the image is
+ * compared against white, as the encoder does. */
+static size_t typical_lines(const unsigned char *bitmap, size_t stride,
+                            unsigned long first, unsigned long last)
+{
+    size_t typical = 0;
+    for (unsigned long y = first; y < last; y++) {
+        const unsigned char *row = bitmap + y * stride;
+        int same;
+        if (y == 0) {
+            same = 1;
+            for (size_t i = 0; i < stride && same; i++)
+                same = row[i] == 0;
+        } else {
+            same = memcmp(row, row - stride, stride) == 0;
+        }
+        typical += same;
+    }
+    return typical;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: ricohgdi-inspect [-q] [-r min-ratio] [file]\n"
+        "  -q  one line per page, no stripe table\n"
+        "  -r  flag pages compressing worse than this (default %.0f:1)\n",
+        DEFAULT_MIN_RATIO);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    double min_ratio = DEFAULT_MIN_RATIO;
+    int quiet = 0, fd = 0, opt, rc;
+
+    while ((opt = getopt(argc, argv, "qr:")) != -1) {
+        switch (opt) {
+        case 'q': quiet = 1; break;
+        case 'r': min_ratio = atof(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind < argc && (fd = open(argv[optind], O_RDONLY)) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    gdi_stream_t *s = malloc(sizeof(*s));
+    gdi_page_t page;
+    page_info_t *pages = NULL;
+    size_t npages = 0, cap = 0, total_len = 0, total_raw = 0;
+    int bad = 0;
+
+    memset(&page, 0, sizeof(page));
+    gdi_stream_init(s, gdi_read_fd, &fd);
+
+    while ((rc = gdi_next(s, &page)) > 0) {
+        if (rc == GDI_JOB_START) {
+            printf("job start\n");
+            continue;
+        }
+        if (rc == GDI_JOB_END) {
+            printf("job end: user %s, timestamp %s\n",
+                   s->username[0] ? s->username : "-",
+                   s->timestamp[0] ? s->timestamp : "-");
+            continue;
+        }
+
+        size_t stride = (page.width + 7) / 8;
+        size_t raw = stride * page.height;
+        double ratio = page.imagelen ? (double)raw / page.imagelen : 0;
+        char err[160];
+        gdi_bie_t bie;
+        unsigned char *bitmap = NULL;
+
+        npages++;
+        if (npages > cap) {
+            cap = cap ? cap * 2 : 64;
+            pages = realloc(pages, cap * sizeof(*pages));
+            if (!pages) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        pages[npages - 1].imagelen = page.imagelen;
+        pages[npages - 1].ratio = ratio;
+        total_len += page.imagelen;
+        total_raw += raw;
+
+        printf("page %zu: %s %ux%u %d dpi, source %s, IMAGELEN=%zu, %.1f:1",
+               npages, page.paper, page.width, page.height, page.resolution,
+               page.mediasource, page.imagelen, ratio);
+
+        if (gdi_bie_parse(page.data, page.imagelen, &bie, err, sizeof(err)) < 0) {
+            printf("\n  BIE: %s\n", err);
+            bad++;
+            gdi_page_free(&page);
+            continue;
+        }
+        printf(", %zu stripes of %lu lines%s\n", bie.nstripes, bie.l0,
+               bie.sdrst ? " (SDRST)" : "");
+
+        double t0 = now();
+        int decoded = gdi_page_decode(&page, &bitmap, err, sizeof(err)) == 0;
+        double decode_ms = (now() - t0) * 1000;
+        size_t typical = 0;
+        if (decoded)
+            typical = typical_lines(bitmap, stride, 0, page.height);
+        else
+            bad++;
+
+        size_t smed = median(bie.stripe_bytes, bie.nstripes);
+        size_t smin = 0, smax = 0;
+        for (size_t i = 0; i < bie.nstripes; i++) {
+            if (i == 0 || bie.stripe_bytes[i] < smin) smin = bie.stripe_bytes[i];
+            if (bie.stripe_bytes[i] > smax) smax = bie.stripe_bytes[i];
+        }
+        printf("  stripes: min %zu, median %zu, max %zu bytes", smin, smed, smax);
+        if (decoded)
+            printf("; typical lines %.1f%%", 100.0 * typical / page.height);
+        printf("\n  decode %.1f ms, transfer %.3fs USB full-speed, %.3fs 100 Mbit",
+               decode_ms, page.imagelen / LINK_USB_FS, page.imagelen / LINK_100M);
+        if (page.dotcount >= 0)
+            printf(", DOTCOUNT=%ld", page.dotcount);
+        printf("\n");
+        if (!decoded)
+            printf("  DECODE FAILED: %s\n", err);
+
+        if (!quiet) {
+            for (size_t i = 0; i < bie.nstripes; i++) {
+                unsigned long first = i * bie.l0;
+                unsigned long last = first + bie.l0;
+                if (last > page.height) last = page.height;
+                printf("    stripe %4zu  lines %5lu-%-5lu %8zu bytes", i,
+                       first, last - 1, bie.stripe_bytes[i]);
+                if (decoded && last > first)
+                    printf("  TP %5.1f%%", 100.0 *
+                           typical_lines(bitmap, stride, first, last) / (last - first));
+                if (smed > 0 && bie.stripe_bytes[i] > STRIPE_OUTLIER * smed)
+                    printf("  !");
+                printf("\n");
+            }
+        }
+
+        free(bitmap);
+        gdi_bie_free(&bie);
+        gdi_page_free(&page);
+    }
+    gdi_page_free(&page);
+    if (rc == GDI_ERROR) {
+        fprintf(stderr, "ricohgdi-inspect: %s\n", s->error);
+        bad++;
+    }
+
+    /* Flag pages against the absolute ratio and against the job median */
+    size_t *sizes = malloc((npages ? npages : 1) * sizeof(size_t));
+    size_t flagged = 0;
+    for (size_t i = 0; sizes && i < npages; i++)
+        sizes[i] = pages[i].imagelen;
+    size_t pmed = sizes ? median(sizes, npages) : 0;
+    for (size_t i = 0; i < npages; i++) {
+        const char *why = NULL;
+        if (pages[i].ratio < min_ratio)
+            why = "compresses poorly (noise, halftone or scanned background?)";
+        else if (npages >= 3 && pages[i].imagelen > OUTLIER_FACTOR * pmed)
+            why = "much larger than the job median";
+        if (why) {
+            printf("flag: page %zu, %zu bytes, %.1f:1, %s\n",
+                   i + 1, pages[i].imagelen, pages[i].ratio, why);
+            flagged++;
+        }
+    }
+
+    printf("total: %zu page(s), %zu bytes", npages, total_len);
+    if (total_len > 0)
+        printf(", %.1f:1, median page %zu bytes", (double)total_raw / total_len, pmed);
+    printf(", %zu flagged, %d bad\n", flagged, bad);
+
+    free(sizes);
+    free(pages);
+    free(s);
+    if (fd > 0) close(fd);
+    return bad > 0 ? 1 : 0;
+}
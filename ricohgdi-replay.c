@@ -0,0 +1,558 @@
+/*
+ * ricohgdi-replay - feed captured jobs back through the filter
+ *
+ * Runs the filter on jobs recorded with ricoh-capture, back to back and
+ * as fast as the filter goes, and reports the time of each job and the
+ * page rate overall. The output is discarded, or piped into a command
+ * such as ricohgdi-emu to include the printer link.
+ *
+ * Jobs captured as hashes are rebuilt before they are timed: a stripe
+ * becomes its sample if one was kept, else the sample nearest to it in
+ * density, else dots at its recorded density. Identical hashes always
+ * give identical stripes, so the caches see the job's real repetition.
+ *
+ * With -c N each job is cancelled as CUPS does it, with SIGTERM once N
+ * pages have come out, and the time until the filter exits is reported.
+ * The output must still end the PJL job properly, with @PJL EOJ and a
+ * closing UEL and without a page cut short inside its IMAGELEN.
+ *
+ *   ricohgdi-replay $TMPDIR/ricoh-capture/1234-5678.job
+ *   ricohgdi-replay -e "./ricohgdi-emu -q" -o ricoh-stripe-cache=on *.job
+ *   ricohgdi-replay -c 2 *.job
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "gdicapture.h"
+#include "gdistream.h"
+#include "ricohgdi.h"
+
+#define MAX_SAMPLES 64
+
+/* What a job's output must end with, as the filter writes it */
+#define PJL_UEL     "\033%-12345X"
+#define PJL_UEL_LEN 9
+
+typedef struct {
+    char *name;
+    unsigned int width, lines;
+    unsigned long black;
+    unsigned char *data;
+} sample_t;
+
+typedef struct {
+    char dir[1024];             /* where the .job file is; names are relative */
+    char *field[5];             /* job, user, title, copies, options */
+    int hashes;
+    char *raster;
+    char **lines;               /* all lines of the file */
+    size_t nlines;
+    sample_t samples[MAX_SAMPLES];
+    int nsamples;
+} job_t;
+
+static const char *field_names[5] = { "job", "user", "title", "copies", "options" };
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void job_free(job_t *job)
+{
+    for (size_t i = 0; i < job->nlines; i++)
+        free(job->lines[i]);
+    free(job->lines);
+    for (int i = 0; i < job->nsamples; i++) {
+        free(job->samples[i].name);
+        free(job->samples[i].data);
+    }
+    memset(job, 0, sizeof(*job));
+}
+
+static int job_load(job_t *job, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    memset(job, 0, sizeof(*job));
+    const char *slash = strrchr(path, '/');
+    snprintf(job->dir, sizeof(job->dir), "%.*s",
+             slash ? (int)(slash - path) : 1, slash ? path : ".");
+
+    char *line = NULL;
+    size_t cap = 0, alloc = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) > 0) {
+        if (line[len - 1] == '\n') line[len - 1] = '\0';
+        if (job->nlines == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            char **lines = realloc(job->lines, alloc * sizeof(char *));
+            if (!lines) break;
+            job->lines = lines;
+        }
+        job->lines[job->nlines++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+
+    if (job->nlines == 0 || strcmp(job->lines[0], GDI_CAPTURE_MAGIC) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", path);
+        job_free(job);
+        return -1;
+    }
+    for (size_t i = 1; i < job->nlines; i++) {
+        char *l = job->lines[i];
+        for (int k = 0; k < 5; k++) {
+            size_t n = strlen(field_names[k]);
+            if (strncmp(l, field_names[k], n) == 0 && l[n] == ' ')
+                job->field[k] = l + n + 1;
+        }
+        if (strcmp(l, "mode hashes") == 0) job->hashes = 1;
+        if (strncmp(l, "raster ", 7) == 0) job->raster = l + 7;
+    }
+    for (int k = 0; k < 5; k++) {
+        if (!job->field[k]) {
+            fprintf(stderr, "%s: no %s line\n", path, field_names[k]);
+            job_free(job);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static sample_t *sample_load(job_t *job, const char *name)
+{
+    for (int i = 0; i < job->nsamples; i++)
+        if (strcmp(job->samples[i].name, name) == 0) return &job->samples[i];
+    if (job->nsamples == MAX_SAMPLES) return NULL;
+
+    char path[2048];
+    snprintf(path, sizeof(path), "%s/%s", job->dir, name);
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    sample_t *s = &job->samples[job->nsamples];
+    if (fscanf(f, "P4 %u %u", &s->width, &s->lines) != 2 || fgetc(f) == EOF) {
+        fclose(f);
+        return NULL;
+    }
+    size_t size = (size_t)(s->width + 7) / 8 * s->lines;
+    s->data = malloc(size);
+    if (!s->data || fread(s->data, 1, size, f) != size) {
+        free(s->data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    s->black = 0;
+    for (size_t i = 0; i < size; i++)
+        s->black += __builtin_popcount(s->data[i]);
+    s->name = strdup(name);
+    job->nsamples++;
+    return s;
+}
+
+/* One stripe of a hashed capture, written into dst */
+static void rebuild_stripe(job_t *job, const char *hash, unsigned long black,
+                           const char *sample_name, unsigned int width,
+                           unsigned int lines, unsigned char *dst)
+{
+    size_t stride = (width + 7) / 8;
+    size_t size = stride * lines;
+    sample_t *best = NULL;
+
+    memset(dst, 0, size);
+    if (black == 0) return;
+
+    if (sample_name)
+        best = sample_load(job, sample_name);
+    if (!best) {
+        unsigned long best_diff = ~0UL;
+        for (int i = 0; i < job->nsamples; i++) {
+            sample_t *s = &job->samples[i];
+            if (s->width != width || s->lines != lines) continue;
+            unsigned long diff = s->black > black ? s->black - black : black - s->black;
+            if (diff < best_diff) {
+                best = s;
+                best_diff = diff;
+            }
+        }
+    }
+    if (best && best->width == width && best->lines == lines) {
+        memcpy(dst, best->data, size);
+        return;
+    }
+
+    /* No sample: dots at the recorded density, seeded by the hash */
+    char seed_hex[9];
+    snprintf(seed_hex, sizeof(seed_hex), "%.8s", hash);
+    unsigned int seed = (unsigned int)strtoul(seed_hex, NULL, 16) | 1;
+    double p = (double)black / ((double)width * lines);
+    for (unsigned int y = 0; y < lines; y++)
+        for (unsigned int x = 0; x < width; x++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            if (seed < p * 4294967296.0)
+                dst[y * stride + x / 8] |= 0x80 >> (x % 8);
+        }
+}
+
+/* Turn a hashed capture back into a raster stream in f; returns pages */
+static int rebuild(job_t *job, FILE *f)
+{
+    /* Every sample is a candidate for stripes that have none */
+    for (size_t i = 0; i < job->nlines; i++) {
+        char hash[80], name[1100];
+        unsigned long black;
+        if (sscanf(job->lines[i], "stripe %79s %lu %1099s", hash, &black, name) == 3)
+            sample_load(job, name);
+    }
+
+    cups_raster_t *ras = cupsRasterOpen(fileno(f), CUPS_RASTER_WRITE);
+    if (!ras) return -1;
+
+    int pages = 0;
+    size_t i = 0;
+    while (i < job->nlines) {
+        cups_page_header2_t header;
+        char size_name[64];
+        memset(&header, 0, sizeof(header));
+        if (sscanf(job->lines[i++], "page %u %u %u %u %u %u %u %u %u %63s",
+                   &header.cupsWidth, &header.cupsHeight,
+                   &header.HWResolution[0], &header.HWResolution[1],
+                   &header.PageSize[0], &header.PageSize[1], &header.MediaPosition,
+                   &header.cupsInteger[0], &header.cupsInteger[1], size_name) != 10)
+            continue;
+        if (strcmp(size_name, "-") != 0)
+            snprintf(header.cupsPageSizeName, sizeof(header.cupsPageSizeName), "%s", size_name);
+        header.cupsBitsPerColor = 1;
+        header.cupsBitsPerPixel = 1;
+        header.cupsBytesPerLine = (header.cupsWidth + 7) / 8;
+        header.cupsColorSpace = CUPS_CSPACE_K;
+        header.cupsNumColors = 1;
+
+        size_t stride = header.cupsBytesPerLine;
+        unsigned char *page = calloc(stride, header.cupsHeight);
+        if (!page) break;
+        for (unsigned int y = 0; y < header.cupsHeight && i < job->nlines; y += RGDI_STRIPE_LINES) {
+            char hash[80], name[1100];
+            unsigned long black;
+            int n = sscanf(job->lines[i], "stripe %79s %lu %1099s", hash, &black, name);
+            if (n < 2) break;
+            i++;
+            unsigned int lines = header.cupsHeight - y < RGDI_STRIPE_LINES
+                                     ? header.cupsHeight - y : RGDI_STRIPE_LINES;
+            rebuild_stripe(job, hash, black, n == 3 ? name : NULL,
+                           header.cupsWidth, lines, page + (size_t)y * stride);
+        }
+        cupsRasterWriteHeader2(ras, &header);
+        cupsRasterWritePixels(ras, page, stride * header.cupsHeight);
+        free(page);
+        pages++;
+    }
+    cupsRasterClose(ras);
+    fflush(f);
+    return pages;
+}
+
+static int count_pages(int fd)
+{
+    cups_raster_t *ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+    cups_page_header2_t header;
+    int pages = 0;
+
+    if (!ras) return -1;
+    while (cupsRasterReadHeader2(ras, &header)) {
+        unsigned char *line = malloc(header.cupsBytesPerLine ? header.cupsBytesPerLine : 1);
+        if (!line) break;
+        for (unsigned int y = 0; y < header.cupsHeight; y++)
+            if (cupsRasterReadPixels(ras, line, header.cupsBytesPerLine) == 0) break;
+        free(line);
+        pages++;
+    }
+    cupsRasterClose(ras);
+    lseek(fd, 0, SEEK_SET);
+    return pages;
+}
+
+/* A cancelled job's output on its way to out_fd, with its last bytes kept */
+typedef struct {
+    int fd, out_fd;
+    unsigned char tail[PJL_UEL_LEN];
+    size_t tail_len;
+} tap_t;
+
+static ssize_t tap_read(void *ctx, void *buf, size_t len)
+{
+    tap_t *t = ctx;
+    ssize_t n;
+
+    do
+        n = read(t->fd, buf, len);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0) return n;
+
+    for (ssize_t done = 0, w; done < n; done += w)
+        if ((w = write(t->out_fd, (char *)buf + done, n - done)) <= 0) break;
+    if ((size_t)n >= sizeof(t->tail)) {
+        memcpy(t->tail, (char *)buf + n - sizeof(t->tail), sizeof(t->tail));
+        t->tail_len = sizeof(t->tail);
+    } else {
+        size_t keep = t->tail_len + n > sizeof(t->tail) ? sizeof(t->tail) - n : t->tail_len;
+        memmove(t->tail, t->tail + t->tail_len - keep, keep);
+        memcpy(t->tail + keep, buf, n);
+        t->tail_len = keep + n;
+    }
+    return n;
+}
+
+/* How a job cancelled with -c went */
+typedef struct {
+    int signalled;              /* the job had enough pages to be cancelled */
+    double exit_ms;             /* from SIGTERM until the filter was gone */
+    int pages;                  /* complete pages in the output */
+    char error[160];            /* what is wrong with the output, or "" */
+} cancel_result_t;
+
+/* Read the filter's output as it comes, send SIGTERM after the given
+ * page, and check how the stream ends once the filter exits */
+static void watch_cancel(pid_t pid, int fd, int out_fd, int after, cancel_result_t *r)
+{
+    tap_t tap = { fd, out_fd, { 0 }, 0 };
+    gdi_stream_t *s = malloc(sizeof(*s));
+    gdi_page_t page;
+    int last = GDI_EOF;
+    double sent = 0;
+
+    memset(r, 0, sizeof(*r));
+    if (!s) {
+        snprintf(r->error, sizeof(r->error), "out of memory");
+        kill(pid, SIGTERM);
+        return;
+    }
+    gdi_stream_init(s, tap_read, &tap);
+    for (;;) {
+        int rc = gdi_next(s, &page);
+        if (rc == GDI_EOF) break;
+        if (rc == GDI_ERROR) {
+            snprintf(r->error, sizeof(r->error), "%s", s->error);
+            break;
+        }
+        last = rc;
+        if (rc == GDI_PAGE) {
+            gdi_page_free(&page);
+            if (++r->pages == after && !r->signalled) {
+                kill(pid, SIGTERM);
+                sent = now();
+                r->signalled = 1;
+            }
+        }
+    }
+
+    /* Whatever follows an error is read, so the filter is not stopped
+     * by a full pipe */
+    char buf[65536];
+    while (tap_read(&tap, buf, sizeof(buf)) > 0)
+        ;
+    waitpid(pid, NULL, 0);
+    if (r->signalled)
+        r->exit_ms = (now() - sent) * 1e3;
+    if (!r->error[0] && last != GDI_JOB_END)
+        snprintf(r->error, sizeof(r->error), "output does not end with @PJL EOJ");
+    if (!r->error[0] && (tap.tail_len < PJL_UEL_LEN ||
+                         memcmp(tap.tail, PJL_UEL, PJL_UEL_LEN) != 0))
+        snprintf(r->error, sizeof(r->error), "no closing UEL after @PJL EOJ");
+    free(s);
+}
+
+/* Run the filter on in_fd; returns its exit status, or -1. With
+ * cancel_after > 0 the job is cancelled after that page, see r. */
+static int run_filter(const char *filter, const job_t *job, const char *extra,
+                      int in_fd, const char *emulator, double *secs,
+                      int cancel_after, cancel_result_t *r)
+{
+    FILE *emu = NULL;
+    int out_fd;
+
+    if (emulator) {
+        fflush(stdout);
+        emu = popen(emulator, "w");
+        if (!emu) {
+            perror(emulator);
+            return -1;
+        }
+        out_fd = fileno(emu);
+    } else {
+        out_fd = open("/dev/null", O_WRONLY);
+    }
+
+    /* The job's options, less the one that captured it */
+    char options[4096] = "";
+    char *copy = strdup(job->field[4]), *save = NULL;
+    for (char *t = copy ? strtok_r(copy, " ", &save) : NULL; t; t = strtok_r(NULL, " ", &save)) {
+        if (strncmp(t, "ricoh-capture", 13) == 0 && (t[13] == '=' || t[13] == '\0'))
+            continue;
+        size_t used = strlen(options);
+        snprintf(options + used, sizeof(options) - used, "%s%s", used ? " " : "", t);
+    }
+    free(copy);
+    if (extra) {
+        size_t used = strlen(options);
+        snprintf(options + used, sizeof(options) - used, "%s%s", used ? " " : "", extra);
+    }
+
+    int pipe_fds[2] = { -1, -1 };
+    if (cancel_after > 0 && pipe(pipe_fds) < 0) {
+        perror("pipe");
+        if (emu) pclose(emu);
+        else close(out_fd);
+        return -1;
+    }
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in_fd, 0);
+        dup2(cancel_after > 0 ? pipe_fds[1] : out_fd, 1);
+        if (cancel_after > 0) {
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+        }
+        execl(filter, filter, job->field[0], job->field[1], job->field[2],
+              job->field[3], options, (char *)NULL);
+        perror(filter);
+        _exit(127);
+    }
+    int status = -1;
+    if (cancel_after > 0) {
+        close(pipe_fds[1]);
+        if (pid > 0)
+            watch_cancel(pid, pipe_fds[0], out_fd, cancel_after, r);
+        close(pipe_fds[0]);
+        status = 0;             /* a cancelled filter's status says nothing */
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+    *secs = now() - start;
+
+    if (emu) pclose(emu);
+    else close(out_fd);
+    return pid > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: ricohgdi-replay [-f filter] [-e command] [-o options] [-r times] job...\n"
+        "  -f  filter to run (default ./rastertericoh)\n"
+        "  -e  pipe each job's output into this command, e.g. \"./ricohgdi-emu -q\"\n"
+        "  -o  options added to each job's own, e.g. ricoh-stripe-cache=on\n"
+        "  -r  replay the jobs this many times (default 1)\n"
+        "  -c  cancel each job with SIGTERM after this many pages, and time its exit\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = "./rastertericoh";
+    const char *emulator = NULL, *extra = NULL;
+    int opt, repeat = 1, cancel_after = 0;
+
+    while ((opt = getopt(argc, argv, "f:e:o:r:c:")) != -1) {
+        switch (opt) {
+        case 'f': filter = optarg; break;
+        case 'e': emulator = optarg; break;
+        case 'o': extra = optarg; break;
+        case 'r': repeat = atoi(optarg); break;
+        case 'c': cancel_after = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind >= argc || repeat < 1 || cancel_after < 0) usage();
+
+    int jobs = 0, pages = 0, failed = 0, cancels = 0;
+    double total = 0, worst_exit_ms = 0;
+    for (int r = 0; r < repeat; r++) {
+        for (int a = optind; a < argc; a++) {
+            job_t job;
+            if (job_load(&job, argv[a]) < 0) {
+                failed++;
+                continue;
+            }
+
+            /* Input is prepared before the clock starts */
+            int in_fd = -1, job_pages = -1;
+            FILE *tmp = NULL;
+            if (job.hashes) {
+                tmp = tmpfile();
+                if (tmp && (job_pages = rebuild(&job, tmp)) >= 0) {
+                    in_fd = fileno(tmp);
+                    lseek(in_fd, 0, SEEK_SET);
+                }
+            } else if (job.raster) {
+                char path[2048];
+                snprintf(path, sizeof(path), "%s/%s", job.dir, job.raster);
+                in_fd = open(path, O_RDONLY);
+                if (in_fd >= 0) job_pages = count_pages(in_fd);
+            }
+            if (in_fd < 0) {
+                fprintf(stderr, "%s: cannot prepare the job's input\n", argv[a]);
+                if (tmp) fclose(tmp);
+                job_free(&job);
+                failed++;
+                continue;
+            }
+
+            double secs = 0;
+            cancel_result_t cancel;
+            int status = run_filter(filter, &job, extra, in_fd, emulator, &secs,
+                                    cancel_after, &cancel);
+            if (cancel_after > 0 && !cancel.signalled) {
+                printf("%s: %d page(s), ended before page %d, not cancelled%s%s\n", argv[a],
+                       cancel.pages, cancel_after, cancel.error[0] ? ": " : "", cancel.error);
+                if (cancel.error[0]) status = 1;
+            } else if (cancel_after > 0) {
+                printf("%s: cancelled after page %d, exited in %.1f ms, %d page(s) out, %s\n",
+                       argv[a], cancel_after, cancel.exit_ms, cancel.pages,
+                       cancel.error[0] ? cancel.error : "job ended properly");
+                cancels++;
+                if (cancel.exit_ms > worst_exit_ms) worst_exit_ms = cancel.exit_ms;
+                if (cancel.error[0]) status = 1;
+            } else {
+                printf("%s: %d page(s), %.3f s, %.2f pages/s%s\n", argv[a], job_pages, secs,
+                       secs > 0 ? job_pages / secs : 0.0, status == 0 ? "" : ", filter failed");
+            }
+            fflush(stdout);
+            jobs++;
+            pages += job_pages > 0 ? job_pages : 0;
+            total += secs;
+            if (status != 0) failed++;
+
+            if (tmp) fclose(tmp);
+            else close(in_fd);
+            job_free(&job);
+        }
+    }
+
+    if (cancel_after > 0)
+        printf("total: %d job(s), %d cancelled, slowest exit %.1f ms, %d failed\n",
+               jobs, cancels, worst_exit_ms, failed);
+    else
+        printf("total: %d job(s), %d page(s), %.3f s, %.2f pages/s, %d failed\n",
+               jobs, pages, total, total > 0 ? pages / total : 0.0, failed);
+    return failed ? 1 : 0;
+}
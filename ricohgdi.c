@@ -0,0 +1,1015 @@
+/*
+ * ricohgdi - page ingest, JBIG encoding and PJL framing
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <jbig.h>
+#include "ricohgdi.h"
+
+static int buffer_reserve(rgdi_buffer_t *buf, size_t len)
+{
+    if (buf->failed) return -1;
+    if (buf->size + len <= buf->capacity)
+        return 0;
+    size_t new_cap = buf->capacity ? buf->capacity * 2 : 1024;
+    while (new_cap < buf->size + len)
+        new_cap *= 2;
+    unsigned char *new_data = realloc(buf->data, new_cap);
+    if (!new_data) {
+        gdi_log(LOG_ERR, "rastertericoh: buffer realloc failed");
+        buf->failed = 1;
+        return -1;
+    }
+    buf->data = new_data;
+    buf->capacity = new_cap;
+    return 0;
+}
+
+int rgdi_buffer_append(rgdi_buffer_t *buf, const void *data, size_t len)
+{
+    if (buffer_reserve(buf, len) < 0) return -1;
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    return 0;
+}
+
+void rgdi_buffer_free(rgdi_buffer_t *buf)
+{
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+void rgdi_pack_line(const cups_page_header2_t *header, const unsigned char *line,
+                    unsigned char *dst)
+{
+    unsigned int width = header->cupsWidth;
+    unsigned int bpl = header->cupsBytesPerLine;
+    unsigned int pbm_stride = (width + 7) / 8;
+
+    if (header->cupsBitsPerPixel == 1) {
+        /* Already 1-bit packed - but CUPS uses 0=white, 1=black
+         * which matches PBM convention. Just copy. */
+        memcpy(dst, line, pbm_stride);
+    } else if (header->cupsBitsPerPixel == 8) {
+        /* 8-bit grayscale: threshold at 128
+         * CUPS: 0=black, 255=white for COLORSPACE_W
+         * PBM: 1=black, 0=white
+         * So: if pixel < 128 -> black (1), else white (0) */
+        memset(dst, 0, pbm_stride);
+        for (unsigned int x = 0; x < width; x++) {
+            int black;
+            if (header->cupsColorSpace == CUPS_CSPACE_W ||
+                header->cupsColorSpace == CUPS_CSPACE_SW) {
+                /* White colorspace: 0=black, 255=white */
+                black = (line[x] < 128);
+            } else {
+                /* K colorspace: 0=white, 255=black */
+                black = (line[x] >= 128);
+            }
+            if (black) {
+                dst[x / 8] |= (0x80 >> (x % 8));
+            }
+        }
+    } else {
+        gdi_log(LOG_WARNING, "rastertericoh: unsupported bpp=%u, treating as 1-bit",
+                header->cupsBitsPerPixel);
+        memcpy(dst, line, pbm_stride < bpl ? pbm_stride : bpl);
+    }
+}
+
+/* Convert CUPS raster page to packed PBM (1-bit) format.
+ * CUPS raster for a B&W printer should already be 1-bit,
+ * but we handle 8-bit grayscale too just in case. */
+unsigned char *rgdi_raster_to_pbm(cups_page_header2_t *header,
+                                  cups_raster_t *ras,
+                                  unsigned int *out_width,
+                                  unsigned int *out_height,
+                                  size_t *out_size)
+{
+    unsigned int width = header->cupsWidth;
+    unsigned int height = header->cupsHeight;
+    unsigned int bpl = header->cupsBytesPerLine;
+    /* PBM row stride: ceil(width/8) */
+    unsigned int pbm_stride = (width + 7) / 8;
+    size_t pbm_size = (size_t)pbm_stride * height;
+    unsigned char *pbm = calloc(1, pbm_size);
+    unsigned char *line = malloc(bpl);
+
+    if (!pbm || !line) {
+        gdi_log(LOG_ERR, "rastertericoh: memory allocation failed");
+        free(pbm);
+        free(line);
+        return NULL;
+    }
+
+    uint64_t span = gdi_trace_begin();
+    for (unsigned int y = 0; y < height; y++) {
+        if (cupsRasterReadPixels(ras, line, bpl) != bpl) {
+            gdi_log(LOG_ERR, "rastertericoh: short read at line %u", y);
+            break;
+        }
+
+        rgdi_pack_line(header, line, pbm + (size_t)y * pbm_stride);
+
+        /* Traced in stripes of rows, to line up with the encoder */
+        if ((y + 1) % RGDI_STRIPE_LINES == 0 || y + 1 == height) {
+            gdi_trace_end("ingest", span, y / RGDI_STRIPE_LINES);
+            span = gdi_trace_begin();
+        }
+    }
+
+    free(line);
+    *out_width = width;
+    *out_height = height;
+    *out_size = pbm_size;
+    return pbm;
+}
+
+/* Largest image taken: US Legal at 1200 dpi, the biggest paper at the
+ * highest resolution, so a bogus header cannot ask for gigabytes */
+#define PNM_MAX_PIXELS ((size_t)10200 * 16800)
+
+void rgdi_pnm_open(rgdi_pnm_t *pnm, int fd)
+{
+    pnm->fd = fd;
+    pnm->pos = pnm->len = 0;
+}
+
+int rgdi_pnm_rewind(rgdi_pnm_t *pnm)
+{
+    if (lseek(pnm->fd, 0, SEEK_SET) < 0)
+        return -1;
+    pnm->pos = pnm->len = 0;
+    return 0;
+}
+
+/* Next byte of the stream, -1 at its end or on a read error */
+static int pnm_byte(rgdi_pnm_t *pnm)
+{
+    if (pnm->pos == pnm->len) {
+        ssize_t n;
+        do {
+            n = read(pnm->fd, pnm->buf, sizeof(pnm->buf));
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return -1;
+        pnm->pos = 0;
+        pnm->len = (size_t)n;
+    }
+    return pnm->buf[pnm->pos++];
+}
+
+/* len bytes of image data: what is buffered, then the rest read
+ * straight into dst. Returns the bytes got. */
+static size_t pnm_read(rgdi_pnm_t *pnm, unsigned char *dst, size_t len)
+{
+    size_t got = pnm->len - pnm->pos < len ? pnm->len - pnm->pos : len;
+    memcpy(dst, pnm->buf + pnm->pos, got);
+    pnm->pos += got;
+    while (got < len) {
+        ssize_t n = read(pnm->fd, dst + got, len - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    return got;
+}
+
+/* Header number, after whitespace and comments; 0 if malformed. The
+ * single whitespace byte after it is consumed too. */
+static unsigned int pnm_number(rgdi_pnm_t *pnm)
+{
+    int c = pnm_byte(pnm);
+    while (c == '#' || (c >= 0 && isspace(c))) {
+        if (c == '#')
+            while (c >= 0 && c != '\n') c = pnm_byte(pnm);
+        c = pnm_byte(pnm);
+    }
+    unsigned long v = 0;
+    if (c < 0 || !isdigit(c))
+        return 0;
+    while (c >= 0 && isdigit(c) && v <= 1000000) {
+        v = v * 10 + (c - '0');
+        c = pnm_byte(pnm);
+    }
+    return c >= 0 && isspace(c) && v <= 1000000 ? (unsigned int)v : 0;
+}
+
+/* Next sample of a plain (P1, P2) image, after whitespace and comments:
+ * one digit for P1, which needs no space between pixels, else a number
+ * up to maxval. -1 if malformed; the stream may end after the last. */
+static long pnm_sample(rgdi_pnm_t *pnm, int format, unsigned int maxval)
+{
+    int c = pnm_byte(pnm);
+    while (c == '#' || (c >= 0 && isspace(c))) {
+        if (c == '#')
+            while (c >= 0 && c != '\n') c = pnm_byte(pnm);
+        c = pnm_byte(pnm);
+    }
+    if (c < 0 || !isdigit(c))
+        return -1;
+    if (format == '1')
+        return c <= '1' ? c - '0' : -1;
+    unsigned long v = 0;
+    while (c >= 0 && isdigit(c) && v <= maxval) {
+        v = v * 10 + (c - '0');
+        c = pnm_byte(pnm);
+    }
+    return (c < 0 || isspace(c)) && v <= maxval ? (long)v : -1;
+}
+
+int rgdi_pnm_read(rgdi_pnm_t *pnm, cups_page_header2_t *header, unsigned char **pbm,
+                  unsigned int *width, unsigned int *height, size_t *size)
+{
+    int c = pnm_byte(pnm);
+    while (c >= 0 && isspace(c))
+        c = pnm_byte(pnm);
+    if (c < 0)
+        return 0;
+    int format = c == 'P' ? pnm_byte(pnm) : -1;
+    if (format != '1' && format != '2' && format != '4' && format != '5') {
+        gdi_log(LOG_ERR, "unsupported image: only PBM (P1, P4) and PGM (P2, P5) are taken");
+        return -1;
+    }
+    int bitmap = format == '1' || format == '4';
+    unsigned int w = pnm_number(pnm), h = pnm_number(pnm);
+    unsigned int maxval = bitmap ? 1 : pnm_number(pnm);
+    if (!w || !h || !maxval || maxval > 65535) {
+        gdi_log(LOG_ERR, "malformed P%c header", format);
+        return -1;
+    }
+    if ((size_t)w * h > PNM_MAX_PIXELS) {
+        gdi_log(LOG_ERR, "P%c image too large (%ux%u)", format, w, h);
+        return -1;
+    }
+
+    size_t stride = GDI_BITMAP_STRIDE(w), page_size = stride * h;
+    unsigned char *page = malloc(page_size);
+    if (!page) {
+        gdi_log(LOG_ERR, "rastertericoh: memory allocation failed");
+        return -1;
+    }
+    header->cupsWidth = w;
+    header->cupsHeight = h;
+    header->cupsBitsPerColor = header->cupsBitsPerPixel = bitmap ? 1 : 8;
+    header->cupsBytesPerLine = bitmap ? (unsigned int)stride : w;
+    header->cupsColorSpace = bitmap ? CUPS_CSPACE_K : CUPS_CSPACE_SW;
+
+    int complete = 1;
+    if (format == '1') {
+        /* One digit per pixel, 1 black as in the bitmap */
+        memset(page, 0, page_size);
+        for (unsigned int y = 0; y < h && complete; y++) {
+            unsigned char *row = page + (size_t)y * stride;
+            for (unsigned int x = 0; x < w && complete; x++) {
+                long bit = pnm_sample(pnm, format, 1);
+                complete = bit >= 0;
+                if (bit > 0)
+                    row[x / 8] |= 0x80 >> (x % 8);
+            }
+        }
+    } else if (format == '4') {
+        /* The bitmap's own layout; only the padding bits, which PBM
+         * leaves undefined, need clearing */
+        complete = pnm_read(pnm, page, page_size) == page_size;
+        if (w % 8)
+            for (unsigned int y = 0; y < h; y++)
+                page[(size_t)y * stride + stride - 1] &= 0xff << (8 - w % 8);
+    } else {
+        size_t sample = maxval > 255 ? 2 : 1;
+        unsigned char *line = malloc(w * sample);
+        if (!line) {
+            free(page);
+            gdi_log(LOG_ERR, "rastertericoh: memory allocation failed");
+            return -1;
+        }
+        for (unsigned int y = 0; y < h && complete; y++) {
+            if (format == '2') {
+                /* Numbers, which go through the same scaling as bytes */
+                for (unsigned int x = 0; x < w && complete; x++) {
+                    long v = pnm_sample(pnm, format, maxval);
+                    complete = v >= 0;
+                    if (sample == 2) {
+                        line[2 * x] = (unsigned char)(v >> 8);
+                        line[2 * x + 1] = (unsigned char)v;
+                    } else {
+                        line[x] = (unsigned char)v;
+                    }
+                }
+            } else {
+                complete = pnm_read(pnm, line, w * sample) == w * sample;
+            }
+            /* To 8 bits, 0 black, so 128 is the threshold */
+            if (sample == 2)
+                for (unsigned int x = 0; x < w; x++)
+                    line[x] = ((unsigned long)line[2 * x] << 8 | line[2 * x + 1]) * 255 / maxval;
+            else if (maxval != 255)
+                for (unsigned int x = 0; x < w; x++)
+                    line[x] = (unsigned int)line[x] * 255 / maxval;
+            rgdi_pack_line(header, line, page + (size_t)y * stride);
+        }
+        free(line);
+    }
+    if (!complete) {
+        gdi_log(LOG_ERR, "short or malformed P%c image (%ux%u)", format, w, h);
+        free(page);
+        return -1;
+    }
+    *pbm = page;
+    *width = w;
+    *height = h;
+    *size = page_size;
+    return 1;
+}
+
+/* JBIG output callback - collect compressed data */
+static void jbig_data_cb(unsigned char *start, size_t len, void *file)
+{
+    rgdi_buffer_append((rgdi_buffer_t *)file, start, len);
+}
+
+/* Compress PBM data to JBIG1 with the specific parameters for Ricoh printers */
+unsigned char *rgdi_pbm_to_jbig(const unsigned char *pbm,
+                                unsigned int width,
+                                unsigned int height,
+                                size_t *out_size)
+{
+    struct jbg_enc_state enc;
+    rgdi_buffer_t buf = { NULL, 0, 0, 0 };
+
+    unsigned char *pbm_mut = (unsigned char *)pbm;
+    jbg_enc_init(&enc, width, height, 1, &pbm_mut, jbig_data_cb, &buf);
+
+    /* Parameters matching the original driver:
+     * -p 72  -> l0 = RGDI_STRIPE_LINES (lines per stripe)
+     * -o 3   -> order = JBG_HITOLO | JBG_SEQ = 3
+     * -m 0   -> mx = 0 (no AT moves)
+     * -q     -> options = JBG_TPBON (typical prediction)
+     * Keep RGDI_PROFILE in step with these. */
+    jbg_enc_options(&enc, JBG_HITOLO | JBG_SEQ, JBG_TPBON, RGDI_STRIPE_LINES, 0, 0);
+    jbg_enc_out(&enc);
+    jbg_enc_free(&enc);
+
+    if (buf.failed || buf.size == 0) {
+        free(buf.data);
+        return NULL;
+    }
+    *out_size = buf.size;
+    return buf.data;
+}
+
+unsigned char *rgdi_encode(rgdi_encoder_t *enc, const unsigned char *pbm,
+                           unsigned int width, unsigned int height,
+                           size_t *out_size)
+{
+    size_t pbm_size = (size_t)(width + 7) / 8 * height;
+    const char *profile = enc->stripe_cache || enc->sdrst ? RGDI_PROFILE_SDRST
+                                                          : RGDI_PROFILE;
+    unsigned char key[PAGE_CACHE_KEY_LEN];
+    unsigned char *jbig;
+
+    enc->from_cache = 0;
+    enc->dots = gdi_bitmap_count(pbm, pbm_size);
+    enc->guard.tripped = 0;
+    if (enc->page_cache) {
+        uint64_t span = gdi_trace_begin();
+        page_cache_key(pbm, pbm_size, width, height, profile, key);
+        if (enc->page_cache_lock) pthread_mutex_lock(enc->page_cache_lock);
+        jbig = page_cache_get(enc->page_cache, key, width, height, out_size);
+        if (enc->page_cache_lock) pthread_mutex_unlock(enc->page_cache_lock);
+        gdi_trace_end("page cache lookup", span, -1);
+        if (jbig) {
+            enc->from_cache = 1;
+            enc->page_hits++;
+            return jbig;
+        }
+    }
+
+    if (enc->stripe_cache || enc->sdrst) {
+        jbig = jbig_encode_stripes(pbm, width, height, RGDI_STRIPE_LINES, enc->stripe_cache,
+                                   enc->stripe_cache_lock, enc->cancel, out_size);
+    } else if (enc->cancel || enc->guard.page_ms > 0 || enc->guard.max_ratio > 0) {
+        /* Same bytes as rgdi_pbm_to_jbig(), but it can stop early or
+         * give up on a pathological page */
+        jbig = jbig_encode_page(pbm, width, height, RGDI_STRIPE_LINES,
+                                enc->cancel, &enc->guard, out_size);
+    } else {
+        uint64_t span = gdi_trace_begin();
+        jbig = rgdi_pbm_to_jbig(pbm, width, height, out_size);
+        gdi_trace_end("encode page", span, -1);
+    }
+
+    /* A page the guard gave up on depends on timing; keep it out of the cache */
+    if (jbig && enc->page_cache && !enc->guard.tripped) {
+        /* The file is written and synced outside the lock; other
+         * threads only wait for the rename */
+        char temp[PAGE_CACHE_PATH_LEN];
+        uint64_t span = gdi_trace_begin();
+        off_t size = page_cache_write(enc->page_cache, key, width, height, jbig,
+                                      *out_size, 1, temp);
+        if (size >= 0) {
+            if (enc->page_cache_lock) pthread_mutex_lock(enc->page_cache_lock);
+            page_cache_commit(enc->page_cache, key, temp, size);
+            if (enc->page_cache_lock) pthread_mutex_unlock(enc->page_cache_lock);
+        }
+        gdi_trace_end("page cache store", span, -1);
+    }
+    return jbig;
+}
+
+/* Papers the printer takes: CUPS name, PJL name and size in points,
+ * as in the PPD */
+static const struct {
+    const char *cups;
+    const char *pjl;
+    unsigned int width, height;
+} papers[] = {
+    { "A4", "A4", 595, 842 },
+    { "Letter", "LETTER", 612, 792 },
+    { "Legal", "LEGAL", 612, 1008 },
+    { "A5", "A5", 420, 595 },
+    { "A6", "A6", 297, 420 },
+    { "B5", "B5", 516, 729 },
+    { "B6", "B6", 363, 516 },
+    { "Monarch", "MONARCH", 279, 540 },
+};
+
+static int find_paper(const char *cups_size)
+{
+    for (size_t i = 0; cups_size && i < sizeof(papers) / sizeof(papers[0]); i++)
+        if (strcasecmp(cups_size, papers[i].cups) == 0) return (int)i;
+    return -1;
+}
+
+/* Map CUPS page size name to PJL paper name */
+const char *rgdi_cups_to_pjl_paper(const char *cups_size)
+{
+    int i = find_paper(cups_size);
+    return i >= 0 ? papers[i].pjl : "A4";
+}
+
+/* Raster resolution the page is scaled from: 300 and 1200 dpi are
+ * brought to the printer's 600, anything else is sent as it is */
+static unsigned int adapt_from(const cups_page_header2_t *header)
+{
+    unsigned int xres = header->HWResolution[0];
+    if (xres == header->HWResolution[1] && (xres == 300 || xres == 1200))
+        return xres;
+    return RGDI_RESOLUTION;
+}
+
+void rgdi_page_info_from_header(rgdi_page_info_t *info,
+                                const cups_page_header2_t *header,
+                                unsigned int width, unsigned int height)
+{
+    info->paper = rgdi_cups_to_pjl_paper(header->cupsPageSizeName);
+    info->mediasource = header->MediaPosition == 1 ? "MANUALFEED" : "TRAY1";
+    info->width = width;
+    info->height = height;
+    info->resolution = adapt_from(header) != RGDI_RESOLUTION ? RGDI_RESOLUTION
+                                                             : (int)header->HWResolution[0];
+}
+
+/* A numeric option, or def if it is missing or outside [min, max] */
+static double number_option(const char *name, double def, double min, double max,
+                            int num_options, cups_option_t *options)
+{
+    const char *value = cupsGetOption(name, num_options, options);
+    double v = value ? atof(value) : def;
+    return v >= min && v <= max ? v : def;
+}
+
+void rgdi_job_header_from_options(cups_page_header2_t *header, int num_options,
+                                  cups_option_t *options)
+{
+    const char *size = cupsGetOption("PageSize", num_options, options);
+    const char *slot = cupsGetOption("InputSlot", num_options, options);
+    const char *resolution = cupsGetOption("Resolution", num_options, options);
+    if (!size) size = cupsGetOption("media", num_options, options);
+    char name[64];
+    snprintf(name, sizeof(name), "%.*s", size ? (int)strcspn(size, ",") : 0, size ? size : "");
+    int paper = find_paper(name);
+    if (paper < 0) paper = 0;
+    int dpi = resolution ? atoi(resolution) : RGDI_RESOLUTION;
+
+    memset(header, 0, sizeof(*header));
+    snprintf(header->cupsPageSizeName, sizeof(header->cupsPageSizeName), "%s",
+             papers[paper].cups);
+    header->HWResolution[0] = header->HWResolution[1] =
+        dpi == 300 || dpi == 1200 ? (unsigned int)dpi : RGDI_RESOLUTION;
+    header->MediaPosition = slot && strcasecmp(slot, "MANUALFEED") == 0;
+}
+
+void rgdi_text_from_options(gdi_text_layout_t *layout, cups_page_header2_t *header,
+                            int num_options, cups_option_t *options)
+{
+    rgdi_job_header_from_options(header, num_options, options);
+    header->HWResolution[0] = header->HWResolution[1] = RGDI_RESOLUTION;
+    int paper = find_paper(header->cupsPageSizeName);
+
+    header->cupsWidth = papers[paper].width * RGDI_RESOLUTION / 72;
+    header->cupsHeight = papers[paper].height * RGDI_RESOLUTION / 72;
+    header->cupsBitsPerPixel = header->cupsBitsPerColor = 1;
+    header->cupsBytesPerLine = GDI_BITMAP_STRIDE(header->cupsWidth);
+
+    /* Cells no wider than the glyph rows: at least 9.4 characters per inch */
+    double cpi = number_option("cpi", RGDI_TEXT_CPI,
+                               (double)RGDI_RESOLUTION / GDI_TEXT_MAX_CELL, 100,
+                               num_options, options);
+    double lpi = number_option("lpi", RGDI_TEXT_LPI, 1, 100, num_options, options);
+    double half_width = papers[paper].width / 2.0, half_height = papers[paper].height / 2.0;
+    double left = number_option("page-left", RGDI_TEXT_MARGIN, 0, half_width,
+                                num_options, options);
+    double right = number_option("page-right", RGDI_TEXT_MARGIN, 0, half_width,
+                                 num_options, options);
+    double top = number_option("page-top", RGDI_TEXT_MARGIN, 0, half_height,
+                               num_options, options);
+    double bottom = number_option("page-bottom", RGDI_TEXT_MARGIN, 0, half_height,
+                                  num_options, options);
+    const char *wrap = cupsGetOption("wrap", num_options, options);
+
+    layout->width = header->cupsWidth;
+    layout->height = header->cupsHeight;
+    layout->left = (unsigned int)(left * RGDI_RESOLUTION / 72);
+    layout->top = (unsigned int)(top * RGDI_RESOLUTION / 72);
+    layout->cell_width = (unsigned int)(RGDI_RESOLUTION / cpi);
+    layout->cell_height = (unsigned int)(RGDI_RESOLUTION / lpi);
+    unsigned int right_px = (unsigned int)(right * RGDI_RESOLUTION / 72);
+    unsigned int bottom_px = (unsigned int)(bottom * RGDI_RESOLUTION / 72);
+    layout->columns = layout->left + right_px < layout->width
+        ? (layout->width - layout->left - right_px) / layout->cell_width : 0;
+    layout->lines = layout->top + bottom_px < layout->height
+        ? (layout->height - layout->top - bottom_px) / layout->cell_height : 0;
+    layout->wrap = !wrap || rgdi_option_enabled("wrap", num_options, options);
+}
+
+/* "odd", "even" or a list such as 1,3-5,8- */
+static void parse_pages(rgdi_adapt_t *adapt, const char *list)
+{
+    if (strcasecmp(list, "odd") == 0) {
+        adapt->parity = 1;
+        return;
+    }
+    if (strcasecmp(list, "even") == 0) {
+        adapt->parity = 2;
+        return;
+    }
+    for (const char *p = list; *p && adapt->nranges < RGDI_MAX_RANGES; ) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) break;
+        p = end;
+        if (*p == '-') {
+            last = strtol(++p, &end, 10);
+            if (end == p) last = INT_MAX;
+            p = end;
+        }
+        adapt->ranges[adapt->nranges].first = (int)first;
+        adapt->ranges[adapt->nranges].last = (int)last;
+        adapt->nranges++;
+        if (*p == ',') p++;
+    }
+}
+
+void rgdi_adapt_from_options(rgdi_adapt_t *adapt, int num_options, cups_option_t *options)
+{
+    const char *downsample = cupsGetOption("ricoh-downsample", num_options, options);
+    const char *fit = cupsGetOption("ricoh-fit", num_options, options);
+    const char *rotate = cupsGetOption("ricoh-rotate", num_options, options);
+    const char *pages = cupsGetOption("ricoh-transform-pages", num_options, options);
+
+    adapt->majority = downsample && strcasecmp(downsample, "majority") == 0;
+    adapt->fit = !fit || rgdi_option_enabled("ricoh-fit", num_options, options);
+    adapt->rotate = rotate ? atoi(rotate) : 0;
+    if (adapt->rotate != 90 && adapt->rotate != 180 && adapt->rotate != 270)
+        adapt->rotate = 0;
+    adapt->mirror = rgdi_option_enabled("ricoh-mirror", num_options, options);
+    adapt->parity = 0;
+    adapt->nranges = 0;
+    if (pages && *pages)
+        parse_pages(adapt, pages);
+}
+
+static int transform_page(const rgdi_adapt_t *adapt, int page)
+{
+    if (!adapt->rotate && !adapt->mirror) return 0;
+    if (adapt->parity) return page % 2 == adapt->parity % 2;
+    if (adapt->nranges == 0) return 1;
+    for (int i = 0; i < adapt->nranges; i++)
+        if (page >= adapt->ranges[i].first && page <= adapt->ranges[i].last) return 1;
+    return 0;
+}
+
+/* Replace *page by next, freeing *page unless it is the caller's */
+static int step(unsigned char **page, unsigned char *next, const unsigned char *orig)
+{
+    if (!next) return -1;
+    if (*page != orig) free(*page);
+    *page = next;
+    return 0;
+}
+
+int rgdi_adapt_page(const rgdi_adapt_t *adapt, const cups_page_header2_t *header,
+                    int page_number, unsigned char **pbm, unsigned int *width,
+                    unsigned int *height, size_t *size)
+{
+    unsigned int from = adapt_from(header);
+    unsigned char *page = *pbm;
+    unsigned int w = *width, h = *height;
+    int failed = 0;
+
+    if (from == 300) {
+        failed = step(&page, gdi_bitmap_double(page, w, h), *pbm);
+        w *= 2;
+        h *= 2;
+    } else if (from == 1200) {
+        failed = step(&page, gdi_bitmap_halve(page, w, h, adapt->majority), *pbm);
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+
+    /* Orientation before fitting, so a landscape envelope is turned
+     * and then matched to its portrait paper */
+    if (!failed && transform_page(adapt, page_number)) {
+        if (adapt->rotate) {
+            failed = step(&page, gdi_bitmap_rotate(page, w, h, adapt->rotate), *pbm);
+            if (adapt->rotate != 180) {
+                unsigned int t = w;
+                w = h;
+                h = t;
+            }
+        }
+        if (!failed && adapt->mirror)
+            failed = step(&page, gdi_bitmap_mirror(page, w, h), *pbm);
+    }
+
+    /* The paper at 600 dpi, truncated as CUPS does for the raster; pages
+     * within RGDI_FIT_SLACK of it are left alone */
+    int paper = find_paper(header->cupsPageSizeName);
+    int at_600 = from != RGDI_RESOLUTION || (header->HWResolution[0] == RGDI_RESOLUTION &&
+                                             header->HWResolution[1] == RGDI_RESOLUTION);
+    if (!failed && adapt->fit && at_600 && paper >= 0) {
+        unsigned int pw = papers[paper].width * RGDI_RESOLUTION / 72;
+        unsigned int ph = papers[paper].height * RGDI_RESOLUTION / 72;
+        if (w + RGDI_FIT_SLACK < pw || w > pw + RGDI_FIT_SLACK ||
+            h + RGDI_FIT_SLACK < ph || h > ph + RGDI_FIT_SLACK) {
+            failed = step(&page, gdi_bitmap_fit(page, w, h, pw, ph), *pbm);
+            w = pw;
+            h = ph;
+        }
+    }
+
+    if (failed) {
+        if (page != *pbm) free(page);
+        return -1;
+    }
+    if (page != *pbm) {
+        free(*pbm);
+        *pbm = page;
+        *width = w;
+        *height = h;
+        *size = GDI_BITMAP_STRIDE(w) * h;
+    }
+    return 0;
+}
+
+/* Next number in a PBM header, skipping whitespace and comments */
+static const unsigned char *pbm_number(const unsigned char *p, const unsigned char *end,
+                                       unsigned int *value)
+{
+    while (p < end && (isspace(*p) || *p == '#')) {
+        if (*p == '#')
+            while (p < end && *p != '\n') p++;
+        else
+            p++;
+    }
+    unsigned long v = 0;
+    const unsigned char *start = p;
+    while (p < end && isdigit(*p) && v <= 1000000)
+        v = v * 10 + (*p++ - '0');
+    if (p == start || v == 0 || v > 1000000) return NULL;
+    *value = (unsigned int)v;
+    return p;
+}
+
+static int valid_overlay_name(const char *name, size_t len)
+{
+    if (len == 0 || len > 64 || name[0] == '.') return 0;
+    for (size_t i = 0; i < len; i++)
+        if (!isalnum((unsigned char)name[i]) && !strchr("-_.", name[i])) return 0;
+    return 1;
+}
+
+static void map_overlay(rgdi_overlays_t *overlays, const char *dir, const char *name,
+                        size_t len, int knockout)
+{
+    char path[1024];
+    if (!valid_overlay_name(name, len)) {
+        gdi_log(LOG_ERR, "overlay name \"%.*s\" not allowed", (int)len, name);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%.*s.pbm", dir, (int)len, name);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        gdi_log(LOG_ERR, "cannot open overlay %s: %s", path, strerror(errno));
+        return;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        gdi_log(LOG_ERR, "cannot map overlay %s", path);
+        return;
+    }
+
+    /* P4, width, height, one whitespace character, packed rows */
+    const unsigned char *p = map, *end = p + st.st_size;
+    unsigned int width = 0, height = 0;
+    if (st.st_size < 2 || p[0] != 'P' || p[1] != '4' ||
+        !(p = pbm_number(p + 2, end, &width)) ||
+        !(p = pbm_number(p, end, &height)) || p >= end || !isspace(*p) ||
+        (size_t)(end - ++p) < GDI_BITMAP_STRIDE(width) * height) {
+        gdi_log(LOG_ERR, "overlay %s is not a raw PBM (P4) file", path);
+        munmap(map, (size_t)st.st_size);
+        return;
+    }
+
+    int i = overlays->count++;
+    overlays->layers[i].bits = p;
+    overlays->layers[i].width = width;
+    overlays->layers[i].height = height;
+    overlays->layers[i].knockout = knockout;
+    overlays->layers[i].map = map;
+    overlays->layers[i].map_size = (size_t)st.st_size;
+    gdi_log(LOG_DEBUG, "event=overlay name=%.*s width=%u height=%u knockout=%d",
+            (int)len, name, width, height, knockout);
+}
+
+void rgdi_overlays_from_options(rgdi_overlays_t *overlays, int num_options,
+                                cups_option_t *options)
+{
+    const char *dir = getenv("RICOH_GDI_OVERLAYS");
+    if (!dir || !*dir) dir = RGDI_OVERLAY_DIR;
+
+    overlays->count = 0;
+    for (int knockout = 1; knockout >= 0; knockout--) {
+        const char *list = cupsGetOption(knockout ? "ricoh-overlay-knockout" : "ricoh-overlay",
+                                         num_options, options);
+        for (const char *p = list; p && *p; ) {
+            size_t len = strcspn(p, ",");
+            if (len && overlays->count < RGDI_MAX_OVERLAYS)
+                map_overlay(overlays, dir, p, len, knockout);
+            p += len;
+            if (*p == ',') p++;
+        }
+    }
+}
+
+void rgdi_overlays_apply(const rgdi_overlays_t *overlays, unsigned char *pbm,
+                         unsigned int width, unsigned int height)
+{
+    for (int i = 0; i < overlays->count; i++)
+        gdi_bitmap_overlay(pbm, width, height, overlays->layers[i].bits,
+                           overlays->layers[i].width, overlays->layers[i].height,
+                           overlays->layers[i].knockout);
+}
+
+void rgdi_overlays_free(rgdi_overlays_t *overlays)
+{
+    for (int i = 0; i < overlays->count; i++)
+        munmap(overlays->layers[i].map, overlays->layers[i].map_size);
+    overlays->count = 0;
+}
+
+void rgdi_nup_from_options(rgdi_nup_t *nup, int num_options, cups_option_t *options)
+{
+    const char *number_up = cupsGetOption("ricoh-number-up", num_options, options);
+    const char *downsample = cupsGetOption("ricoh-downsample", num_options, options);
+
+    memset(nup, 0, sizeof(*nup));
+    nup->number_up = number_up ? atoi(number_up) : 1;
+    if (nup->number_up != 2 && nup->number_up != 4)
+        nup->number_up = 1;
+    nup->border = rgdi_option_enabled("ricoh-number-up-border", num_options, options);
+    nup->majority = downsample && strcasecmp(downsample, "majority") == 0;
+}
+
+int rgdi_nup_add(rgdi_nup_t *nup, const cups_page_header2_t *header,
+                 const unsigned char *pbm, unsigned int width, unsigned int height)
+{
+    if (!nup->sheet) {
+        size_t stride = GDI_BITMAP_STRIDE(width);
+        nup->sheet = calloc(stride ? stride : 1, height ? height : 1);
+        if (!nup->sheet) return -1;
+        nup->width = width;
+        nup->height = height;
+        nup->placed = 0;
+        nup->header = *header;
+    }
+
+    /* Cells in reading order once the sheet is turned so that 2-up
+     * pages are upright: top to bottom on a portrait sheet, whose pages
+     * are turned clockwise, left to right on a landscape one */
+    int landscape = nup->width > nup->height;
+    unsigned int cols = 2, rows = 2;
+    if (nup->number_up == 2) {
+        cols = landscape ? 2 : 1;
+        rows = landscape ? 1 : 2;
+    }
+    unsigned int cell_w = nup->width / cols, cell_h = nup->height / rows;
+    unsigned int cell_x = (unsigned int)nup->placed % cols * cell_w;
+    unsigned int cell_y = (unsigned int)nup->placed / cols * cell_h;
+
+    unsigned char *page = gdi_bitmap_halve(pbm, width, height, nup->majority);
+    unsigned int w = (width + 1) / 2, h = (height + 1) / 2;
+    if (page && (w > h) != (cell_w > cell_h)) {
+        unsigned char *turned = gdi_bitmap_rotate(page, w, h, landscape ? 270 : 90);
+        free(page);
+        page = turned;
+        unsigned int t = w;
+        w = h;
+        h = t;
+    }
+
+    /* A page larger than its cell (from a bigger paper than the first
+     * one) loses its edges rather than covering its neighbours */
+    if (page && (w > cell_w || h > cell_h)) {
+        unsigned int fw = w < cell_w ? w : cell_w, fh = h < cell_h ? h : cell_h;
+        unsigned char *fitted = gdi_bitmap_fit(page, w, h, fw, fh);
+        free(page);
+        page = fitted;
+        w = fw;
+        h = fh;
+    }
+    if (!page) return -1;
+
+    unsigned int x = cell_x + (cell_w - w) / 2, y = cell_y + (cell_h - h) / 2;
+    gdi_bitmap_place(nup->sheet, nup->width, nup->height, page, w, h, x, y);
+    if (nup->border)
+        gdi_bitmap_frame(nup->sheet, nup->width, nup->height, x, y, w, h,
+                         RGDI_NUP_BORDER);
+    free(page);
+
+    return ++nup->placed == nup->number_up;
+}
+
+unsigned char *rgdi_nup_take(rgdi_nup_t *nup, cups_page_header2_t *header,
+                             unsigned int *width, unsigned int *height, size_t *size)
+{
+    unsigned char *sheet = nup->sheet;
+    if (!sheet) return NULL;
+    *header = nup->header;
+    *width = nup->width;
+    *height = nup->height;
+    *size = GDI_BITMAP_STRIDE(nup->width) * nup->height;
+    nup->sheet = NULL;
+    nup->placed = 0;
+    return sheet;
+}
+
+void rgdi_nup_free(rgdi_nup_t *nup)
+{
+    free(nup->sheet);
+    nup->sheet = NULL;
+    nup->placed = 0;
+}
+
+/* True for boolean job options given as on/true/yes */
+int rgdi_option_enabled(const char *name, int num_options, cups_option_t *options)
+{
+    const char *value = cupsGetOption(name, num_options, options);
+    return value && (strcasecmp(value, "on") == 0 || strcasecmp(value, "true") == 0 ||
+                     strcasecmp(value, "yes") == 0);
+}
+
+int rgdi_despeckle_from_options(int num_options, cups_option_t *options)
+{
+    const char *value = cupsGetOption("ricoh-despeckle", num_options, options);
+    if (value && strcasecmp(value, "pixels") == 0) return 1;
+    return rgdi_option_enabled("ricoh-despeckle", num_options, options) ? 2 : 0;
+}
+
+void rgdi_guard_from_options(rgdi_encoder_t *enc, int num_options, cups_option_t *options)
+{
+    const char *value = cupsGetOption("ricoh-page-budget", num_options, options);
+    double ms = value ? atof(value) : 0;
+
+    if (ms > 0) {
+        enc->guard.page_ms = ms;
+        enc->guard.max_ratio = RGDI_GUARD_MAX_RATIO;
+    }
+}
+
+void rgdi_pjl_timestamp(char *buf, size_t size, int fixed)
+{
+    if (fixed) {
+        const char *epoch = getenv("SOURCE_DATE_EPOCH");
+        if (epoch) {
+            time_t t = (time_t)strtoll(epoch, NULL, 10);
+            strftime(buf, size, "%Y/%m/%d %H:%M:%S", gmtime(&t));
+        } else {
+            snprintf(buf, size, "%s", RGDI_FIXED_TIMESTAMP);
+        }
+    } else {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(buf, size, "%Y/%m/%d %H:%M:%S", &tm);
+    }
+}
+
+/* Append raw text to a PJL buffer */
+void rgdi_pjl_puts(rgdi_buffer_t *buf, const char *text)
+{
+    rgdi_buffer_append(buf, text, strlen(text));
+}
+
+/* Append PJL line with CR+LF ending */
+void rgdi_pjl_printf(rgdi_buffer_t *buf, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0 || buffer_reserve(buf, (size_t)len + 3) < 0) return;
+
+    va_start(ap, fmt);
+    vsnprintf((char *)buf->data + buf->size, (size_t)len + 1, fmt, ap);
+    va_end(ap);
+    buf->size += len;
+    buf->data[buf->size++] = '\r';
+    buf->data[buf->size++] = '\n';
+}
+
+void rgdi_pjl_job_header(rgdi_buffer_t *buf, const char *timestamp, const char *user)
+{
+    rgdi_pjl_printf(buf, "\033%%-12345X@PJL");
+    rgdi_pjl_printf(buf, "@PJL SET TIMESTAMP=%s", timestamp);
+    rgdi_pjl_printf(buf, "@PJL SET FILENAME=Document");
+    rgdi_pjl_printf(buf, "@PJL SET COMPRESS=JBIG");
+    rgdi_pjl_printf(buf, "@PJL SET USERNAME=%s", user);
+    rgdi_pjl_printf(buf, "@PJL SET COVER=OFF");
+    rgdi_pjl_printf(buf, "@PJL SET HOLD=OFF");
+}
+
+void rgdi_pjl_page_header(rgdi_buffer_t *buf, const rgdi_page_info_t *info,
+                          size_t imagelen)
+{
+    rgdi_pjl_printf(buf, "@PJL SET PAGESTATUS=START");
+    rgdi_pjl_printf(buf, "@PJL SET COPIES=1");
+    rgdi_pjl_printf(buf, "@PJL SET MEDIASOURCE=%s", info->mediasource);
+    rgdi_pjl_printf(buf, "@PJL SET MEDIATYPE=PLAINRECYCLE");
+    rgdi_pjl_printf(buf, "@PJL SET PAPER=%s", info->paper);
+    rgdi_pjl_printf(buf, "@PJL SET PAPERWIDTH=%u", info->width);
+    rgdi_pjl_printf(buf, "@PJL SET PAPERLENGTH=%u", info->height);
+    rgdi_pjl_printf(buf, "@PJL SET RESOLUTION=%d", info->resolution);
+    rgdi_pjl_printf(buf, "@PJL SET IMAGELEN=%zu", imagelen);
+}
+
+void rgdi_pjl_page_footer(rgdi_buffer_t *buf, unsigned long dots)
+{
+    rgdi_pjl_printf(buf, "@PJL SET DOTCOUNT=%lu", dots);
+    rgdi_pjl_printf(buf, "@PJL SET PAGESTATUS=END");
+}
+
+void rgdi_pjl_job_footer(rgdi_buffer_t *buf)
+{
+    rgdi_pjl_printf(buf, "@PJL EOJ");
+    rgdi_pjl_puts(buf, "\033%-12345X");
+}
+
+rgdi_page_t *rgdi_page_new(unsigned char *jbig, size_t jbig_size)
+{
+    rgdi_page_t *page = calloc(1, sizeof(*page));
+    if (!page) {
+        gdi_log(LOG_ERR, "rastertericoh: memory allocation failed");
+        return NULL;
+    }
+    page->jbig = jbig;
+    page->jbig_size = jbig_size;
+    return page;
+}
+
+void rgdi_page_free(rgdi_page_t *page)
+{
+    if (!page) return;
+    free(page->head.data);
+    free(page->jbig);
+    free(page->tail.data);
+    free(page);
+}
@@ -0,0 +1,403 @@
+/*
+ * libricohgdi - Ricoh SP100/SP200 family GDI output (PJL + JBIG1)
+ *
+ * The pieces of rastertericoh as a library, so that other programs can
+ * convert pages in-process: CUPS raster and PBM/PGM ingest, adaptation
+ * of the page to the printer's resolution and paper, overlays, N-up
+ * imposition, JBIG encoding with the printer's parameters (optionally
+ * through the page and stripe caches), PJL framing, and output sinks
+ * with a writer thread that sends one page while the caller prepares
+ * the next.
+ *
+ * Typical use:
+ *
+ *   rgdi_sink_t *sink = rgdi_sink_memory();
+ *   rgdi_encoder_t enc = RGDI_ENCODER_INIT;
+ *   unsigned char *jbig = rgdi_encode(&enc, bitmap, width, height, &len);
+ *   rgdi_page_t *page = rgdi_page_new(jbig, len);
+ *   rgdi_pjl_job_header(&page->head, timestamp, user);
+ *   rgdi_pjl_page_header(&page->head, &info, len);
+ *   rgdi_pjl_page_footer(&page->tail, enc.dots);
+ *   rgdi_sink_write_page(sink, page);
+ */
+
+#ifndef RICOHGDI_H
+#define RICOHGDI_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <cups/cups.h>
+#include <cups/raster.h>
+#include "pagecache.h"
+#include "jbigstripe.h"
+#include "gditrace.h"
+#include "gdilog.h"
+#include "gdibitmap.h"
+#include "gditext.h"
+
+/* The printer's resolution; 300 and 1200 dpi rasters are scaled to it */
+#define RGDI_RESOLUTION 600
+
+/* A page this many pixels (1/32 inch) or less off its paper's size is
+ * sent as it is rather than cropped or padded */
+#define RGDI_FIT_SLACK 18
+
+/* Lines per JBIG stripe, as in the original driver */
+#define RGDI_STRIPE_LINES 72
+
+/* Encoder settings, described for the page cache key */
+#define RGDI_PROFILE       "jbg order=HITOLO|SEQ options=TPBON l0=72 mx=0"
+#define RGDI_PROFILE_SDRST "jbg order=HITOLO|SEQ options=TPBON l0=72 mx=0 SDRST"
+
+/* Timestamp written in fixed-timestamp mode without SOURCE_DATE_EPOCH */
+#define RGDI_FIXED_TIMESTAMP "2000/01/01 00:00:00"
+
+/* Default port for raw (JetDirect-style) socket printing */
+#define RGDI_RAW_SOCKET_PORT "9100"
+
+/* Conversion daemon (ricohgdid). A filter connects to this Unix socket
+ * and sends a request of newline-terminated lines ended by an empty
+ * line: "JOB", queue, job id, user and the option string, with the
+ * raster input and the output fd attached (SCM_RIGHTS). The daemon
+ * answers "OK <pages> <earlier>" or "ERR <pages> <reason>" when the
+ * job is done; earlier counts the jobs ahead of it in the same PJL job.
+ * A request of just "METRICS" returns the daemon's metrics as text. */
+#define RGDI_DAEMON_SOCKET "/var/run/ricohgdid.sock"
+
+/* Growable byte buffer */
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    int failed;             /* an allocation failed, contents are incomplete */
+} rgdi_buffer_t;
+
+int rgdi_buffer_append(rgdi_buffer_t *buf, const void *data, size_t len);
+void rgdi_buffer_free(rgdi_buffer_t *buf);
+
+/*
+ * Page ingest
+ */
+
+/* Convert one raster line as described by header into a packed 1-bit
+ * line of (cupsWidth + 7) / 8 bytes */
+void rgdi_pack_line(const cups_page_header2_t *header, const unsigned char *line,
+                    unsigned char *dst);
+
+/* Read one CUPS raster page into a packed 1-bit bitmap (1 = black).
+ * 8-bit grayscale is thresholded at 128. */
+unsigned char *rgdi_raster_to_pbm(cups_page_header2_t *header,
+                                  cups_raster_t *ras,
+                                  unsigned int *out_width,
+                                  unsigned int *out_height,
+                                  size_t *out_size);
+
+/* PBM (P1, P4) and PGM (P2, P5) input, one page per image; images may
+ * follow each other in the stream. Paper and resolution are the job's
+ * (rgdi_job_header_from_options), since the formats carry neither. */
+typedef struct {
+    int fd;
+    size_t pos, len;
+    unsigned char buf[4096];
+} rgdi_pnm_t;
+
+void rgdi_pnm_open(rgdi_pnm_t *pnm, int fd);
+
+/* Read the next image into a packed bitmap, setting the header's size
+ * and depth. P4 rows are read straight into the bitmap, which is the
+ * same layout; P5 is thresholded at half its maxval as 8-bit raster
+ * is; the plain P1 and P2 are parsed into the same. Returns 1, 0 at
+ * the end of the stream, or -1 (logged) for an unsupported, malformed
+ * or short image or if memory runs out. */
+int rgdi_pnm_read(rgdi_pnm_t *pnm, cups_page_header2_t *header, unsigned char **pbm,
+                  unsigned int *width, unsigned int *height, size_t *size);
+
+/* Start over from the beginning of the file, for the next copy; -1 if
+ * it cannot seek */
+int rgdi_pnm_rewind(rgdi_pnm_t *pnm);
+
+/* The raster header settings a job's own options stand for, for input
+ * that is not raster: the paper from PageSize (or media), HWResolution
+ * from Resolution (300dpi, 600dpi or 1200dpi) and the manual feed slot
+ * from InputSlot */
+void rgdi_job_header_from_options(cups_page_header2_t *header, int num_options,
+                                  cups_option_t *options);
+
+/* Plain text defaults: characters and lines per inch, margins in points */
+#define RGDI_TEXT_CPI    10
+#define RGDI_TEXT_LPI    6
+#define RGDI_TEXT_MARGIN 36
+
+/* Layout for text/plain input from PageSize (or media), cpi, lpi,
+ * page-left, page-right, page-top, page-bottom and wrap=false, and the
+ * raster header its pages stand in for, as rgdi_job_header_from_options()
+ * but always at 600 dpi */
+void rgdi_text_from_options(gdi_text_layout_t *layout, cups_page_header2_t *header,
+                            int num_options, cups_option_t *options);
+
+/*
+ * Page adaptation, between ingest and encode
+ */
+
+/* Page ranges an option can list, as in ricoh-transform-pages=1,3-5 */
+#define RGDI_MAX_RANGES 16
+
+typedef struct {
+    int majority;       /* 1200 dpi: black if 2 of 4 pixels are, not any */
+    int fit;            /* crop or pad to the paper size (default) */
+    int rotate;         /* 0, 90, 180 or 270 degrees clockwise */
+    int mirror;         /* flip left to right */
+    int parity;         /* rotate/mirror odd pages (1), even pages (2), or all */
+    int nranges;        /* else pages in these ranges, if any */
+    struct { int first, last; } ranges[RGDI_MAX_RANGES];
+} rgdi_adapt_t;
+
+#define RGDI_ADAPT_INIT { 0, 1, 0, 0, 0, 0, { { 0, 0 } } }
+
+/* ricoh-downsample=majority, ricoh-fit=off, ricoh-rotate=90|180|270,
+ * ricoh-mirror=on and ricoh-transform-pages=odd|even|<list> */
+void rgdi_adapt_from_options(rgdi_adapt_t *adapt, int num_options, cups_option_t *options);
+
+/* Bring a page read from a raster with this header to the printer: 300
+ * and 1200 dpi are scaled to 600, the page is rotated and mirrored if
+ * asked for page number page (from 1), and a page that does not match
+ * its paper is cropped or padded around its centre. *pbm is replaced
+ * (and the old one freed) when anything changed. Returns -1, with the
+ * page left as it was, if memory runs out. */
+int rgdi_adapt_page(const rgdi_adapt_t *adapt, const cups_page_header2_t *header,
+                    int page, unsigned char **pbm, unsigned int *width,
+                    unsigned int *height, size_t *size);
+
+/*
+ * Overlays, after adaptation
+ */
+
+/* Where overlays are looked up by name, as <name>.pbm; readable from
+ * the CUPS sandbox. RICOH_GDI_OVERLAYS in the environment overrides it. */
+#define RGDI_OVERLAY_DIR "/Library/Printers/Ricoh/overlays"
+
+#define RGDI_MAX_OVERLAYS 8
+
+/* Raw (P4) PBM files mapped for the job, drawn from the page's top
+ * left corner, so an overlay made at the paper's size at 600 dpi lines
+ * up with the fitted page */
+typedef struct {
+    int count;
+    struct {
+        const unsigned char *bits;  /* the PBM's rows, in the mapping */
+        unsigned int width, height;
+        int knockout;               /* clear to white rather than draw */
+        void *map;
+        size_t map_size;
+    } layers[RGDI_MAX_OVERLAYS];
+} rgdi_overlays_t;
+
+/* Map the overlays named in ricoh-overlay=<name>[,<name>...] and
+ * ricoh-overlay-knockout=<name>[,...]. Names are letters, digits, '-',
+ * '_' and '.', not starting with '.'; ones that cannot be loaded are
+ * logged and left out. */
+void rgdi_overlays_from_options(rgdi_overlays_t *overlays, int num_options,
+                                cups_option_t *options);
+
+/* Knockouts first, then the rest, in the order given */
+void rgdi_overlays_apply(const rgdi_overlays_t *overlays, unsigned char *pbm,
+                         unsigned int width, unsigned int height);
+
+void rgdi_overlays_free(rgdi_overlays_t *overlays);
+
+/*
+ * N-up imposition, after adaptation
+ */
+
+/* Width in pixels of the frame ricoh-number-up-border=on draws around
+ * each page (1/150 inch) */
+#define RGDI_NUP_BORDER 4
+
+typedef struct {
+    int number_up;              /* pages per sheet: 1 (off), 2 or 4 */
+    int border;                 /* frame each page */
+    int majority;               /* halve as ricoh-downsample=majority does */
+    unsigned char *sheet;       /* being filled, NULL between sheets */
+    unsigned int width, height;
+    int placed;                 /* pages on it so far */
+    cups_page_header2_t header; /* of its first page, for the PJL settings */
+} rgdi_nup_t;
+
+/* ricoh-number-up=2|4 and ricoh-number-up-border=on */
+void rgdi_nup_from_options(rgdi_nup_t *nup, int num_options, cups_option_t *options);
+
+/* Halve an adapted page and put it in the next cell of the sheet, which
+ * is started at the size of its first page: two cells across the
+ * longer side, pages turned to fit them, or a 2x2 grid. Only the sheet
+ * is kept, so pbm can be freed straight away. Returns 1 when the sheet
+ * is full, 0 while it has room, -1 if memory runs out. */
+int rgdi_nup_add(rgdi_nup_t *nup, const cups_page_header2_t *header,
+                 const unsigned char *pbm, unsigned int width, unsigned int height);
+
+/* Hand over the sheet, full or not (at the end of the job), with the
+ * header of its first page; NULL if no page has been added since */
+unsigned char *rgdi_nup_take(rgdi_nup_t *nup, cups_page_header2_t *header,
+                             unsigned int *width, unsigned int *height, size_t *size);
+
+/* Drop a sheet still being filled, as on cancel */
+void rgdi_nup_free(rgdi_nup_t *nup);
+
+/*
+ * JBIG encode
+ */
+
+/* Compress a packed bitmap with the printer's JBIG parameters */
+unsigned char *rgdi_pbm_to_jbig(const unsigned char *pbm,
+                                unsigned int width,
+                                unsigned int height,
+                                size_t *out_size);
+
+/* Encoder state for rgdi_encode(). All members are optional. */
+typedef struct {
+    page_cache_t *page_cache;       /* reuse whole pages across jobs */
+    stripe_cache_t *stripe_cache;   /* reuse stripes; implies SDRST */
+    int sdrst;                      /* independent stripes without a cache */
+    pthread_mutex_t *page_cache_lock;   /* for caches shared between threads */
+    pthread_mutex_t *stripe_cache_lock;
+    const volatile sig_atomic_t *cancel;    /* give up between stripes once set */
+    jbig_guard_t guard;             /* limits in, per-page outcome out;
+                                       not applied with SDRST stripes */
+    int from_cache;                 /* set by rgdi_encode(): page cache hit */
+    unsigned long dots;             /* and the page's black pixels */
+    unsigned int page_hits;
+} rgdi_encoder_t;
+
+#define RGDI_ENCODER_INIT { NULL, NULL, 0, NULL, NULL, NULL, { 0, 0, 0, 0, 0, 0 }, 0, 0, 0 }
+
+/* Size budget of the latency guard: a stripe coding to more than this
+ * share of its raw bytes is noise, not content worth its cost */
+#define RGDI_GUARD_MAX_RATIO 0.5
+
+/* Set up the guard from the ricoh-page-budget=<ms> job option */
+void rgdi_guard_from_options(rgdi_encoder_t *enc, int num_options, cups_option_t *options);
+
+/* Compress a page, consulting the caches configured in enc. Returns a
+ * malloc'd BIE, or NULL on failure or cancellation. */
+unsigned char *rgdi_encode(rgdi_encoder_t *enc, const unsigned char *pbm,
+                           unsigned int width, unsigned int height,
+                           size_t *out_size);
+
+/*
+ * PJL framing
+ */
+
+/* Per-page PJL settings */
+typedef struct {
+    const char *paper;          /* PJL paper name */
+    const char *mediasource;    /* TRAY1 or MANUALFEED */
+    unsigned int width;
+    unsigned int height;
+    int resolution;
+} rgdi_page_info_t;
+
+/* Map CUPS page size name to PJL paper name */
+const char *rgdi_cups_to_pjl_paper(const char *cups_size);
+
+/* Fill in page settings from a raster page header; width and height
+ * are those of the page after rgdi_adapt_page() */
+void rgdi_page_info_from_header(rgdi_page_info_t *info,
+                                const cups_page_header2_t *header,
+                                unsigned int width, unsigned int height);
+
+/* True for boolean job options given as on/true/yes */
+int rgdi_option_enabled(const char *name, int num_options, cups_option_t *options);
+
+/* gdi_bitmap_despeckle() level from ricoh-despeckle: 1 for "pixels",
+ * 2 for on (pixels and pairs), 0 if off */
+int rgdi_despeckle_from_options(int num_options, cups_option_t *options);
+
+/* PJL TIMESTAMP value. In fixed mode it comes from SOURCE_DATE_EPOCH
+ * (UTC) or a constant, so a job's output depends only on its input. */
+void rgdi_pjl_timestamp(char *buf, size_t size, int fixed);
+
+/* Append a PJL line with CR+LF ending, or raw text */
+void rgdi_pjl_printf(rgdi_buffer_t *buf, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void rgdi_pjl_puts(rgdi_buffer_t *buf, const char *text);
+
+void rgdi_pjl_job_header(rgdi_buffer_t *buf, const char *timestamp, const char *user);
+void rgdi_pjl_page_header(rgdi_buffer_t *buf, const rgdi_page_info_t *info,
+                          size_t imagelen);
+/* dots is the page's black pixel count, as the printer's toner gauge
+ * expects in DOTCOUNT */
+void rgdi_pjl_page_footer(rgdi_buffer_t *buf, unsigned long dots);
+void rgdi_pjl_job_footer(rgdi_buffer_t *buf);
+
+/* One unit of output: PJL lines, JBIG data, PJL lines */
+typedef struct {
+    rgdi_buffer_t head;
+    unsigned char *jbig;
+    size_t jbig_size;
+    rgdi_buffer_t tail;
+} rgdi_page_t;
+
+/* New page owning jbig (which may be NULL for pure PJL output) */
+rgdi_page_t *rgdi_page_new(unsigned char *jbig, size_t jbig_size);
+void rgdi_page_free(rgdi_page_t *page);
+
+/*
+ * Output sinks
+ */
+
+typedef struct rgdi_sink rgdi_sink_t;
+
+/* Callback sink function: returns 0, or -1 with errno set */
+typedef int (*rgdi_sink_fn)(void *ctx, const void *data, size_t len);
+
+rgdi_sink_t *rgdi_sink_fd(int fd);                 /* fd stays open */
+/* host[:port]; blocks while the printer is busy or unreachable, until
+ * *cancel is set (cancel may be NULL) */
+rgdi_sink_t *rgdi_sink_socket(const char *address, const volatile sig_atomic_t *cancel);
+rgdi_sink_t *rgdi_sink_memory(void);
+rgdi_sink_t *rgdi_sink_callback(rgdi_sink_fn fn, void *ctx);
+
+/* Write all of iov; returns 0, or -1 with errno set */
+int rgdi_sink_write(rgdi_sink_t *sink, struct iovec *iov, int iovcnt);
+int rgdi_sink_write_page(rgdi_sink_t *sink, const rgdi_page_t *page);
+
+/* Data collected by a memory sink; NULL for other sinks */
+const unsigned char *rgdi_sink_memory_data(const rgdi_sink_t *sink, size_t *len);
+
+/* Flush and release; a socket sink waits for the printer to close */
+void rgdi_sink_close(rgdi_sink_t *sink);
+
+/* The same for a cancelled job, which has ended its PJL job already:
+ * the printer gets at most RGDI_CANCEL_DRAIN_MS to close */
+#define RGDI_CANCEL_DRAIN_MS 500
+void rgdi_sink_close_cancelled(rgdi_sink_t *sink);
+
+/* Writer thread: sends finished pages while the caller works on the
+ * next one. At most one page waits behind the one being sent. */
+typedef struct {
+    rgdi_sink_t *sink;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    rgdi_page_t *pending;   /* handed over, not yet picked up */
+    int busy;               /* a page is being written */
+    int done;               /* no more pages will be submitted */
+    int failed;             /* a write failed, errno saved in error */
+    int error;
+} rgdi_writer_t;
+
+int rgdi_writer_start(rgdi_writer_t *w, rgdi_sink_t *sink);
+/* Takes ownership of page; returns -1 once a write has failed */
+int rgdi_writer_submit(rgdi_writer_t *w, rgdi_page_t *page);
+/* Wait until the pages submitted so far are written, keeping the
+ * writer open; returns -1 if any write failed */
+int rgdi_writer_sync(rgdi_writer_t *w);
+/* Drop the page waiting behind the one being written, if any, and
+ * return how many were dropped. A page already being written is always
+ * completed, so the printer gets the IMAGELEN bytes it was promised. */
+int rgdi_writer_cancel(rgdi_writer_t *w);
+/* Wait for all submitted pages; returns -1 if any write failed */
+int rgdi_writer_finish(rgdi_writer_t *w);
+
+#endif
@@ -0,0 +1,1421 @@
+/*
+ * ricohgdid - persistent conversion daemon for rastertericoh
+ *
+ * Filters started with ricoh-daemon=on hand their raster input and
+ * output fds to this daemon over a Unix socket instead of converting
+ * in-process. Pages of all jobs are compressed on one worker pool;
+ * workers take pages from the queues round-robin, so a long job on one
+ * queue cannot hold up the others. The page cache and per-queue stripe
+ * caches stay warm between jobs.
+ *
+ * In raw socket mode the daemon owns the printer connection, and with
+ * ricoh-coalesce=<ms> it keeps the PJL job open that long after a job
+ * ends: a following job for the same queue and paper joins it, with its
+ * own USERNAME line, instead of paying for another job start. With
+ * ricoh-lookahead=on a job's pages are spooled for the printer instead,
+ * in memory and then in $TMPDIR up to the -a and -A budgets, and the
+ * filter is told the job is done once it is converted: CUPS starts the
+ * next job, which is converted while the printer still prints this one.
+ *
+ * Only the CUPS group may connect: a client picks the printer address
+ * and spools on the daemon's disk, so the socket is not for every user.
+ *
+ * Usage: ricohgdid [-s socket] [-g group] [-w workers] [-c cache-dir]
+ *                  [-C cache-MB] [-a spool-memory-MB] [-A spool-disk-MB]
+ *        ricohgdid [-s socket] -m      (print a running daemon's metrics)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <grp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <cups/cups.h>
+#include <cups/raster.h>
+#include "ricohgdi.h"
+
+/* Pages of one job on the pool at a time, unless limited by the job
+ * (cupsInteger0 = minimum, cupsInteger1 = maximum, from the PPD's
+ * RicohWorkers option) or by RICOH_GDI_MIN_WORKERS and
+ * RICOH_GDI_MAX_WORKERS in the daemon's environment */
+#define RASTER_MIN_WORKERS 0
+#define RASTER_MAX_WORKERS 1
+#define JOB_START_WINDOW   2
+
+/* Waits shorter than this are noise, not a bottleneck */
+#define CONTROL_THRESHOLD_SECS 0.005
+
+/* Stripe cache memory per queue; a full cache is emptied at the start of
+ * the next job, so the daemon keeps up with changing letterheads */
+#define QUEUE_STRIPE_BYTES (16 * 1024 * 1024)
+
+/* Samples kept for page latency percentiles and pages/s */
+#define LATENCY_SAMPLES 1024
+#define RATE_WINDOW_SECS 60
+
+#define PAGE_CACHE_SIZE_MB 64
+
+/* Look-ahead spool budgets (-a, -A): converted pages not yet printed
+ * are kept in memory up to the first, then in files up to the second;
+ * beyond both, conversion waits for the printer */
+#define SPOOL_MEMORY_MB 64
+#define SPOOL_DISK_MB   512
+
+/* Group the CUPS filters run as (Group in cups-files.conf) */
+#ifdef __APPLE__
+#define DAEMON_GROUP "_lp"
+#else
+#define DAEMON_GROUP "lp"
+#endif
+
+typedef struct queue queue_t;
+
+/* One page waiting for or undergoing compression */
+typedef struct task {
+    struct task *next;          /* in the queue's FIFO */
+    struct task *job_next;      /* in the job's in-flight list */
+    rgdi_encoder_t enc;
+    unsigned char *pbm;
+    unsigned int width, height;
+    size_t pbm_size;
+    rgdi_page_info_t info;
+    unsigned char *jbig;
+    size_t jbig_size;
+    double submitted;
+    int done;
+} task_t;
+
+struct queue {
+    queue_t *next;
+    char name[128];
+    task_t *head, *tail;
+    unsigned int depth;         /* tasks waiting for a worker */
+    unsigned int active_jobs;
+    unsigned int window;        /* sum of its active jobs' windows */
+    unsigned long jobs, pages;
+    stripe_cache_t stripes;
+    unsigned long stripe_hits;  /* of caches already reset, for the metrics */
+    pthread_mutex_t stripe_lock;
+};
+
+/* A printer connection kept open between jobs, so that short jobs that
+ * follow each other go out as one PJL job (ricoh-coalesce) */
+typedef struct link {
+    struct link *next;
+    char key[512];              /* queue and printer address */
+    char paper[32];
+    char mediasource[32];
+    rgdi_sink_t *sink;
+    rgdi_writer_t writer;
+    int busy;                   /* a job is writing, or it is connecting */
+    unsigned int jobs;          /* jobs in the current PJL job */
+    double expires;             /* when idle: time to end the PJL job */
+} link_t;
+
+/* A page converted ahead of the printer (ricoh-lookahead) */
+typedef struct spool_page {
+    struct spool_page *next;
+    rgdi_page_info_t info;
+    unsigned long dots;
+    unsigned char *jbig;        /* NULL when in the job's spool file */
+    off_t offset;
+    size_t jbig_size;
+} spool_page_t;
+
+/* A job's pages, in order, as they are converted */
+typedef struct spool_job {
+    struct spool_job *next;
+    char id[32], user[128], timestamp[64];
+    double window;              /* ricoh-coalesce, in seconds */
+    int fd;                     /* unlinked spool file, or -1 */
+    off_t file_size;
+    spool_page_t *head, *tail;
+    int complete;
+    volatile sig_atomic_t cancelled;    /* unsent pages are dropped */
+} spool_job_t;
+
+/* Jobs for one printer, sent in turn by its feeder thread */
+typedef struct spool {
+    struct spool *next;
+    char queue[128], address[256];
+    spool_job_t *head, *tail;
+    int feeding;
+} spool_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* a task was queued */
+    pthread_cond_t done;        /* a task was finished */
+    pthread_cond_t links_changed;
+    pthread_cond_t spooled;     /* a page was spooled, or a job completed */
+    link_t *links;
+    spool_t *spools;
+    size_t spool_memory, spool_disk, spool_memory_max, spool_disk_max;
+    const char *spool_dir;
+    queue_t *queues;
+    queue_t *cursor;            /* queue served last */
+    unsigned int workers;
+    page_cache_t cache;
+    int use_cache;
+    pthread_mutex_t cache_lock;
+    int min_window, max_window;     /* defaults from the environment */
+    long cpus;
+    double started;
+    unsigned long jobs_total, jobs_failed, pages_total, pages_guarded;
+    unsigned int jobs_active;
+    double latency[LATENCY_SAMPLES];
+    double finished[LATENCY_SAMPLES];
+    unsigned long samples;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .links_changed = PTHREAD_COND_INITIALIZER,
+    .spooled = PTHREAD_COND_INITIALIZER,
+    .cache_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Per-job concurrency controller. After every page it compares the
+ * time the job waited for compression (workers are the bottleneck, so
+ * widen the window) with the time it waited for the writer (the printer
+ * is, so compressing further ahead only takes CPU from other queues),
+ * and caps the window when the load average says the machine is busy. */
+typedef struct {
+    int min, max;
+    int window;
+    unsigned int raised, lowered;
+} controller_t;
+
+static void controller_init(controller_t *c, const cups_page_header2_t *header)
+{
+    c->min = pool.min_window;
+    c->max = pool.max_window;
+    if (header->cupsInteger[RASTER_MIN_WORKERS] > 0)
+        c->min = header->cupsInteger[RASTER_MIN_WORKERS];
+    if (header->cupsInteger[RASTER_MAX_WORKERS] > 0)
+        c->max = header->cupsInteger[RASTER_MAX_WORKERS];
+    if (c->max > (int)pool.workers) c->max = pool.workers;
+    if (c->min > c->max) c->min = c->max;
+    if (c->min < 1) c->min = 1;
+    c->window = JOB_START_WINDOW < c->min ? c->min :
+                JOB_START_WINDOW > c->max ? c->max : JOB_START_WINDOW;
+    c->raised = c->lowered = 0;
+}
+
+static void controller_update(controller_t *c, double starved, double stalled)
+{
+    int cap = c->max;
+    double load;
+
+    /* Share the CPUs with everything else that is runnable */
+    if (getloadavg(&load, 1) == 1 && load > pool.cpus) {
+        int fair = (int)(c->max * pool.cpus / load);
+        if (fair < cap) cap = fair;
+    }
+
+    if (stalled > starved && stalled > CONTROL_THRESHOLD_SECS) {
+        c->window--;
+        c->lowered++;
+    } else if (starved > CONTROL_THRESHOLD_SECS) {
+        c->window++;
+        c->raised++;
+    }
+    if (c->window > cap) c->window = cap;
+    if (c->window < c->min) c->window = c->min;
+}
+
+/* Find or create a queue; called with pool.lock held */
+static queue_t *queue_get(const char *name)
+{
+    queue_t *q;
+    for (q = pool.queues; q; q = q->next)
+        if (strcmp(q->name, name) == 0)
+            return q;
+
+    q = calloc(1, sizeof(*q));
+    if (!q) return NULL;
+    snprintf(q->name, sizeof(q->name), "%s", name);
+    stripe_cache_init(&q->stripes, QUEUE_STRIPE_BYTES, NULL);
+    pthread_mutex_init(&q->stripe_lock, NULL);
+    q->next = pool.queues;
+    pool.queues = q;
+    return q;
+}
+
+/* Next task, taking queues in turn after the one served last; called
+ * with pool.lock held */
+static task_t *next_task(void)
+{
+    queue_t *start = pool.cursor && pool.cursor->next ? pool.cursor->next : pool.queues;
+    queue_t *q = start;
+
+    if (!q) return NULL;
+    do {
+        if (q->head) {
+            task_t *t = q->head;
+            q->head = t->next;
+            if (!q->head) q->tail = NULL;
+            q->depth--;
+            pool.cursor = q;
+            return t;
+        }
+        q = q->next ? q->next : pool.queues;
+    } while (q != start);
+    return NULL;
+}
+
+static void *worker_main(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        task_t *t;
+        while (!(t = next_task()))
+            pthread_cond_wait(&pool.work, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        t->jbig = rgdi_encode(&t->enc, t->pbm, t->width, t->height, &t->jbig_size);
+        free(t->pbm);
+        t->pbm = NULL;
+
+        double finished = now_secs();
+        pthread_mutex_lock(&pool.lock);
+        unsigned long i = pool.samples++ % LATENCY_SAMPLES;
+        pool.latency[i] = finished - t->submitted;
+        pool.finished[i] = finished;
+        pool.pages_total++;
+        t->done = 1;
+        pthread_cond_broadcast(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+static void submit_task(queue_t *q, task_t *t)
+{
+    pthread_mutex_lock(&pool.lock);
+    t->submitted = now_secs();
+    if (q->tail) q->tail->next = t;
+    else q->head = t;
+    q->tail = t;
+    q->depth++;
+    pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void wait_task(task_t *t)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (!t->done)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* A request received from a filter */
+typedef struct {
+    int client;
+    char *lines[5];             /* JOB, queue, job id, user, options */
+    int nlines;
+    int fds[2];                 /* raster input, output */
+    int nfds;
+    char buf[8192];
+} request_t;
+
+/* A JOB request has five lines, the option string possibly empty,
+ * before its empty line; other requests just the one */
+static int request_complete(const char *buf, size_t len)
+{
+    int expect = strncmp(buf, "JOB\n", len < 4 ? len : 4) == 0 ? 5 : 1;
+    int lines = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != '\n') continue;
+        if (lines == expect) return 1;
+        lines++;
+    }
+    return 0;
+}
+
+/* Read a request up to its empty line, collecting any passed fds */
+static int read_request(request_t *req)
+{
+    size_t got = 0;
+
+    req->nfds = 0;
+    for (;;) {
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(2 * sizeof(int))];
+        } control;
+        struct iovec iov = { req->buf + got, sizeof(req->buf) - 1 - got };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t n = recvmsg(req->client, &msg, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *fds = (int *)CMSG_DATA(c);
+            for (int i = 0; i < count; i++) {
+                if (req->nfds < 2) req->fds[req->nfds++] = fds[i];
+                else close(fds[i]);
+            }
+        }
+
+        got += n;
+        req->buf[got] = '\0';
+        if (request_complete(req->buf, got)) break;
+        if (got >= sizeof(req->buf) - 1) return -1;
+    }
+
+    char *p = req->buf;
+    int expect = strncmp(req->buf, "JOB\n", 4) == 0 ? 5 : 1;
+    for (req->nlines = 0; req->nlines < expect; req->nlines++) {
+        req->lines[req->nlines] = p;
+        p = strchr(p, '\n');
+        *p++ = '\0';
+    }
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Metrics in the Prometheus text format */
+static void send_metrics(int client)
+{
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    double sorted[LATENCY_SAMPLES];
+    if (!out) return;
+
+    pthread_mutex_lock(&pool.lock);
+    double now = now_secs();
+    unsigned long n = pool.samples < LATENCY_SAMPLES ? pool.samples : LATENCY_SAMPLES;
+    unsigned long recent = 0;
+    for (unsigned long i = 0; i < n; i++) {
+        sorted[i] = pool.latency[i];
+        if (now - pool.finished[i] <= RATE_WINDOW_SECS) recent++;
+    }
+    double window = now - pool.started < RATE_WINDOW_SECS ? now - pool.started
+                                                          : RATE_WINDOW_SECS;
+
+    fprintf(out, "ricohgdid_uptime_seconds %.0f\n", now - pool.started);
+    fprintf(out, "ricohgdid_workers %u\n", pool.workers);
+    fprintf(out, "ricohgdid_jobs_active %u\n", pool.jobs_active);
+    fprintf(out, "ricohgdid_jobs_total %lu\n", pool.jobs_total);
+    fprintf(out, "ricohgdid_jobs_failed_total %lu\n", pool.jobs_failed);
+    fprintf(out, "ricohgdid_pages_total %lu\n", pool.pages_total);
+    fprintf(out, "ricohgdid_pages_per_second %.2f\n", window > 0 ? recent / window : 0.0);
+    fprintf(out, "ricohgdid_pages_guarded_total %lu\n", pool.pages_guarded);
+    fprintf(out, "ricohgdid_spool_bytes{where=\"memory\"} %zu\n", pool.spool_memory);
+    fprintf(out, "ricohgdid_spool_bytes{where=\"disk\"} %zu\n", pool.spool_disk);
+    for (spool_t *sp = pool.spools; sp; sp = sp->next) {
+        unsigned int jobs = 0;
+        for (spool_job_t *j = sp->head; j; j = j->next) jobs++;
+        fprintf(out, "ricohgdid_spool_jobs{queue=\"%s\"} %u\n", sp->queue, jobs);
+    }
+    for (queue_t *q = pool.queues; q; q = q->next) {
+        fprintf(out, "ricohgdid_queue_depth{queue=\"%s\"} %u\n", q->name, q->depth);
+        fprintf(out, "ricohgdid_queue_jobs_active{queue=\"%s\"} %u\n", q->name, q->active_jobs);
+        fprintf(out, "ricohgdid_queue_window{queue=\"%s\"} %u\n", q->name, q->window);
+        fprintf(out, "ricohgdid_queue_jobs_total{queue=\"%s\"} %lu\n", q->name, q->jobs);
+        fprintf(out, "ricohgdid_queue_pages_total{queue=\"%s\"} %lu\n", q->name, q->pages);
+        pthread_mutex_lock(&q->stripe_lock);
+        unsigned long stripe_hits = q->stripe_hits + q->stripes.hits;
+        pthread_mutex_unlock(&q->stripe_lock);
+        fprintf(out, "ricohgdid_queue_stripe_hits_total{queue=\"%s\"} %lu\n",
+                q->name, stripe_hits);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (pool.use_cache) {
+        pthread_mutex_lock(&pool.cache_lock);
+        fprintf(out, "ricohgdid_page_cache_hits_total %u\n", pool.cache.hits);
+        pthread_mutex_unlock(&pool.cache_lock);
+    }
+
+    /* Time from a page being read to its compression finishing */
+    if (n > 0) {
+        static const double quantiles[] = { 0.5, 0.9, 0.99 };
+        qsort(sorted, n, sizeof(*sorted), cmp_double);
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(*quantiles); i++)
+            fprintf(out, "ricohgdid_page_latency_seconds{quantile=\"%g\"} %.4f\n",
+                    quantiles[i], sorted[(size_t)(quantiles[i] * (n - 1))]);
+        fprintf(out, "ricohgdid_page_latency_seconds_max %.4f\n", sorted[n - 1]);
+    }
+    fclose(out);
+
+    for (size_t off = 0; off < size; ) {
+        ssize_t w = write(client, text + off, size - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        off += w;
+    }
+    free(text);
+}
+
+/* End the PJL job on a link and disconnect */
+static void link_close(link_t *l, int failed)
+{
+    if (!failed) {
+        rgdi_page_t *footer = rgdi_page_new(NULL, 0);
+        if (footer) {
+            rgdi_pjl_job_footer(&footer->head);
+            rgdi_writer_submit(&l->writer, footer);
+        }
+    }
+    rgdi_writer_finish(&l->writer);
+    rgdi_sink_close(l->sink);
+    syslog(LOG_INFO, "printer job on %s ended after %u job(s)",
+           strchr(l->key, '\n') + 1, l->jobs);
+    free(l);
+}
+
+/* Unlink l from the list; called with pool.lock held */
+static void link_remove(link_t *l)
+{
+    for (link_t **p = &pool.links; *p; p = &(*p)->next) {
+        if (*p == l) {
+            *p = l->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&pool.links_changed);
+}
+
+/* Get the link for a queue and printer, joining the PJL job still open
+ * on it if the paper matches, or connecting anew; NULL once *cancel is
+ * set while waiting for the link or the printer */
+static link_t *link_acquire(const char *queue, const char *address,
+                            const rgdi_page_info_t *info,
+                            const volatile sig_atomic_t *cancel)
+{
+    char key[512];
+    link_t *l;
+
+    snprintf(key, sizeof(key), "%s\n%s", queue, address);
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        for (l = pool.links; l; l = l->next)
+            if (strcmp(l->key, key) == 0)
+                break;
+        if (!l || !l->busy) break;
+        if (*cancel) {
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        pthread_cond_wait(&pool.links_changed, &pool.lock);
+    }
+    /* A link past its window is over even if the reaper has not got
+     * to it yet */
+    if (l && (l->expires <= now_secs() || strcmp(l->paper, info->paper) != 0 ||
+              strcmp(l->mediasource, info->mediasource) != 0)) {
+        link_remove(l);
+        pthread_mutex_unlock(&pool.lock);
+        link_close(l, 0);
+        pthread_mutex_lock(&pool.lock);
+        l = NULL;
+    }
+    if (l) {
+        l->busy = 1;
+        l->jobs++;
+        pthread_mutex_unlock(&pool.lock);
+        return l;
+    }
+
+    /* Listed while connecting, so other jobs for it wait for us */
+    l = calloc(1, sizeof(*l));
+    if (!l) {
+        pthread_mutex_unlock(&pool.lock);
+        return NULL;
+    }
+    snprintf(l->key, sizeof(l->key), "%s", key);
+    snprintf(l->paper, sizeof(l->paper), "%s", info->paper);
+    snprintf(l->mediasource, sizeof(l->mediasource), "%s", info->mediasource);
+    l->busy = 1;
+    l->jobs = 1;
+    l->next = pool.links;
+    pool.links = l;
+    pthread_mutex_unlock(&pool.lock);
+
+    l->sink = rgdi_sink_socket(address, cancel);
+    if (!l->sink || rgdi_writer_start(&l->writer, l->sink) < 0) {
+        rgdi_sink_close(l->sink);
+        pthread_mutex_lock(&pool.lock);
+        link_remove(l);
+        pthread_mutex_unlock(&pool.lock);
+        free(l);
+        return NULL;
+    }
+    return l;
+}
+
+/* Done with a link: keep it open for window seconds, or drop it */
+static void link_release(link_t *l, int failed, double window)
+{
+    pthread_mutex_lock(&pool.lock);
+    if (failed) {
+        link_remove(l);
+        pthread_mutex_unlock(&pool.lock);
+        link_close(l, 1);
+        return;
+    }
+    l->busy = 0;
+    l->expires = now_secs() + window;
+    pthread_cond_broadcast(&pool.links_changed);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Ends the PJL job on links that stayed idle past their window */
+static void *reaper_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        double now = now_secs(), next = 0;
+        link_t *expired = NULL;
+        for (link_t *l = pool.links; l; l = l->next) {
+            if (l->busy) continue;
+            if (l->expires <= now) {
+                expired = l;
+                break;
+            }
+            if (next == 0 || l->expires < next)
+                next = l->expires;
+        }
+        if (expired) {
+            link_remove(expired);
+            pthread_mutex_unlock(&pool.lock);
+            link_close(expired, 0);
+            pthread_mutex_lock(&pool.lock);
+            continue;
+        }
+
+        if (next == 0) {
+            pthread_cond_wait(&pool.links_changed, &pool.lock);
+        } else {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            double wait = next - now;
+            until.tv_sec += (time_t)wait;
+            until.tv_nsec += (long)((wait - (time_t)wait) * 1e9);
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&pool.links_changed, &pool.lock, &until);
+        }
+    }
+    return NULL;
+}
+
+/* Pass a finished page to the writer, framed like the filter does;
+ * the writer takes jbig */
+static int emit_page(rgdi_writer_t *writer, unsigned char *jbig, size_t jbig_size,
+                     const rgdi_page_info_t *info, unsigned long dots, int job_header,
+                     int user_header, const char *timestamp, const char *user)
+{
+    rgdi_page_t *page = rgdi_page_new(jbig, jbig_size);
+    if (!page) {
+        free(jbig);
+        return 0;
+    }
+    if (job_header)
+        rgdi_pjl_job_header(&page->head, timestamp, user);
+    else if (user_header)
+        rgdi_pjl_printf(&page->head, "@PJL SET USERNAME=%s", user);
+    rgdi_pjl_page_header(&page->head, info, jbig_size);
+    rgdi_pjl_page_footer(&page->tail, dots);
+    return rgdi_writer_submit(writer, page);
+}
+
+/* Watches a job's connection while it runs. The filter writes CANCEL
+ * when CUPS cancels the job, and a filter that goes away cancels it too. */
+typedef struct {
+    int client;
+    pthread_t thread;
+    volatile sig_atomic_t cancel;
+    volatile sig_atomic_t finished;
+} watch_t;
+
+static void *watch_main(void *arg)
+{
+    watch_t *w = arg;
+    char buf[64];
+    ssize_t n;
+
+    do
+        n = read(w->client, buf, sizeof(buf));
+    while (n < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&pool.lock);
+    if (!w->finished) {
+        w->cancel = 1;
+        /* Wake the job if it is waiting for a page or a link */
+        pthread_cond_broadcast(&pool.done);
+        pthread_cond_broadcast(&pool.links_changed);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void watch_stop(watch_t *w, int watching)
+{
+    if (!watching) return;
+    pthread_mutex_lock(&pool.lock);
+    w->finished = 1;
+    pthread_mutex_unlock(&pool.lock);
+    shutdown(w->client, SHUT_RD);
+    pthread_join(w->thread, NULL);
+}
+
+/* Send a printer's spooled jobs in turn, each page as soon as it is
+ * converted, through the same links as jobs printed directly */
+static void *feeder_main(void *arg)
+{
+    spool_t *s = arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while (s->head) {
+        spool_job_t *j = s->head;
+        link_t *link = NULL;
+        unsigned int earlier = 0;
+        int sent = 0, failed = 0;
+
+        for (;;) {
+            while (!j->head && !j->complete)
+                pthread_cond_wait(&pool.spooled, &pool.lock);
+            spool_page_t *p = j->head;
+            if (!p) break;
+            j->head = p->next;
+            if (!j->head) j->tail = NULL;
+            int cancelled = j->cancelled;
+            pthread_mutex_unlock(&pool.lock);
+
+            unsigned char *jbig = p->jbig;
+            if (!jbig && !cancelled && !failed) {
+                jbig = malloc(p->jbig_size ? p->jbig_size : 1);
+                if (!jbig || pread(j->fd, jbig, p->jbig_size, p->offset) !=
+                                 (ssize_t)p->jbig_size) {
+                    syslog(LOG_ERR, "job %s: cannot read back a spooled page", j->id);
+                    free(jbig);
+                    jbig = NULL;
+                    failed = 1;
+                }
+            }
+            if (cancelled || failed) {
+                free(jbig);
+            } else {
+                if (!link) {
+                    link = link_acquire(s->queue, s->address, &p->info, &j->cancelled);
+                    if (link) earlier = link->jobs - 1;
+                }
+                if (!link || emit_page(&link->writer, jbig, p->jbig_size, &p->info, p->dots,
+                                       sent == 0 && earlier == 0, sent == 0,
+                                       j->timestamp, j->user) < 0)
+                    failed = 1;
+                else
+                    sent++;
+            }
+
+            pthread_mutex_lock(&pool.lock);
+            if (p->jbig) pool.spool_memory -= p->jbig_size;
+            pthread_cond_broadcast(&pool.done);
+            free(p);
+        }
+        s->head = j->next;
+        if (!s->head) s->tail = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (link) {
+            if (rgdi_writer_sync(&link->writer) < 0)
+                failed = 1;
+            link_release(link, failed, j->window);
+        }
+        if (failed)
+            syslog(LOG_ERR, "job %s on %s: printing failed after %d page(s), after the "
+                   "job was reported done", j->id, s->queue, sent);
+        else
+            syslog(LOG_INFO, "job %s on %s: %d spooled page(s) printed%s", j->id, s->queue,
+                   sent, j->cancelled ? ", rest cancelled" : "");
+        if (j->fd >= 0) close(j->fd);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.spool_disk -= (size_t)j->file_size;
+        pthread_cond_broadcast(&pool.done);
+        free(j);
+    }
+    s->feeding = 0;
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/* Queue a job for the printer at queue and address, ahead of its pages,
+ * so jobs print in the order they start; NULL if memory runs out */
+static spool_job_t *spool_start(const char *queue, const char *address,
+                                const char *id, const char *user, double window)
+{
+    spool_job_t *j = calloc(1, sizeof(*j));
+    if (!j) return NULL;
+    snprintf(j->id, sizeof(j->id), "%s", id);
+    snprintf(j->user, sizeof(j->user), "%s", user);
+    j->window = window;
+    j->fd = -1;
+
+    pthread_mutex_lock(&pool.lock);
+    spool_t *s;
+    for (s = pool.spools; s; s = s->next)
+        if (strcmp(s->queue, queue) == 0 && strcmp(s->address, address) == 0)
+            break;
+    if (!s && (s = calloc(1, sizeof(*s)))) {
+        snprintf(s->queue, sizeof(s->queue), "%s", queue);
+        snprintf(s->address, sizeof(s->address), "%s", address);
+        s->next = pool.spools;
+        pool.spools = s;
+    }
+    if (!s) {
+        pthread_mutex_unlock(&pool.lock);
+        free(j);
+        return NULL;
+    }
+    if (s->tail) s->tail->next = j;
+    else s->head = j;
+    s->tail = j;
+    if (!s->feeding) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, feeder_main, s) == 0) {
+            pthread_detach(thread);
+            s->feeding = 1;
+        } else {
+            syslog(LOG_ERR, "cannot start feeder thread for %s", queue);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return j;
+}
+
+/* An unlinked file in the spool directory, gone when it is closed */
+static int spool_file(void)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/ricohgdid-spool-XXXXXX", pool.spool_dir);
+    int fd = mkstemp(path);
+    if (fd >= 0) unlink(path);
+    return fd;
+}
+
+/* Hand a compressed page to the job's spool, waiting while both budgets
+ * are used up; a page always fits an empty memory budget. Takes
+ * t->jbig. Returns -1 if cancelled meanwhile or the page cannot be
+ * stored. */
+static int spool_add(spool_job_t *j, task_t *t, volatile sig_atomic_t *cancel)
+{
+    spool_page_t *p = calloc(1, sizeof(*p));
+    int in_memory = 0;
+    if (!p) {
+        free(t->jbig);
+        return -1;
+    }
+    p->info = t->info;
+    p->dots = t->enc.dots;
+    p->jbig_size = t->jbig_size;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        if (*cancel) break;
+        if (pool.spool_memory == 0 ||
+            pool.spool_memory + p->jbig_size <= pool.spool_memory_max) {
+            pool.spool_memory += p->jbig_size;
+            in_memory = 1;
+            break;
+        }
+        if (pool.spool_disk + p->jbig_size <= pool.spool_disk_max) {
+            pool.spool_disk += p->jbig_size;
+            break;
+        }
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (*cancel) {
+        free(t->jbig);
+        free(p);
+        return -1;
+    }
+
+    if (in_memory) {
+        p->jbig = t->jbig;
+    } else {
+        if (j->fd < 0) j->fd = spool_file();
+        ssize_t n = j->fd < 0 ? -1 : pwrite(j->fd, t->jbig, p->jbig_size, j->file_size);
+        free(t->jbig);
+        pthread_mutex_lock(&pool.lock);
+        if (n != (ssize_t)p->jbig_size) {
+            /* The file only counts for what it holds */
+            pool.spool_disk -= p->jbig_size;
+            pthread_mutex_unlock(&pool.lock);
+            syslog(LOG_ERR, "job %s: cannot spool a page in %s: %s", j->id,
+                   pool.spool_dir, strerror(errno));
+            free(p);
+            return -1;
+        }
+        p->offset = j->file_size;
+        j->file_size += (off_t)p->jbig_size;
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (j->tail) j->tail->next = p;
+    else j->head = p;
+    j->tail = p;
+    pthread_cond_broadcast(&pool.spooled);
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+/* No more pages; those not yet sent of a cancelled job are dropped */
+static void spool_finish(spool_job_t *j, int cancelled)
+{
+    pthread_mutex_lock(&pool.lock);
+    j->complete = 1;
+    j->cancelled = cancelled;
+    pthread_cond_broadcast(&pool.spooled);
+    pthread_cond_broadcast(&pool.links_changed);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Convert one job; the reply tells the filter how it went */
+static void run_job(request_t *req, char *reply, size_t reply_size)
+{
+    const char *queue_name = req->lines[1];
+    const char *job_id = req->lines[2];
+    const char *user = req->lines[3];
+    cups_option_t *options = NULL;
+    int num_options = cupsParseOptions(req->lines[4], 0, &options);
+    int page_count = 0, write_failed = 0;
+    rgdi_writer_t own_writer, *writer = NULL;
+    rgdi_sink_t *sink = NULL;
+    link_t *link = NULL;
+    unsigned int earlier_jobs = 0;
+    watch_t watch = { req->client, 0, 0, 0 };
+
+    cups_raster_t *ras = cupsRasterOpen(req->fds[0], CUPS_RASTER_READ);
+    if (!ras) {
+        snprintf(reply, reply_size, "ERR 0 cannot open raster stream\n");
+        cupsFreeOptions(num_options, options);
+        return;
+    }
+    int watching = pthread_create(&watch.thread, NULL, watch_main, &watch) == 0;
+
+    /* Short jobs can share one PJL job only where we own the printer
+     * connection; with CUPS backends every job has its own pipe */
+    const char *socket_address = cupsGetOption("ricoh-socket", num_options, options);
+    const char *coalesce_opt = cupsGetOption("ricoh-coalesce", num_options, options);
+    double window = coalesce_opt ? atol(coalesce_opt) / 1000.0 : 0;
+    if (window > 0 && !(socket_address && *socket_address)) {
+        syslog(LOG_INFO, "job %s: ricoh-coalesce needs ricoh-socket, ignored", job_id);
+        window = 0;
+    }
+
+    /* Spooling ahead of the printer needs the printer connection too:
+     * a CUPS backend only runs once the filter is done */
+    spool_job_t *spooled = NULL;
+    if (rgdi_option_enabled("ricoh-lookahead", num_options, options)) {
+        if (!(socket_address && *socket_address))
+            syslog(LOG_INFO, "job %s: ricoh-lookahead needs ricoh-socket, ignored", job_id);
+        else if (!(spooled = spool_start(queue_name, socket_address, job_id, user, window)))
+            syslog(LOG_WARNING, "job %s: cannot spool, printing directly", job_id);
+    }
+
+    if (window <= 0 && !spooled) {
+        if (socket_address && *socket_address)
+            sink = rgdi_sink_socket(socket_address, &watch.cancel);
+        else
+            sink = rgdi_sink_fd(req->fds[1]);
+        if (!sink || rgdi_writer_start(&own_writer, sink) < 0) {
+            snprintf(reply, reply_size, watch.cancel ? "ERR 0 cancelled\n"
+                                                     : "ERR 0 cannot open output\n");
+            watch_stop(&watch, watching);
+            rgdi_sink_close(sink);
+            cupsRasterClose(ras);
+            cupsFreeOptions(num_options, options);
+            return;
+        }
+        writer = &own_writer;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    queue_t *q = queue_get(queue_name);
+    if (q) {
+        q->active_jobs++;
+        q->jobs++;
+    }
+    pool.jobs_active++;
+    pool.jobs_total++;
+    pthread_mutex_unlock(&pool.lock);
+    if (!q) {
+        snprintf(reply, reply_size, "ERR 0 out of memory\n");
+        if (spooled) spool_finish(spooled, 1);
+        watch_stop(&watch, watching);
+        if (writer) rgdi_writer_finish(writer);
+        rgdi_sink_close(sink);
+        cupsRasterClose(ras);
+        cupsFreeOptions(num_options, options);
+        return;
+    }
+
+    rgdi_encoder_t enc = RGDI_ENCODER_INIT;
+    enc.cancel = &watch.cancel;
+    if (pool.use_cache && rgdi_option_enabled("ricoh-cache", num_options, options)) {
+        enc.page_cache = &pool.cache;
+        enc.page_cache_lock = &pool.cache_lock;
+    }
+    if (rgdi_option_enabled("ricoh-stripe-cache", num_options, options)) {
+        pthread_mutex_lock(&q->stripe_lock);
+        if (q->stripes.bytes >= q->stripes.max_bytes * 9 / 10) {
+            q->stripe_hits += q->stripes.hits;
+            stripe_cache_free(&q->stripes);
+            stripe_cache_init(&q->stripes, QUEUE_STRIPE_BYTES, NULL);
+        }
+        pthread_mutex_unlock(&q->stripe_lock);
+        enc.stripe_cache = &q->stripes;
+        enc.stripe_cache_lock = &q->stripe_lock;
+    }
+    rgdi_guard_from_options(&enc, num_options, options);
+    rgdi_adapt_t adapt = RGDI_ADAPT_INIT;
+    rgdi_adapt_from_options(&adapt, num_options, options);
+    rgdi_overlays_t overlays;
+    rgdi_overlays_from_options(&overlays, num_options, options);
+    rgdi_nup_t nup;
+    rgdi_nup_from_options(&nup, num_options, options);
+    int toner_save = rgdi_option_enabled("ricoh-toner-save", num_options, options);
+    int despeckle = rgdi_despeckle_from_options(num_options, options);
+    unsigned long despeckled = 0;
+
+    char timestamp[64];
+    rgdi_pjl_timestamp(timestamp, sizeof(timestamp),
+                       rgdi_option_enabled("ricoh-fixed-timestamp", num_options, options));
+    if (spooled) {
+        pthread_mutex_lock(&pool.lock);
+        snprintf(spooled->timestamp, sizeof(spooled->timestamp), "%s", timestamp);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    syslog(LOG_INFO, "job %s on %s for %s%s", job_id, queue_name, user,
+           spooled ? ", spooled" : "");
+
+    /* Pages are read in order, compressed on the pool up to the
+     * controller's window at a time, and written in order as they finish */
+    task_t *first = NULL, *last = NULL;
+    int inflight = 0, reading = 1, window_set = 0, pages_read = 0;
+    controller_t ctl = { 1, 1, 1, 0, 0 };
+    cups_page_header2_t header;
+    while (reading || first) {
+        if (watch.cancel || write_failed)
+            reading = 0;
+        if (reading && inflight < ctl.window) {
+            unsigned char *pbm;
+            unsigned int width, height;
+            size_t pbm_size;
+            if (!cupsRasterReadHeader2(ras, &header)) {
+                /* A partly filled N-up sheet is the job's last page */
+                reading = 0;
+                if (!(pbm = rgdi_nup_take(&nup, &header, &width, &height, &pbm_size)))
+                    continue;
+            } else {
+                if (header.cupsBytesPerLine == 0 || header.cupsHeight == 0)
+                    continue;
+                if (!window_set) {
+                    controller_init(&ctl, &header);
+                    window_set = 1;
+                    pthread_mutex_lock(&pool.lock);
+                    q->window += ctl.window;
+                    pthread_mutex_unlock(&pool.lock);
+                }
+
+                pbm = rgdi_raster_to_pbm(&header, ras, &width, &height, &pbm_size);
+                if (!pbm)
+                    continue;
+                if (rgdi_adapt_page(&adapt, &header, ++pages_read, &pbm, &width,
+                                    &height, &pbm_size) < 0) {
+                    syslog(LOG_ERR, "job %s: failed to adapt a page", job_id);
+                    free(pbm);
+                    continue;
+                }
+                rgdi_overlays_apply(&overlays, pbm, width, height);
+                if (nup.number_up > 1) {
+                    int full = rgdi_nup_add(&nup, &header, pbm, width, height);
+                    free(pbm);
+                    if (full < 0)
+                        syslog(LOG_ERR, "job %s: failed to impose a page", job_id);
+                    if (full <= 0)
+                        continue;
+                    pbm = rgdi_nup_take(&nup, &header, &width, &height, &pbm_size);
+                }
+            }
+
+            if (despeckle) {
+                long removed = gdi_bitmap_despeckle(pbm, width, height, despeckle);
+                if (removed > 0) despeckled += removed;
+            }
+            if (toner_save && gdi_bitmap_thin(pbm, width, height) < 0)
+                syslog(LOG_WARNING, "job %s: out of memory for toner saving", job_id);
+
+            task_t *t = calloc(1, sizeof(*t));
+            if (!t) {
+                free(pbm);
+                reading = 0;
+                continue;
+            }
+            t->pbm = pbm;
+            t->width = width;
+            t->height = height;
+            t->pbm_size = pbm_size;
+            rgdi_page_info_from_header(&t->info, &header, t->width, t->height);
+            t->enc = enc;
+            if (last) last->job_next = t;
+            else first = t;
+            last = t;
+            inflight++;
+            submit_task(q, t);
+            continue;
+        }
+
+        if (!first)
+            continue;           /* stopped with nothing in flight */
+        task_t *t = first;
+        first = t->job_next;
+        if (!first) last = NULL;
+        inflight--;
+        double waited = now_secs();
+        wait_task(t);
+        double starved = now_secs() - waited;
+
+        if (watch.cancel) {
+            free(t->jbig);
+            free(t);
+            continue;
+        }
+        if (!t->jbig) {
+            syslog(LOG_ERR, "job %s: failed to JBIG-compress a page", job_id);
+            free(t);
+            continue;
+        }
+        if (t->enc.guard.tripped) {
+            syslog(LOG_WARNING, "job %s: page %d: stripe %lu over budget (%zu bytes, "
+                   "%.1f ms into the page), dithered the rest of the page", job_id,
+                   page_count + 1, t->enc.guard.stripe + 1,
+                   t->enc.guard.stripe_bytes, t->enc.guard.elapsed_ms);
+            pthread_mutex_lock(&pool.lock);
+            pool.pages_guarded++;
+            pthread_mutex_unlock(&pool.lock);
+        }
+        if (!write_failed && !writer && !spooled) {
+            link = link_acquire(queue_name, socket_address, &t->info, &watch.cancel);
+            if (link) {
+                writer = &link->writer;
+                earlier_jobs = link->jobs - 1;
+            } else {
+                write_failed = 1;
+            }
+        }
+        double stalled = now_secs();
+        if (write_failed) {
+            free(t->jbig);
+        } else if (spooled ? spool_add(spooled, t, &watch.cancel) < 0
+                           : emit_page(writer, t->jbig, t->jbig_size, &t->info, t->enc.dots,
+                                       page_count == 0 && earlier_jobs == 0,
+                                       page_count == 0, timestamp, user) < 0) {
+            write_failed = 1;
+        } else {
+            page_count++;
+        }
+        stalled = now_secs() - stalled;
+        free(t);
+
+        int before = ctl.window;
+        controller_update(&ctl, starved, stalled);
+        if (ctl.window != before) {
+            pthread_mutex_lock(&pool.lock);
+            q->window += ctl.window - before;
+            pthread_mutex_unlock(&pool.lock);
+        }
+    }
+    if (despeckle)
+        syslog(LOG_INFO, "job %s: despeckling removed %lu pixel(s)", job_id, despeckled);
+    if (window_set)
+        syslog(LOG_INFO, "job %s: %d-%d worker(s), window raised %u and lowered %u "
+               "time(s), ended at %d", job_id, ctl.min, ctl.max, ctl.raised,
+               ctl.lowered, ctl.window);
+
+    if (spooled) {
+        /* Done once converted; the feeder prints the rest */
+        spool_finish(spooled, watch.cancel || write_failed);
+    } else if (link) {
+        /* The PJL job stays open for the next job; ours is done once
+         * its pages are written */
+        if (rgdi_writer_sync(writer) < 0)
+            write_failed = 1;
+        link_release(link, write_failed, window);
+    } else if (sink) {
+        /* As in the filter: drop the waiting page, end the PJL job */
+        if (watch.cancel)
+            page_count -= rgdi_writer_cancel(writer);
+        if (page_count > 0 && !write_failed) {
+            rgdi_page_t *footer = rgdi_page_new(NULL, 0);
+            if (footer) {
+                rgdi_pjl_job_footer(&footer->head);
+                if (rgdi_writer_submit(writer, footer) < 0)
+                    write_failed = 1;
+            }
+        }
+        if (rgdi_writer_finish(writer) < 0)
+            write_failed = 1;
+        if (watch.cancel)
+            rgdi_sink_close_cancelled(sink);
+        else
+            rgdi_sink_close(sink);
+    }
+    watch_stop(&watch, watching);
+    rgdi_nup_free(&nup);
+    rgdi_overlays_free(&overlays);
+    cupsRasterClose(ras);
+    cupsFreeOptions(num_options, options);
+
+    pthread_mutex_lock(&pool.lock);
+    q->active_jobs--;
+    if (window_set) q->window -= ctl.window;
+    q->pages += page_count;
+    pool.jobs_active--;
+    if (write_failed || page_count == 0) pool.jobs_failed++;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (watch.cancel)
+        snprintf(reply, reply_size, "ERR %d cancelled\n", page_count);
+    else if (write_failed)
+        snprintf(reply, reply_size, "ERR %d write failed\n", page_count);
+    else
+        snprintf(reply, reply_size, "OK %d %u\n", page_count, earlier_jobs);
+    syslog(LOG_INFO, "job %s on %s: %s%s", job_id, queue_name,
+           watch.cancel ? "cancelled" : write_failed ? "aborted" : "complete",
+           watch.cancel || write_failed ? ""
+           : spooled ? ", pages spooled for the printer"
+           : earlier_jobs ? ", joined an open printer job" : "");
+}
+
+static void *client_main(void *arg)
+{
+    request_t *req = arg;
+    char reply[128];
+
+    if (read_request(req) == 0) {
+        if (req->nlines >= 1 && strcmp(req->lines[0], "METRICS") == 0) {
+            send_metrics(req->client);
+        } else if (req->nlines == 5 && strcmp(req->lines[0], "JOB") == 0 &&
+                   req->nfds == 2) {
+            run_job(req, reply, sizeof(reply));
+            if (write(req->client, reply, strlen(reply)) < 0)
+                syslog(LOG_WARNING, "cannot reply to filter: %s", strerror(errno));
+        } else {
+            syslog(LOG_WARNING, "malformed request");
+        }
+    }
+
+    for (int i = 0; i < req->nfds; i++)
+        close(req->fds[i]);
+    close(req->client);
+    free(req);
+    return NULL;
+}
+
+static int connect_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* -m: print the metrics of a running daemon */
+static int print_metrics(const char *path)
+{
+    char buf[4096];
+    ssize_t n;
+    int fd = connect_socket(path);
+    if (fd < 0) {
+        fprintf(stderr, "ricohgdid: cannot connect to %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (write(fd, "METRICS\n\n", 9) != 9) {
+        close(fd);
+        return 1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, n, stdout);
+    close(fd);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: ricohgdid [-s socket] [-g group] [-w workers] [-c cache-dir]\n"
+                    "                [-C cache-MB] [-a spool-memory-MB] [-A spool-disk-MB]\n"
+                    "       ricohgdid [-s socket] -m\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = RGDI_DAEMON_SOCKET;
+    const char *group = DAEMON_GROUP;
+    const char *cache_dir = NULL;
+    long cache_mb = PAGE_CACHE_SIZE_MB;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    long spool_memory_mb = SPOOL_MEMORY_MB, spool_disk_mb = SPOOL_DISK_MB;
+    int metrics = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:g:w:c:C:a:A:m")) != -1) {
+        switch (opt) {
+        case 's': path = optarg; break;
+        case 'g': group = optarg; break;
+        case 'w': workers = atol(optarg); break;
+        case 'c': cache_dir = optarg; break;
+        case 'C': cache_mb = atol(optarg); break;
+        case 'a': spool_memory_mb = atol(optarg); break;
+        case 'A': spool_disk_mb = atol(optarg); break;
+        case 'm': metrics = 1; break;
+        default: usage();
+        }
+    }
+    if (optind != argc) usage();
+    if (metrics) return print_metrics(path);
+    if (workers < 1) workers = 1;
+    pool.spool_memory_max = spool_memory_mb > 0 ? (size_t)spool_memory_mb << 20 : 0;
+    pool.spool_disk_max = spool_disk_mb > 0 ? (size_t)spool_disk_mb << 20 : 0;
+    pool.spool_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp";
+
+    const char *env_min = getenv("RICOH_GDI_MIN_WORKERS");
+    const char *env_max = getenv("RICOH_GDI_MAX_WORKERS");
+    pool.cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (pool.cpus < 1) pool.cpus = 1;
+    pool.min_window = env_min ? atoi(env_min) : 1;
+    pool.max_window = env_max ? atoi(env_max) : pool.cpus;
+    if (pool.max_window < 1) pool.max_window = 1;
+
+    openlog("ricohgdid", LOG_PID | LOG_PERROR, LOG_LPR);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path) >=
+        (int)sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "socket path too long: %s", path);
+        return 1;
+    }
+
+    /* Replace a socket left behind by a previous run, but not a live one */
+    int probe = connect_socket(path);
+    if (probe >= 0) {
+        syslog(LOG_ERR, "another daemon is listening on %s", path);
+        close(probe);
+        return 1;
+    }
+    unlink(path);
+
+    /* Filters run as the unprivileged CUPS user; the socket is theirs
+     * and ours only, from the moment it exists */
+    struct group *gr = getgrnam(group);
+    if (!gr) {
+        syslog(LOG_ERR, "no group %s for the socket (use -g)", group);
+        return 1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0117);
+    int bound = listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || chown(path, (uid_t)-1, gr->gr_gid) < 0 || listen(listener, 64) < 0) {
+        syslog(LOG_ERR, "cannot listen on %s: %s", path, strerror(errno));
+        if (bound) unlink(path);
+        return 1;
+    }
+
+    if (cache_dir && cache_mb > 0)
+        pool.use_cache = page_cache_open(&pool.cache, cache_dir, (off_t)cache_mb << 20) == 0;
+
+    pool.started = now_secs();
+    pool.workers = workers;
+    pthread_t reaper;
+    if (pthread_create(&reaper, NULL, reaper_main, NULL) != 0) {
+        syslog(LOG_ERR, "cannot start reaper thread");
+        return 1;
+    }
+    pthread_detach(reaper);
+    for (long i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0) {
+            syslog(LOG_ERR, "cannot start worker thread");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    syslog(LOG_INFO, "listening on %s with %ld worker(s)%s", path, workers,
+           pool.use_cache ? ", page cache on" : "");
+
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                syslog(LOG_WARNING, "accept failed: %s", strerror(errno));
+            continue;
+        }
+        request_t *req = calloc(1, sizeof(*req));
+        pthread_t thread;
+        if (!req) {
+            close(client);
+            continue;
+        }
+        req->client = client;
+        if (pthread_create(&thread, NULL, client_main, req) != 0) {
+            close(client);
+            free(req);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}